@@ -16,13 +16,18 @@ typedef struct camera {
   float lens_radius;
 } camera;
 
+// Direction from the camera origin through the image plane at st
+static float3 pinhole_direction(__constant camera* c, const float2 st) {
+  return c->lower_left_corner + (c->horizontal * st.x) + (c->vertical * st.y) -
+         c->origin;
+}
+
 static ray get_ray(__constant camera* c, const float2 st,
                    unsigned int rand_state[1]) {
 #if USE_PINHOLE_CAMERA
   ray r;
   r.o = c->origin;
-  r.dir = c->lower_left_corner + (c->horizontal * st.x) + (c->vertical * st.y) -
-          c->origin;
+  r.dir = pinhole_direction(c, st);
   return r;
 #else
   float3 ray_disk = c->lens_radius * random_unit_disk(rand_state);
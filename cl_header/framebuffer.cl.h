@@ -0,0 +1,128 @@
+#ifndef FRAMEBUFFER_CL
+#define FRAMEBUFFER_CL
+
+// Storage formats of the trace buffer, selected with SAMPLE_FORMAT. The
+// values match the host's SampleFormat.
+#define SAMPLE_FORMAT_FLOAT 0
+#define SAMPLE_FORMAT_PLANAR 1
+#define SAMPLE_FORMAT_HALF 2
+#define SAMPLE_FORMAT_RGBE 3
+
+#ifndef SAMPLE_FORMAT
+#define SAMPLE_FORMAT SAMPLE_FORMAT_FLOAT
+#endif
+
+#if SAMPLE_FORMAT == SAMPLE_FORMAT_HALF
+typedef half sample_t;
+#elif SAMPLE_FORMAT == SAMPLE_FORMAT_RGBE
+typedef uint sample_t;
+#else
+typedef float sample_t;
+#endif
+
+// Elements in one color plane of the planar formats
+#define SAMPLE_PLANE ((size_t)WIDTH * HEIGHT * SAMPLES)
+
+// Position of a sample in the trace buffer. The interleaved format keeps the
+// samples of a pixel together, while the others store each sample index as
+// an image so that neighbouring work items touch neighbouring elements.
+static size_t sample_slot(uint x, uint y, uint s) {
+#if SAMPLE_FORMAT == SAMPLE_FORMAT_FLOAT
+  return ((size_t)y * WIDTH + x) * SAMPLES + s;
+#else
+  return ((size_t)s * HEIGHT + y) * WIDTH + x;
+#endif
+}
+
+#if SAMPLE_FORMAT == SAMPLE_FORMAT_RGBE
+// Greg Ward's shared exponent encoding: an 8-bit mantissa per channel scaled
+// by the exponent of the brightest one, in the low to high bytes
+static uint encode_rgbe(float3 color) {
+  const float brightest = fmax(color.x, fmax(color.y, color.z));
+  if (!(brightest > 1e-32f)) {
+    return 0u;
+  }
+  int exponent;
+  const float scale = frexp(brightest, &exponent) * 256.0f / brightest;
+  const uint3 mantissa = convert_uint3_sat(color * scale);
+  return mantissa.x | (mantissa.y << 8) | (mantissa.z << 16) |
+         ((uint)(exponent + 128) << 24);
+}
+
+// Decodes to the middle of the quantization step, halving the error
+static float3 decode_rgbe(uint rgbe) {
+  const int exponent = (int)(rgbe >> 24);
+  if (exponent == 0) {
+    return (float3)(0.0f, 0.0f, 0.0f);
+  }
+  const float3 mantissa = convert_float3((uint3)(
+      rgbe & 0xFFu, (rgbe >> 8) & 0xFFu, (rgbe >> 16) & 0xFFu));
+  return (mantissa + 0.5f) * ldexp(1.0f, exponent - (128 + 8));
+}
+#endif
+
+static void store_sample(__global sample_t* buffer, uint x, uint y, uint s,
+                         float3 color) {
+  const size_t i = sample_slot(x, y, s);
+#if SAMPLE_FORMAT == SAMPLE_FORMAT_FLOAT
+  buffer[i * 3] = color.x;
+  buffer[i * 3 + 1] = color.y;
+  buffer[i * 3 + 2] = color.z;
+#elif SAMPLE_FORMAT == SAMPLE_FORMAT_PLANAR
+  buffer[i] = color.x;
+  buffer[i + SAMPLE_PLANE] = color.y;
+  buffer[i + 2 * SAMPLE_PLANE] = color.z;
+#elif SAMPLE_FORMAT == SAMPLE_FORMAT_HALF
+  vstore_half_rte(color.x, i, buffer);
+  vstore_half_rte(color.y, i + SAMPLE_PLANE, buffer);
+  vstore_half_rte(color.z, i + 2 * SAMPLE_PLANE, buffer);
+#else
+  buffer[i] = encode_rgbe(color);
+#endif
+}
+
+static float3 load_sample(__global const sample_t* buffer, uint x, uint y,
+                          uint s) {
+  const size_t i = sample_slot(x, y, s);
+#if SAMPLE_FORMAT == SAMPLE_FORMAT_FLOAT
+  return (float3)(buffer[i * 3], buffer[i * 3 + 1], buffer[i * 3 + 2]);
+#elif SAMPLE_FORMAT == SAMPLE_FORMAT_PLANAR
+  return (float3)(buffer[i], buffer[i + SAMPLE_PLANE],
+                  buffer[i + 2 * SAMPLE_PLANE]);
+#elif SAMPLE_FORMAT == SAMPLE_FORMAT_HALF
+  return (float3)(vload_half(i, buffer), vload_half(i + SAMPLE_PLANE, buffer),
+                  vload_half(i + 2 * SAMPLE_PLANE, buffer));
+#else
+  return decode_rgbe(buffer[i]);
+#endif
+}
+
+// Writes a pixel's average color gamma corrected to 8 bits per channel
+static void store_rgb8(__global unsigned char* output, uint2 pixel,
+                       float3 color) {
+  color = sqrt(color);
+  const size_t i = ((size_t)WIDTH * pixel.y + pixel.x) * 3;
+  output[i] = (unsigned char)(255.99 * color.x);
+  output[i + 1] = (unsigned char)(255.99 * color.y);
+  output[i + 2] = (unsigned char)(255.99 * color.z);
+}
+
+// Writes a pixel's average color as linear floats
+static void store_linear(__global float* output, uint2 pixel, float3 color) {
+  const size_t i = ((size_t)WIDTH * pixel.y + pixel.x) * 3;
+  output[i] = color.x;
+  output[i + 1] = color.y;
+  output[i + 2] = color.z;
+}
+
+// Sum of the first count samples of a pixel
+static float3 sum_samples(__global const sample_t* buffer, uint x, uint y,
+                          uint count) {
+  float3 color = (float3)(0, 0, 0);
+  for (uint s = 0; s < count; ++s) {
+    color += load_sample(buffer, x, y, s);
+  }
+  return color;
+}
+
+#endif
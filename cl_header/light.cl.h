@@ -0,0 +1,64 @@
+#ifndef LIGHT_CL
+#define LIGHT_CL
+
+#include "sphere.cl.h"
+
+#ifdef NUM_LIGHTS
+// The host sorts emissive spheres to the front of the scene, so the first
+// NUM_LIGHTS spheres are the light list. Lights are sampled over the cone
+// they subtend from the shaded point, which is exact for spheres.
+
+// One minus the cosine of the half angle of the cone a light subtends from p,
+// or zero from inside the light. Computed without the cancellation of
+// 1 - cos for small and distant lights.
+static float light_cone(SCENE_MEM sphere* light, float3 p) {
+  const float3 d = light->center - p;
+  const float sin2 = light->radius * light->radius / dot(d, d);
+  if (sin2 >= 1.0f) {
+    return 0.0f;
+  }
+  return sin2 / (1.0f + math_sqrt(1.0f - sin2));
+}
+
+// Solid angle density with which sample_light picks a direction from p
+// towards light, including the choice among the lights
+static float light_pdf(SCENE_MEM sphere* light, float3 p) {
+  const float cone = light_cone(light, p);
+  return cone > 0.0f ? 1.0f / (2.0f * M_PI_F * cone * NUM_LIGHTS) : 0.0f;
+}
+
+// Picks a light uniformly and a direction from p inside the cone it
+// subtends. Returns false if p is inside the light.
+static bool sample_light(SCENE_MEM sphere* spheres, float3 p,
+                         uint* rand_seed, int* light, float3* dir,
+                         float* pdf) {
+  *light = min((int)(rand(rand_seed) * NUM_LIGHTS), NUM_LIGHTS - 1);
+  const float cone = light_cone(&spheres[*light], p);
+  const float u = rand(rand_seed);
+  const float azimuth = 2.0f * M_PI_F * rand(rand_seed);
+  if (cone <= 0.0f) {
+    return false;
+  }
+
+  const float3 w = math_normalize(spheres[*light].center - p);
+  const float3 a = fabs(w.x) > 0.9f ? (float3)(0.0f, 1.0f, 0.0f)
+                                    : (float3)(1.0f, 0.0f, 0.0f);
+  const float3 t = math_normalize(cross(a, w));
+  const float3 b = cross(w, t);
+  const float cos_theta = 1.0f - u * cone;
+  const float sin_theta =
+      math_sqrt(fmax(0.0f, 1.0f - cos_theta * cos_theta));
+  *dir = (t * math_cos(azimuth) + b * math_sin(azimuth)) * sin_theta +
+         w * cos_theta;
+  *pdf = 1.0f / (2.0f * M_PI_F * cone * NUM_LIGHTS);
+  return true;
+}
+
+// Weight of a sample drawn with density a that could also have been drawn
+// with density b
+static float power_heuristic(float a, float b) {
+  return a * a / (a * a + b * b);
+}
+#endif
+
+#endif
@@ -20,8 +20,18 @@ typedef struct dielectric {
   float r_index;
 } dielectric;
 
+// EMISSIVE
+typedef struct emissive {
+  float3 emission;
+} emissive;
+
 // Base Material
-typedef enum material_type { LAMBERTIAN, METAL, DIELECTRIC } material_type;
+typedef enum material_type {
+  LAMBERTIAN,
+  METAL,
+  DIELECTRIC,
+  EMISSIVE
+} material_type;
 
 typedef struct material {
   material_type type;
@@ -29,15 +39,24 @@ typedef struct material {
     lambertian l;
     metal me;
     dielectric d;
+    emissive e;
   };
 } material;
 
+// Scenes that fit are read from constant memory, larger ones from global
+// memory
+#ifdef SCENE_IN_GLOBAL_MEMORY
+#define SCENE_MEM __global const
+#else
+#define SCENE_MEM __constant
+#endif
+
 // Hit Record
 typedef struct hit_record {
   float t;
   float3 p;
   float3 normal;
-  __constant material* m;
+  SCENE_MEM material* m;
 } hit_record;
 
 static bool lambertian_scatter(const hit_record* record, const ray* r,
@@ -60,7 +79,7 @@ static bool metal_scatter(const hit_record* record, const ray* r,
                           unsigned int rand_state[static 1]) {
   *attenuation = record->m->me.albedo;
 
-  float3 reflected = reflect(normalize(r->dir), record->normal);
+  float3 reflected = reflect(math_normalize(r->dir), record->normal);
 
   ray sc;
   sc.o = record->p;
@@ -111,7 +130,16 @@ static bool dielectric_scatter(const hit_record* record, const ray* r,
   return true;
 }
 
-// Returns the scattered ray
+// Light given off towards the ray that hit the surface. Lights only shine
+// from the outside.
+static float3 emitted(const hit_record* record, const ray* r) {
+  if (record->m->type == EMISSIVE && dot(r->dir, record->normal) < 0.0f) {
+    return record->m->e.emission;
+  }
+  return (float3)(0.0f, 0.0f, 0.0f);
+}
+
+// Returns the scattered ray, or false for surfaces that absorb the ray
 static bool scatter(const hit_record* record, const ray* r, float3* attenuation,
                     ray* scattered, unsigned int rand_state[static 1]) {
   switch (record->m->type) {
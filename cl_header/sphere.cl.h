@@ -9,32 +9,126 @@ typedef struct sphere {
   material m;
 } sphere;
 
-static bool hit(__constant sphere* s, const ray* r, float t_min, float t_max,
-                hit_record* record) {
-  float3 oc = r->o - s->center;
+// The host stores the spheres a second time after the scene, in batches of
+// SPHERE_BATCH: a float4 each of the x, y and z of their centers and of their
+// radii. A ray is tested against a whole batch with vector math. As a batch
+// holds four float4s, the batch of sphere i starts at float4 i. The last
+// batch is padded.
+#define SPHERE_BATCH 4
+
+static SCENE_MEM const float4* sphere_batches(SCENE_MEM sphere* s) {
+  return (SCENE_MEM const float4*)(s + NUM_SPHERES);
+}
+
+// Returns the nearest intersection of r with a sphere within (t_min, t_max)
+static bool intersect(float3 center, float radius, const ray* r, float t_min,
+                      float t_max, float* t) {
+  float3 oc = r->o - center;
   float a = dot(r->dir, r->dir);
-  float b = 2.0f * dot(oc, r->dir);
-  float c = dot(oc, oc) - s->radius * s->radius;
-  float discriminant = b * b - 4.0f * a * c;
+  float half_b = dot(oc, r->dir);
+  float c = dot(oc, oc) - radius * radius;
+  float discriminant = half_b * half_b - a * c;
 
   if (discriminant > 0.0f) {
-    float t_hit = (-b - sqrt(discriminant)) / (2.0f * a);
+    const float root = math_sqrt(discriminant);
+    float t_hit = (-half_b - root) / a;
     if (t_hit >= t_max || t_hit <= t_min) {
-      t_hit = (-b + sqrt(discriminant)) / (2.0f * a);
+      t_hit = (-half_b + root) / a;
     }
 
     if (t_hit < t_max && t_hit > t_min) {
-      record->t = t_hit;
-      record->p = point_at(r, t_hit);
-      record->normal = normalize((record->p - s->center) / s->radius);
-      record->m = &(s->m);
+      *t = t_hit;
       return true;
     }
   }
   return false;
 }
 
-static bool hit_spheres(__constant sphere* s, int num_spheres, const ray* r,
+static void set_record(SCENE_MEM sphere* s, const ray* r, float t,
+                       hit_record* record) {
+  record->t = t;
+  record->p = point_at(r, t);
+  record->normal = math_normalize((record->p - s->center) / s->radius);
+  record->m = &(s->m);
+}
+
+static bool hit(SCENE_MEM sphere* s, const ray* r, float t_min, float t_max,
+                hit_record* record) {
+  float t;
+  if (intersect(s->center, s->radius, r, t_min, t_max, &t)) {
+    set_record(s, r, t, record);
+    return true;
+  }
+  return false;
+}
+
+// Index in the scene of the sphere a record was hit on
+static int sphere_index(SCENE_MEM sphere* s, const hit_record* record) {
+  return (int)(((SCENE_MEM char*)record->m - (SCENE_MEM char*)&s[0].m) /
+               sizeof(sphere));
+}
+
+// Tests r against the batch of spheres first onwards, the same way as
+// intersect, and keeps the nearest hit of each lane in closest and
+// closest_index. Lanes past num_spheres are padding and never hit.
+static void intersect_batch(float4 x, float4 y, float4 z, float4 radius,
+                            int first, int num_spheres, const ray* r,
+                            float t_min, float4* closest,
+                            int4* closest_index) {
+  const float4 ocx = r->o.x - x;
+  const float4 ocy = r->o.y - y;
+  const float4 ocz = r->o.z - z;
+  const float a = dot(r->dir, r->dir);
+  const float4 half_b = ocx * r->dir.x + ocy * r->dir.y + ocz * r->dir.z;
+  const float4 c = ocx * ocx + ocy * ocy + ocz * ocz - radius * radius;
+  const float4 discriminant = half_b * half_b - a * c;
+  const float4 root = math_sqrt(fmax(discriminant, 0.0f));
+
+  const float4 t_near = (-half_b - root) / a;
+  const float4 t_far = (-half_b + root) / a;
+  const float4 t_low = (float4)(t_min);
+  const int4 near_in_range =
+      isgreater(t_near, t_low) & isless(t_near, *closest);
+  const float4 t = select(t_far, t_near, near_in_range);
+  const int4 lane = (int4)(first) + (int4)(0, 1, 2, 3);
+  const int4 found = isgreater(discriminant, (float4)(0.0f)) &
+                     isgreater(t, t_low) & isless(t, *closest) &
+                     (lane < (int4)(num_spheres));
+  *closest = select(*closest, t, found);
+  *closest_index = select(*closest_index, lane, found);
+}
+
+// Nearest of the lanes' hits, preferring the lower sphere index on ties like
+// a loop over the spheres in order would. Returns -1 if no lane hit.
+static int nearest_lane(float4 closest, int4 closest_index, float* t) {
+  const int2 upper = isless(closest.zw, closest.xy) |
+                     (isequal(closest.zw, closest.xy) &
+                      (closest_index.zw < closest_index.xy));
+  const float2 pair_t = select(closest.xy, closest.zw, upper);
+  const int2 pair_index = select(closest_index.xy, closest_index.zw, upper);
+  const bool second =
+      pair_t.y < pair_t.x ||
+      (pair_t.y == pair_t.x && pair_index.y < pair_index.x);
+  *t = second ? pair_t.y : pair_t.x;
+  return second ? pair_index.y : pair_index.x;
+}
+
+// Position, normal and material are only computed for the nearest hit
+static bool hit_nearest(SCENE_MEM sphere* s, float4 closest,
+                        int4 closest_index, const ray* r,
+                        hit_record* record) {
+  float t;
+  const int nearest = nearest_lane(closest, closest_index, &t);
+  if (nearest < 0) {
+    return false;
+  }
+  set_record(&s[nearest], r, t, record);
+  return true;
+}
+
+#ifdef SCALAR_SPHERES
+// One sphere at a time, kept to benchmark the batches against
+static bool hit_spheres(SCENE_MEM sphere* s, int num_spheres, const ray* r,
                         float t_min, float t_max, hit_record* record) {
   hit_record temp_rec;
   float closest = t_max;
@@ -48,5 +142,113 @@ static bool hit_spheres(__constant sphere* s, int num_spheres, const ray* r,
   }
   return hit_anything;
 }
+#else
+static bool hit_spheres(SCENE_MEM sphere* s, int num_spheres, const ray* r,
+                        float t_min, float t_max, hit_record* record) {
+  SCENE_MEM const float4* batches = sphere_batches(s);
+  float4 closest = (float4)(t_max);
+  int4 closest_index = (int4)(-1);
+  for (int first = 0; first < num_spheres; first += SPHERE_BATCH) {
+    SCENE_MEM const float4* batch = batches + first;
+    intersect_batch(batch[0], batch[1], batch[2], batch[3], first,
+                    num_spheres, r, t_min, &closest, &closest_index);
+  }
+  return hit_nearest(s, closest, closest_index, r, record);
+}
+#endif
+
+#ifdef SCENE_CACHE_SIZE
+static uint local_linear_id() {
+  return (get_local_id(2) * get_local_size(1) + get_local_id(1)) *
+             get_local_size(0) +
+         get_local_id(0);
+}
+
+// Whether any work item in the group passed active. Must be reached by every
+// work item of the group.
+static bool group_any(bool active, __local int* flag) {
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (local_linear_id() == 0) {
+    *flag = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (active) {
+    *flag = 1;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  return *flag != 0;
+}
+
+// Same result as hit_spheres, but the work group loads the spheres in chunks
+// of SCENE_CACHE_SIZE into cache, so each sphere is read from global memory
+// once per group instead of once per ray. The cache holds the chunk's
+// batches, or with SCALAR_SPHERES the center and radius of each sphere,
+// which is all that is needed to find the nearest hit. Must be reached by
+// every work item of the group, work items with inactive set only help
+// loading.
+static bool hit_spheres_cached(SCENE_MEM sphere* s, int num_spheres,
+                               __local float4* cache, const ray* r,
+                               float t_min, float t_max, hit_record* record,
+                               bool active) {
+  const uint local_id = local_linear_id();
+  const uint group_size =
+      get_local_size(0) * get_local_size(1) * get_local_size(2);
+#ifdef SCALAR_SPHERES
+  float closest = t_max;
+  int closest_index = -1;
+#else
+  SCENE_MEM const float4* batches = sphere_batches(s);
+  float4 closest = (float4)(t_max);
+  int4 closest_index = (int4)(-1);
+#endif
+  // SCENE_CACHE_SIZE is a multiple of SPHERE_BATCH, so chunks start on a
+  // batch
+  for (int base = 0; base < num_spheres; base += SCENE_CACHE_SIZE) {
+    const int count = min(SCENE_CACHE_SIZE, num_spheres - base);
+    // The previous chunk must be done with before it is overwritten
+    barrier(CLK_LOCAL_MEM_FENCE);
+#ifdef SCALAR_SPHERES
+    for (int i = local_id; i < count; i += group_size) {
+      cache[i] = (float4)(s[base + i].center, s[base + i].radius);
+    }
+#else
+    const int loads = (count + SPHERE_BATCH - 1) / SPHERE_BATCH * SPHERE_BATCH;
+    for (int i = local_id; i < loads; i += group_size) {
+      cache[i] = batches[base + i];
+    }
+#endif
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (active) {
+#ifdef SCALAR_SPHERES
+      for (int i = 0; i < count; ++i) {
+        float t;
+        if (intersect(cache[i].xyz, cache[i].w, r, t_min, closest, &t)) {
+          closest = t;
+          closest_index = base + i;
+        }
+      }
+#else
+      for (int i = 0; i < count; i += SPHERE_BATCH) {
+        intersect_batch(cache[i], cache[i + 1], cache[i + 2], cache[i + 3],
+                        base + i, num_spheres, r, t_min, &closest,
+                        &closest_index);
+      }
+#endif
+    }
+  }
+
+#ifdef SCALAR_SPHERES
+  if (closest_index < 0) {
+    return false;
+  }
+  // The record points at the material in the scene, not at the cache
+  set_record(&s[closest_index], r, closest, record);
+  return true;
+#else
+  return hit_nearest(s, closest, closest_index, r, record);
+#endif
+}
+#endif
 
 #endif
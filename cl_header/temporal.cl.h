@@ -0,0 +1,92 @@
+#ifndef TEMPORAL_CL
+#define TEMPORAL_CL
+
+#include "camera.cl.h"
+
+// Most samples the history of a pixel stands for, so that it keeps following
+// slow changes in lighting and view
+#define TEMPORAL_MAX_SAMPLES 64.0f
+// Relative difference in first hit distance beyond which a previous pixel
+// shows another surface
+#define TEMPORAL_DEPTH_TOLERANCE 0.05f
+
+// Continuous pixel coordinates in a previous frame, with centers at .5, of
+// the first surface seen through the center of pixel at distance depth, or of
+// the sky in its direction for a depth of MAXFLOAT. prev_depth receives the
+// distance the previous camera should have seen it at. Returns false if the
+// point was behind the previous camera.
+static bool reproject(__constant camera* cam, __constant camera* prev_cam,
+                      uint2 view_size, uint2 prev_view_size, int2 pixel,
+                      float depth, float2* prev_pixel, float* prev_depth) {
+  const float2 st =
+      (float2)((pixel.x + 0.5f) / view_size.x,
+               (view_size.y - (pixel.y + 0.5f)) / view_size.y);
+  const float3 dir = normalize(pinhole_direction(cam, st));
+  float3 d;
+  if (depth < MAXFLOAT) {
+    d = cam->origin + dir * depth - prev_cam->origin;
+    *prev_depth = length(d);
+  } else {
+    // The sky is infinitely far away, so only the rotation matters
+    d = dir;
+    *prev_depth = MAXFLOAT;
+  }
+  const float dz = -dot(d, prev_cam->w);
+  if (dz <= 0.0f) {
+    return false;
+  }
+
+  // Intersect the image plane of the previous camera
+  const float3 corner = prev_cam->lower_left_corner - prev_cam->origin;
+  const float focus = -dot(corner, prev_cam->w);
+  const float2 plane = (float2)(dot(d, prev_cam->u), dot(d, prev_cam->v)) *
+                       (focus / dz);
+  const float s = (plane.x - dot(corner, prev_cam->u)) /
+                  dot(prev_cam->horizontal, prev_cam->u);
+  const float t = (plane.y - dot(corner, prev_cam->v)) /
+                  dot(prev_cam->vertical, prev_cam->v);
+  *prev_pixel =
+      (float2)(s * prev_view_size.x, (1.0f - t) * prev_view_size.y);
+  return true;
+}
+
+// Whether a previous pixel that saw its first surface at stored saw the
+// surface expected at expected, rather than one in front of or behind it
+static bool same_surface(float expected, float stored) {
+  if (expected == MAXFLOAT || stored == MAXFLOAT) {
+    return expected == stored;
+  }
+  return fabs(expected - stored) <= TEMPORAL_DEPTH_TOLERANCE * expected;
+}
+
+// Bilinear fetch of the history at prev_pixel from the taps that saw the
+// expected surface. Returns a weight of zero if the surface was disoccluded.
+static float4 fetch_history(__global const float4* prev_frame,
+                            __global const float4* prev_history,
+                            uint2 prev_view_size, float2 prev_pixel,
+                            float expected, float* weight) {
+  const float2 position = prev_pixel - 0.5f;
+  const int2 base = convert_int2(floor(position));
+  const float2 f = position - floor(position);
+  float4 sum = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+  *weight = 0.0f;
+  for (int dy = 0; dy < 2; ++dy) {
+    for (int dx = 0; dx < 2; ++dx) {
+      const int2 tap = base + (int2)(dx, dy);
+      if (tap.x < 0 || tap.y < 0 || tap.x >= (int)prev_view_size.x ||
+          tap.y >= (int)prev_view_size.y) {
+        continue;
+      }
+      const size_t i = (size_t)tap.y * WIDTH + tap.x;
+      if (!same_surface(expected, prev_frame[i].w)) {
+        continue;
+      }
+      const float w = (dx ? f.x : 1.0f - f.x) * (dy ? f.y : 1.0f - f.y);
+      sum += prev_history[i] * w;
+      *weight += w;
+    }
+  }
+  return *weight > 0.0f ? sum / *weight : sum;
+}
+
+#endif
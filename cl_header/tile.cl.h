@@ -0,0 +1,87 @@
+#ifndef TILE_CL
+#define TILE_CL
+
+#include "camera.cl.h"
+#include "sphere.cl.h"
+
+#ifdef TILE_SIZE
+// Side plane of a tile frustum through the camera origin, spanned by two
+// corner directions and oriented so that inside faces its positive side
+static float3 frustum_plane(float3 a, float3 b, float3 inside) {
+  float3 n = normalize(cross(a, b));
+  return dot(n, inside) < 0.0f ? -n : n;
+}
+
+// Collects the indices of the spheres a primary ray of this work group's
+// tile of an image_size image may hit into candidates. Returns their count,
+// or -1 if there are more than TILE_CANDIDATES, in which case the whole scene
+// has to be tested. Must be reached by every work item of the group. Only
+// valid for pinhole cameras.
+static int cull_tile(__constant camera* c, uint2 image_size,
+                     SCENE_MEM sphere* s, int num_spheres,
+                     __local int* candidates, __local int* count) {
+  const uint local_id = get_local_id(1) * get_local_size(0) + get_local_id(0);
+  const uint group_size = get_local_size(0) * get_local_size(1);
+
+  // Samples jitter inside their pixel, so the frustum spans whole pixels
+  const float x0 = get_global_offset(0) + get_group_id(0) * TILE_SIZE;
+  const float y0 = get_global_offset(1) + get_group_id(1) * TILE_SIZE;
+  const float2 size = convert_float2(image_size);
+  const float s0 = x0 / size.x;
+  const float s1 = (x0 + TILE_SIZE) / size.x;
+  const float t0 = (size.y - (y0 + TILE_SIZE)) / size.y;
+  const float t1 = (size.y - y0) / size.y;
+  const float3 d00 = pinhole_direction(c, (float2)(s0, t0));
+  const float3 d10 = pinhole_direction(c, (float2)(s1, t0));
+  const float3 d11 = pinhole_direction(c, (float2)(s1, t1));
+  const float3 d01 = pinhole_direction(c, (float2)(s0, t1));
+  const float3 center = d00 + d10 + d11 + d01;
+  const float3 planes[4] = {
+      frustum_plane(d00, d10, center), frustum_plane(d10, d11, center),
+      frustum_plane(d11, d01, center), frustum_plane(d01, d00, center)};
+
+  if (local_id == 0) {
+    *count = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int i = local_id; i < num_spheres; i += group_size) {
+    const float3 oc = s[i].center - c->origin;
+    // Negative radii model hollow spheres, and a small margin keeps spheres
+    // grazing a plane despite rounding
+    const float reach = fabs(s[i].radius) + 1e-3f;
+    bool inside = true;
+    for (int p = 0; p < 4; ++p) {
+      inside = inside && dot(planes[p], oc) >= -reach;
+    }
+    if (inside) {
+      int slot = atomic_inc(count);
+      if (slot < TILE_CANDIDATES) {
+        candidates[slot] = i;
+      }
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  const int total = *count;
+  return total <= TILE_CANDIDATES ? total : -1;
+}
+
+// hit_spheres restricted to the spheres listed in candidates
+static bool hit_candidates(SCENE_MEM sphere* s, __local const int* candidates,
+                           int num_candidates, const ray* r, float t_min,
+                           float t_max, hit_record* record) {
+  hit_record temp_rec;
+  float closest = t_max;
+  bool hit_anything = false;
+  for (int i = 0; i < num_candidates; ++i) {
+    if (hit(&s[candidates[i]], r, t_min, closest, &temp_rec)) {
+      hit_anything = true;
+      closest = temp_rec.t;
+      *record = temp_rec;
+    }
+  }
+  return hit_anything;
+}
+#endif
+
+#endif
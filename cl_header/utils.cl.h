@@ -1,6 +1,46 @@
 #ifndef UTILS_CL
 #define UTILS_CL
 
+// Precision profiles, selected with PRECISION. The values match the host's
+// PrecisionProfile.
+#define PRECISION_EXACT 0
+#define PRECISION_FAST 1
+#define PRECISION_AGGRESSIVE 2
+
+#ifndef PRECISION
+#define PRECISION PRECISION_EXACT
+#endif
+
+// Math on the paths every ray takes, approximated by the faster profiles
+#if PRECISION >= PRECISION_FAST
+#define math_sqrt native_sqrt
+#define math_cos native_cos
+#define math_sin native_sin
+#define math_normalize fast_normalize
+#else
+#define math_sqrt sqrt
+#define math_cos cos
+#define math_sin sin
+#define math_normalize normalize
+#endif
+
+// Finalizer from MurmurHash3, mixes every input bit into every output bit
+static uint fmix32(uint h) {
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35u;
+  h ^= h >> 16;
+  return h;
+}
+
+// Starting state for rand() from a pixel and a global sample index. Nearby
+// indices give unrelated states, and xorshift must never start at zero.
+static uint seed_hash(uint pixel, uint sample) {
+  uint h = fmix32(pixel * 0x9E3779B9u + fmix32(sample + 1u));
+  return h == 0u ? 1u : h;
+}
+
 // Pseudorandom number generator based on xorshift32:
 // https://en.wikipedia.org/wiki/Xorshift
 static float rand(unsigned int state[static 1]) {
@@ -8,15 +48,23 @@ static float rand(unsigned int state[static 1]) {
   x ^= x << 13;
   x ^= x >> 17;
   x ^= x << 5;
-  return (float)(state[0] = x) / (float)(UINT_MAX);
+  state[0] = x;
+#if PRECISION >= PRECISION_AGGRESSIVE
+  // The top 23 bits as the mantissa of a float in [1, 2), without a
+  // conversion and division
+  return as_float(0x3F800000u | (x >> 9)) - 1.0f;
+#else
+  return (float)x / (float)(UINT_MAX);
+#endif
 }
 
+// Uniformly distributed point on the unit sphere
 static float3 random_unit_sphere(unsigned int state[static 1]) {
   float azimuth = rand(state) * M_PI_F * 2.0f;
-  float y = rand(state);
-  float sin_elevation = sqrt(1.0f - y * y);
-  float x = sin_elevation * cos(azimuth);
-  float z = sin_elevation * sin(azimuth);
+  float y = 2.0f * rand(state) - 1.0f;
+  float sin_elevation = math_sqrt(1.0f - y * y);
+  float x = sin_elevation * math_cos(azimuth);
+  float z = sin_elevation * math_sin(azimuth);
   return (float3)(x, y, z);
 }
 
@@ -29,12 +77,12 @@ static float3 random_unit_disk(unsigned int state[static 1]) {
 static float3 reflect(float3 a, float3 b) { return a - 2.0f * dot(a, b) * b; }
 
 static bool refract(float3 v, float3 normal, float index, float3* refracted) {
-  float3 normalized = normalize(v);
+  float3 normalized = math_normalize(v);
   float dt = dot(normalized, normal);
   float discriminant = 1.0f - index * index * (1.0f - dt * dt);
   if (discriminant > 0.0f) {
     *refracted =
-        index * (normalized - normal * dt) - normal * sqrt(discriminant);
+        index * (normalized - normal * dt) - normal * math_sqrt(discriminant);
     return true;
   }
   return false;
@@ -43,7 +91,13 @@ static bool refract(float3 v, float3 normal, float index, float3* refracted) {
 static float schlick(float cosine, float index) {
   float r0 = (1 - index) / (1 + index);
   r0 = r0 * r0;
+#if PRECISION >= PRECISION_FAST
+  const float x = 1 - cosine;
+  const float x2 = x * x;
+  return r0 + (1 - r0) * x2 * x2 * x;
+#else
   return r0 + (1 - r0) * pow((1 - cosine), 5);
+#endif
 }
 
 #endif
@@ -1,5 +1,9 @@
 #include "camera.cl.h"
+#include "framebuffer.cl.h"
+#include "light.cl.h"
 #include "sphere.cl.h"
+#include "temporal.cl.h"
+#include "tile.cl.h"
 
 // The following definitions are expected for building this program:
 // - WIDTH = width of the output image
@@ -7,98 +11,534 @@
 // - SAMPLES = number of anti-aliasing samples
 // - DEPTH = depth of bounces allowed for rays
 // - NUM_SPHERES = number of spheres in scene
+// - (Optional) NUM_LIGHTS = number of emissive spheres, which must come first
+//   in the scene. Enables light sampling.
 // - (Optional) USE_PINHOLE_CAMERA = indicates whether the camera
 //   uses a simulated lens with surface area or not
+// - (Optional) SCENE_IN_GLOBAL_MEMORY = reads spheres from global instead of
+//   constant memory, for scenes larger than the constant buffer
+// - (Optional) SCENE_CACHE_SIZE = number of spheres each work group loads
+//   into local memory at a time. Requires SCENE_IN_GLOBAL_MEMORY.
+// - (Optional) TILE_SIZE and TILE_CANDIDATES = work groups are square tiles
+//   of TILE_SIZE pixels whose primary rays only test the spheres inside the
+//   tile's frustum, up to TILE_CANDIDATES of them. Requires a pinhole camera
+//   and work sizes padded to whole tiles.
+// - (Optional) PRECISION = precision profile, one of the PRECISION_* values
+//   in utils.cl.h. Exact by default.
+// - (Optional) SAMPLE_FORMAT = storage format of the trace buffer, one of the
+//   SAMPLE_FORMAT_* values in framebuffer.cl.h. Interleaved float by default.
 
-// TODO: The division of work among kernels could probably be improved
-__kernel void raytrace(__constant camera* cam, __constant sphere* spheres,
-                       __global __write_only float* output
-                       /* output to a buffer because color
-                       compression occurs to output to image */) {
-  // 0 is x, 1 is y, and 2 is s (sample point for anti-aliasing)
-  const uint3 sector =
-      (uint3)(get_global_id(0), get_global_id(1), get_global_id(2));
-  // Make the random seed the unique index for each work item, quick hack
-  uint rand_seed =
-      ((sector.y * WIDTH * SAMPLES) + (sector.x * SAMPLES + sector.z)) * 3;
-  // cache the index now after calculating, since rand seed will change
-  const uint index = rand_seed;
+// Local memory of the optional kernel variants. __local variables can only
+// be declared at kernel scope, so every kernel that traces declares them with
+// these and hands them to trace_path.
+#ifdef SCENE_CACHE_SIZE
+#define SCENE_CACHE_LOCALS                       \
+  __local float4 sphere_cache[SCENE_CACHE_SIZE]; \
+  __local int group_active;
+#define SCENE_CACHE_ARGS sphere_cache, &group_active
+#else
+#define SCENE_CACHE_LOCALS
+#define SCENE_CACHE_ARGS 0, 0
+#endif
+#ifdef TILE_SIZE
+#define TILE_LOCALS                             \
+  __local int tile_candidates[TILE_CANDIDATES]; \
+  __local int tile_count;
+#define CULL_TILE(cam, image_size, spheres)                         \
+  cull_tile(cam, image_size, spheres, NUM_SPHERES, tile_candidates, \
+            &tile_count)
+#define TILE_ARGS tile_candidates
+#else
+#define TILE_LOCALS
+#define CULL_TILE(cam, image_size, spheres) (-1)
+#define TILE_ARGS 0
+#endif
 
+// Starts the camera ray of a sample of an image_size image, which is smaller
+// than WIDTH x HEIGHT for scaled interactive frames. Seeds only depend on the
+// pixel and the global sample index, so that a sample traces the same path no
+// matter which pass or kernel renders it, and passes resumed from a
+// checkpoint continue with fresh sample indices.
+static ray camera_ray(__constant camera* cam, uint2 image_size, uint2 pixel,
+                      uint sample, uint* rand_seed) {
+  *rand_seed = seed_hash(pixel.y * WIDTH + pixel.x, sample);
   const float2 uv = (float2)(
-      ((float)sector.x + rand(&rand_seed)) / (float)WIDTH,
-      ((float)(HEIGHT - (sector.y + 1)) + rand(&rand_seed)) / (float)HEIGHT);
-
-  ray r = get_ray(cam, uv, &rand_seed);
+      ((float)pixel.x + rand(rand_seed)) / (float)image_size.x,
+      ((float)(image_size.y - (pixel.y + 1)) + rand(rand_seed)) /
+          (float)image_size.y);
+  return get_ray(cam, uv, rand_seed);
+}
 
-  float3 color = (float3)(1.0f, 1.0f, 1.0f);
+// Follows a ray through up to DEPTH bounces and returns the light it carries.
+// first_hit receives the distance to the first surface, or MAXFLOAT if the
+// ray escapes to the sky. Rays of pixels outside the image are not traced,
+// but with the scene cache they still take part in the group's loads. The
+// local memory arguments are only used by the variants that declare them.
+// With lights in the scene, diffuse bounces also sample a light with a shadow
+// ray, and both that and hitting the light by bouncing are weighted by
+// multiple importance sampling.
+static float3 trace_path(SCENE_MEM sphere* spheres, ray r, uint* rand_seed,
+                         bool in_image, __local float4* sphere_cache,
+                         __local int* group_active,
+                         __local const int* tile_candidates,
+                         int num_candidates, float* first_hit) {
+  *first_hit = MAXFLOAT;
+  float3 color = (float3)(0.0f, 0.0f, 0.0f);
+  float3 throughput = (float3)(1.0f, 1.0f, 1.0f);
   hit_record record;
   ray scattered;
   float3 attenuation = (float3)(0.0f, 0.0f, 0.0f);
-  for (int i = 0; i < DEPTH; ++i) {
-    if (hit_spheres(spheres, NUM_SPHERES, &r, 0.001f, MAXFLOAT, &record)) {
-      if (scatter(&record, &r, &attenuation, &scattered, &rand_seed)) {
-        color *= attenuation;
-        r = scattered;
-        continue;
+  bool active = in_image;
+#ifdef NUM_LIGHTS
+  // Density with which the last bounce picked the ray's direction, zero for
+  // camera rays and specular bounces that light sampling cannot reach
+  float bounce_pdf = 0.0f;
+#endif
+#ifdef SCENE_CACHE_SIZE
+  // Rays of a group take part in every chunk load until all of them have
+  // terminated, so finished rays stay in the loop as inactive helpers
+  for (int i = 0; i < DEPTH && group_any(active, group_active); ++i) {
+#else
+  for (int i = 0; i < DEPTH && active; ++i) {
+#endif
+    bool hit_anything;
+#ifdef TILE_SIZE
+    // Primary rays only test the spheres inside their tile's frustum. The
+    // condition is the same for the whole group.
+    if (i == 0 && num_candidates >= 0) {
+      hit_anything =
+          active && hit_candidates(spheres, tile_candidates, num_candidates,
+                                   &r, 0.001f, MAXFLOAT, &record);
+    } else
+#endif
+    {
+#ifdef SCENE_CACHE_SIZE
+      hit_anything = hit_spheres_cached(spheres, NUM_SPHERES, sphere_cache,
+                                        &r, 0.001f, MAXFLOAT, &record, active);
+#else
+      hit_anything =
+          hit_spheres(spheres, NUM_SPHERES, &r, 0.001f, MAXFLOAT, &record);
+#endif
+    }
+#ifdef NUM_LIGHTS
+    // Light reaching the shading point from the sampled light if the shadow
+    // ray is not blocked
+    bool shadow = false;
+    ray shadow_ray;
+    int shadow_light;
+    float3 shadow_color;
+#endif
+    if (active) {
+      if (i == 0 && hit_anything) {
+        *first_hit = record.t * length(r.dir);
+      }
+      if (hit_anything) {
+#ifdef NUM_LIGHTS
+        if (record.m->type == EMISSIVE) {
+          float weight = 1.0f;
+          if (bounce_pdf > 0.0f) {
+            weight = power_heuristic(
+                bounce_pdf,
+                light_pdf(&spheres[sphere_index(spheres, &record)], r.o));
+          }
+          color += throughput * emitted(&record, &r) * weight;
+        } else if (record.m->type == LAMBERTIAN) {
+          float light_density;
+          shadow = sample_light(spheres, record.p, rand_seed, &shadow_light,
+                                &shadow_ray.dir, &light_density);
+          const float cosine = dot(record.normal, shadow_ray.dir);
+          shadow = shadow && cosine > 0.0f;
+          if (shadow) {
+            shadow_ray.o = record.p;
+            // Lambertian BRDF times the cosine over the density, weighted
+            // against bouncing into the light with the cosine density
+            shadow_color =
+                throughput * record.m->l.albedo *
+                spheres[shadow_light].m.e.emission * (cosine / M_PI_F) *
+                power_heuristic(light_density, cosine / M_PI_F) /
+                light_density;
+          }
+        }
+#endif
+        if (scatter(&record, &r, &attenuation, &scattered, rand_seed)) {
+          throughput *= attenuation;
+#ifdef NUM_LIGHTS
+          bounce_pdf = record.m->type == LAMBERTIAN
+                           ? fmax(dot(record.normal,
+                                      math_normalize(scattered.dir)),
+                                  0.0f) / M_PI_F
+                           : 0.0f;
+#endif
+          r = scattered;
+        } else {
+          active = false;
+        }
+      } else {
+        // Sky blend
+        float3 dir = math_normalize(r.dir);
+        float t = 0.5f * (dir.y + 1.0f);
+        color += throughput * ((float3)(1.0f, 1.0f, 1.0f) * (1.0f - t) +
+                               (float3)(0.5f, 0.7f, 1.0f) * t);
+        active = false;
       }
+    }
+#ifdef NUM_LIGHTS
+    // The light is visible if the shadow ray hits it first
+    hit_record shadow_record;
+#ifdef SCENE_CACHE_SIZE
+    const bool shadow_hit =
+        hit_spheres_cached(spheres, NUM_SPHERES, sphere_cache, &shadow_ray,
+                           0.001f, MAXFLOAT, &shadow_record, shadow);
+#else
+    const bool shadow_hit =
+        shadow && hit_spheres(spheres, NUM_SPHERES, &shadow_ray, 0.001f,
+                              MAXFLOAT, &shadow_record);
+#endif
+    if (shadow && shadow_hit &&
+        sphere_index(spheres, &shadow_record) == shadow_light) {
+      color += shadow_color;
+    }
+#endif
+  }
+  // Paths still bouncing after DEPTH bounces are lit by their throughput, as
+  // if they had escaped to a white sky
+  return active ? color + throughput : color;
+}
+
+// Average of sample_count samples of a pixel, summed in the same order as the
+// resolve kernels so that fused and separate passes agree. depth receives
+// the first hit distance of the first sample.
+static float3 trace_pixel(__constant camera* cam, SCENE_MEM sphere* spheres,
+                          uint2 image_size, uint2 pixel, bool in_image,
+                          uint sample_offset, uint sample_count,
+                          __local float4* sphere_cache,
+                          __local int* group_active,
+                          __local const int* tile_candidates,
+                          int num_candidates, float* depth) {
+  float3 color = (float3)(0, 0, 0);
+  for (uint s = 0; s < sample_count; ++s) {
+    uint rand_seed;
+    float first_hit;
+    ray r =
+        camera_ray(cam, image_size, pixel, sample_offset + s, &rand_seed);
+    color += trace_path(spheres, r, &rand_seed, in_image, sphere_cache,
+                        group_active, tile_candidates, num_candidates,
+                        &first_hit);
+    if (s == 0) {
+      *depth = first_hit;
+    }
+  }
+  return color / (float)sample_count;
+}
+
+// TODO: The division of work among kernels could probably be improved
+__kernel void raytrace(__constant camera* cam, SCENE_MEM sphere* spheres,
+                       __global sample_t* output
+                       /* output to a buffer because color
+                       compression occurs to output to image */,
+                       const uint sample_offset
+                       /* global index of sample 0 in this launch */) {
+  // 0 is x, 1 is y, and 2 is s (sample point for anti-aliasing)
+  const uint3 sector =
+      (uint3)(get_global_id(0), get_global_id(1), get_global_id(2));
+  // Work items padding the image to whole tiles only help with the tile's
+  // shared work
+  const uint2 image_size = (uint2)(WIDTH, HEIGHT);
+  const bool in_image = sector.x < WIDTH && sector.y < HEIGHT;
+  SCENE_CACHE_LOCALS
+  TILE_LOCALS
+  const int num_candidates = CULL_TILE(cam, image_size, spheres);
 
-      color *= (float3)(0, 0, 0);
+  uint rand_seed;
+  ray r = camera_ray(cam, image_size, sector.xy, sample_offset + sector.z,
+                     &rand_seed);
+  float first_hit;
+  float3 color = trace_path(spheres, r, &rand_seed, in_image, SCENE_CACHE_ARGS,
+                            TILE_ARGS, num_candidates, &first_hit);
+  if (in_image) {
+    store_sample(output, sector.x, sector.y, sector.z, color);
+  }
+};
+
+// Traces the same samples as raytrace over a chunk of chunk_size pixels and
+// samples from chunk_origin, but with only as many work groups as fill the
+// device. Groups repeatedly take the next group-sized batch of the chunk from
+// work_counter, which starts at zero, until it is drained, so a group that
+// drew short paths moves on instead of idling while other groups finish long
+// ones. Batches run along rows, then down the chunk, then through its
+// samples. Tiles are not culled, because a group no longer traces a tile.
+// Experimental, only used with --persistent-threads on.
+__kernel void raytrace_persistent(__constant camera* cam,
+                                  SCENE_MEM sphere* spheres,
+                                  __global sample_t* output,
+                                  const uint sample_offset,
+                                  __global uint* work_counter,
+                                  const uint4 chunk_origin,
+                                  const uint4 chunk_size) {
+  const uint local_id = get_local_id(0);
+  const uint group_size = get_local_size(0);
+  const uint chunk_pixels = chunk_size.x * chunk_size.y;
+  const uint total = chunk_pixels * chunk_size.z;
+  const uint2 image_size = (uint2)(WIDTH, HEIGHT);
+  SCENE_CACHE_LOCALS
+  TILE_LOCALS
+  __local uint batch_start;
+
+  // The exit condition is the same for the whole group, which keeps the
+  // scene cache's barriers uniform
+  while (true) {
+    // Everyone must have read the previous batch before it is replaced
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (local_id == 0) {
+      batch_start = atomic_add(work_counter, group_size);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    const uint start = batch_start;
+    if (start >= total) {
       break;
     }
+    const uint item = start + local_id;
 
-    // Sky blend
-    float3 dir = normalize(r.dir);
-    float t = 0.5f * (dir.y + 1.0f);
-    color *= (float3)(1.0f, 1.0f, 1.0f) * (1.0f - t) +
-             (float3)(0.5f, 0.7f, 1.0f) * t;
-    break;
+    const bool in_work = item < total;
+    const uint pixel = item % chunk_pixels;
+    const uint3 sector =
+        chunk_origin.xyz + (uint3)(pixel % chunk_size.x, pixel / chunk_size.x,
+                                   item / chunk_pixels);
+    uint rand_seed;
+    ray r = camera_ray(cam, image_size, sector.xy, sample_offset + sector.z,
+                       &rand_seed);
+    float first_hit;
+    float3 color = trace_path(spheres, r, &rand_seed, in_work,
+                              SCENE_CACHE_ARGS, TILE_ARGS, -1, &first_hit);
+    if (in_work) {
+      store_sample(output, sector.x, sector.y, sector.z, color);
+    }
   }
+};
+
+// The trace_resolve kernels trace all samples of a pixel in one work item and
+// write the resolved pixel directly, without going through the trace buffer.
+// sample_count may differ from SAMPLES.
 
-  output[index] = color.x;
-  output[index + 1] = color.y;
-  output[index + 2] = color.z;
+// Traces and compresses a pixel to a buffer
+__kernel void trace_resolve_buffer(__constant camera* cam,
+                                   SCENE_MEM sphere* spheres,
+                                   __global unsigned char* output,
+                                   const uint sample_offset,
+                                   const uint sample_count) {
+  const uint2 sector = (uint2)(get_global_id(0), get_global_id(1));
+  const uint2 image_size = (uint2)(WIDTH, HEIGHT);
+  const bool in_image = sector.x < WIDTH && sector.y < HEIGHT;
+  SCENE_CACHE_LOCALS
+  TILE_LOCALS
+  const int num_candidates = CULL_TILE(cam, image_size, spheres);
+
+  float depth;
+  float3 color = trace_pixel(cam, spheres, image_size, sector, in_image,
+                             sample_offset, sample_count, SCENE_CACHE_ARGS,
+                             TILE_ARGS, num_candidates, &depth);
+  if (in_image) {
+    store_rgb8(output, sector, color);
+  }
+};
+
+// Traces and compresses a pixel to an image, whose rows run bottom to top.
+// Interactive frames may trace a smaller view_size image into the lower left
+// corner of the output, which the display scales up.
+__kernel void trace_resolve_image(__constant camera* cam,
+                                  SCENE_MEM sphere* spheres,
+                                  __write_only image2d_t output,
+                                  const uint sample_offset,
+                                  const uint sample_count,
+                                  const uint2 view_size) {
+  const uint2 sector = (uint2)(get_global_id(0), get_global_id(1));
+  const bool in_image = sector.x < view_size.x && sector.y < view_size.y;
+  SCENE_CACHE_LOCALS
+  TILE_LOCALS
+  const int num_candidates = CULL_TILE(cam, view_size, spheres);
+
+  float depth;
+  float3 color = trace_pixel(cam, spheres, view_size, sector, in_image,
+                             sample_offset, sample_count, SCENE_CACHE_ARGS,
+                             TILE_ARGS, num_candidates, &depth);
+  if (in_image) {
+    write_imagef(output, (int2)(sector.x, view_size.y - 1 - sector.y),
+                 (float4)(sqrt(color), 1.0f));
+  }
+};
+
+// Traces and averages a pixel into linear float color
+__kernel void trace_resolve_float(__constant camera* cam,
+                                  SCENE_MEM sphere* spheres,
+                                  __global float* output,
+                                  const uint sample_offset,
+                                  const uint sample_count) {
+  const uint2 sector = (uint2)(get_global_id(0), get_global_id(1));
+  const uint2 image_size = (uint2)(WIDTH, HEIGHT);
+  const bool in_image = sector.x < WIDTH && sector.y < HEIGHT;
+  SCENE_CACHE_LOCALS
+  TILE_LOCALS
+  const int num_candidates = CULL_TILE(cam, image_size, spheres);
+
+  float depth;
+  float3 color = trace_pixel(cam, spheres, image_size, sector, in_image,
+                             sample_offset, sample_count, SCENE_CACHE_ARGS,
+                             TILE_ARGS, num_candidates, &depth);
+  if (in_image) {
+    store_linear(output, sector, color);
+  }
+};
+
+// Traces a pixel of an interactive frame for temporal reuse, with the
+// average color in xyz and the distance to the first surface in w
+__kernel void trace_frame(__constant camera* cam, SCENE_MEM sphere* spheres,
+                          __global float4* frame, const uint sample_offset,
+                          const uint sample_count, const uint2 view_size) {
+  const uint2 sector = (uint2)(get_global_id(0), get_global_id(1));
+  const bool in_image = sector.x < view_size.x && sector.y < view_size.y;
+  SCENE_CACHE_LOCALS
+  TILE_LOCALS
+  const int num_candidates = CULL_TILE(cam, view_size, spheres);
+
+  float depth;
+  float3 color = trace_pixel(cam, spheres, view_size, sector, in_image,
+                             sample_offset, sample_count, SCENE_CACHE_ARGS,
+                             TILE_ARGS, num_candidates, &depth);
+  if (in_image) {
+    frame[(size_t)sector.y * WIDTH + sector.x] = (float4)(color, depth);
+  }
+};
+
+// Blends a traced frame with the history of the previous one, reprojected
+// through the previous camera, and displays the result. History holds the
+// running average color in xyz and the samples it stands for in w. Where the
+// surface was not visible before, the history is dropped, and elsewhere it is
+// clamped to the colors around the pixel in the new frame so that changes in
+// shading do not leave trails.
+__kernel void temporal_resolve(__constant camera* cam,
+                               __constant camera* prev_cam,
+                               __global const float4* frame,
+                               __global const float4* prev_frame,
+                               __global const float4* prev_history,
+                               __global float4* history,
+                               __write_only image2d_t output,
+                               const uint sample_count, const uint2 view_size,
+                               const uint2 prev_view_size,
+                               const uint has_history) {
+  const int2 sector = (int2)(get_global_id(0), get_global_id(1));
+  if (sector.x >= (int)view_size.x || sector.y >= (int)view_size.y) {
+    return;
+  }
+  const size_t index = (size_t)sector.y * WIDTH + sector.x;
+  const float4 current = frame[index];
+
+  float3 low = current.xyz;
+  float3 high = current.xyz;
+  for (int dy = -1; dy <= 1; ++dy) {
+    for (int dx = -1; dx <= 1; ++dx) {
+      const int2 neighbour =
+          clamp(sector + (int2)(dx, dy), (int2)(0, 0),
+                convert_int2(view_size) - 1);
+      const float3 color = frame[(size_t)neighbour.y * WIDTH + neighbour.x].xyz;
+      low = fmin(low, color);
+      high = fmax(high, color);
+    }
+  }
+
+  float4 result = (float4)(current.xyz, (float)sample_count);
+  float2 prev_pixel;
+  float expected;
+  if (has_history &&
+      reproject(cam, prev_cam, view_size, prev_view_size, sector, current.w,
+                &prev_pixel, &expected)) {
+    float weight;
+    const float4 previous = fetch_history(prev_frame, prev_history,
+                                          prev_view_size, prev_pixel,
+                                          expected, &weight);
+    if (weight > 0.0f) {
+      const float3 clamped = clamp(previous.xyz, low, high);
+      const float samples = fmin(previous.w, TEMPORAL_MAX_SAMPLES);
+      result.xyz = (clamped * samples + current.xyz * sample_count) /
+                   (samples + sample_count);
+      result.w = samples + sample_count;
+    }
+  }
+
+  history[index] = result;
+  write_imagef(output, (int2)(sector.x, view_size.y - 1 - sector.y),
+               (float4)(sqrt(result.xyz), 1.0f));
 };
 
 // Compresses anti-aliasing samples for a pixel to a buffer
 __kernel void color_compress_buffer(
-    __global __read_only float* input,
-    __global __write_only unsigned char* output) {
+    __global const sample_t* input,
+    __global unsigned char* output) {
   const uint2 sector = (uint2)(get_global_id(0), get_global_id(1));
 
-  float3 color = (float3)(0, 0, 0);
-  for (int s = 0; s < SAMPLES; ++s) {
-    int outIndex =
-        ((sector.y * WIDTH * SAMPLES) + (sector.x * SAMPLES + s)) * 3;
-    float3 temp =
-        (float3)(input[outIndex], input[outIndex + 1], input[outIndex + 2]);
-    color += temp;
-  }
+  float3 color = sum_samples(input, sector.x, sector.y, SAMPLES);
   color /= (float)SAMPLES;
-  color = (float3)(sqrt(color.x), sqrt(color.y), sqrt(color.z));
 
-  int i = (WIDTH * sector.y + sector.x) * 3;
-  output[i] = (unsigned char)(255.99 * color.x);
-  output[i + 1] = (unsigned char)(255.99 * color.y);
-  output[i + 2] = (unsigned char)(255.99 * color.z);
+  store_rgb8(output, sector, color);
 };
 
-// Compresses anti-aliasing samples for a pixel to an image
-__kernel void color_compress_image(__global __read_only float* input,
+// Compresses anti-aliasing samples for a pixel to an image, whose rows run
+// bottom to top
+__kernel void color_compress_image(__global const sample_t* input,
                                    __write_only image2d_t output) {
   const int2 sector = (int2)(get_global_id(0), get_global_id(1));
 
-  float3 color = (float3)(0, 0, 0);
-  for (int s = 0; s < SAMPLES; ++s) {
-    int outIndex =
-        (((HEIGHT - sector.y) * WIDTH * SAMPLES) + (sector.x * SAMPLES + s)) *
-        3;
-    float3 temp =
-        (float3)(input[outIndex], input[outIndex + 1], input[outIndex + 2]);
-    color += temp;
-  }
+  float3 color =
+      sum_samples(input, sector.x, HEIGHT - 1 - sector.y, SAMPLES);
   color /= (float)SAMPLES;
-  float4 finalColor =
-      (float4)(sqrt(color.x), sqrt(color.y), sqrt(color.z), 1.0f);
 
-  write_imagef(output, sector, finalColor);
+  write_imagef(output, sector, (float4)(sqrt(color), 1.0f));
+};
+
+// Averages anti-aliasing samples for a pixel into linear float color, for
+// output formats that keep the full range
+__kernel void color_resolve_float(__global const sample_t* input,
+                                  __global float* output) {
+  const uint2 sector = (uint2)(get_global_id(0), get_global_id(1));
+
+  float3 color = sum_samples(input, sector.x, sector.y, SAMPLES);
+  color /= (float)SAMPLES;
+
+  store_linear(output, sector, color);
+};
+
+// Adds the samples traced in one pass to the running per-pixel sums, with
+// the sample count in w
+__kernel void accumulate_samples(__global const sample_t* input,
+                                 __global float4* accumulation,
+                                 const uint pass_samples) {
+  const uint2 sector = (uint2)(get_global_id(0), get_global_id(1));
+
+  float3 color = sum_samples(input, sector.x, sector.y, pass_samples);
+
+  accumulation[WIDTH * sector.y + sector.x] +=
+      (float4)(color, (float)pass_samples);
+};
+
+// Compresses accumulated samples for a pixel to a buffer
+__kernel void accumulation_compress_buffer(
+    __global const float4* accumulation,
+    __global unsigned char* output) {
+  const uint2 sector = (uint2)(get_global_id(0), get_global_id(1));
+
+  float4 sum = accumulation[WIDTH * sector.y + sector.x];
+  float3 color = sum.xyz / fmax(sum.w, 1.0f);
+
+  store_rgb8(output, sector, color);
+};
+
+// Averages accumulated samples for a pixel into linear float color
+__kernel void accumulation_resolve_float(
+    __global const float4* accumulation,
+    __global float* output) {
+  const uint2 sector = (uint2)(get_global_id(0), get_global_id(1));
+
+  float4 sum = accumulation[WIDTH * sector.y + sector.x];
+  float3 color = sum.xyz / fmax(sum.w, 1.0f);
+
+  store_linear(output, sector, color);
 };
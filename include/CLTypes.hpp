@@ -40,8 +40,15 @@ struct Dielectric {
   Dielectric(cl_float r_index) : r_index(r_index) {}
 };
 
+// EMISSIVE
+struct Emissive {
+  cl_float3 emission;
+
+  Emissive(Vector3 emission) : emission(emission.GetCLVector()) {}
+};
+
 // Base Material
-enum MaterialType { LAMBERTIAN, METAL, DIELECTRIC };
+enum MaterialType { LAMBERTIAN, METAL, DIELECTRIC, EMISSIVE };
 
 struct Material {
   MaterialType type;
@@ -49,12 +56,14 @@ struct Material {
     Lambertian l;
     Metal me;
     Dielectric d;
+    Emissive e;
   };
 
   Material() {}
   Material(Lambertian l) : type(MaterialType::LAMBERTIAN), l(l) {}
   Material(Metal me) : type(MaterialType::METAL), me(me) {}
   Material(Dielectric d) : type(MaterialType::DIELECTRIC), d(d) {}
+  Material(Emissive e) : type(MaterialType::EMISSIVE), e(e) {}
 };
 
 struct Sphere {
@@ -0,0 +1,69 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <string>
+#include <vector>
+
+#include "CLTypes.hpp"
+
+// Progress of an accumulating render. Each pixel stores the running sum of
+// its samples in xyz and the number of samples in w, matching the layout of
+// the accumulation buffer on the device.
+struct Checkpoint {
+  cl_uint width;
+  cl_uint height;
+  // Samples per pixel accumulated so far, which is also the global index of
+  // the next sample to trace
+  cl_uint samples;
+  std::vector<cl_float4> accumulation;
+
+  // What was rendered and how it was traced, so that a resume cannot add
+  // samples of another image or of another estimator
+  std::string scene;
+  cl_uint depth;
+  CLTypes::Vector3 origin;
+  CLTypes::Vector3 lookAt;
+  cl_float fov;
+  // A PrecisionProfile and a SampleFormat, which change the traced samples
+  cl_uint precision;
+  cl_uint sampleFormat;
+  // Emissive spheres, with which the kernel samples lights directly
+  cl_uint numLights;
+
+  Checkpoint()
+      : width(0),
+        height(0),
+        samples(0),
+        depth(0),
+        fov(0.0f),
+        precision(0),
+        sampleFormat(0),
+        numLights(0) {}
+  Checkpoint(cl_uint width, cl_uint height)
+      : width(width),
+        height(height),
+        samples(0),
+        depth(0),
+        fov(0.0f),
+        precision(0),
+        sampleFormat(0),
+        numLights(0) {
+    accumulation.resize((size_t)width * height);
+  }
+
+  // Writes to a temporary file next to path and renames it over path, so a
+  // job killed while saving still leaves the previous checkpoint intact.
+  // Returns 0 on success.
+  int Save(const std::string &path) const;
+  // Restores the samples and accumulation of a checkpoint of the render this
+  // one describes. Fails with the reason in errorLog if the file is not a
+  // checkpoint or its resolution, scene, depth, camera, precision, sample
+  // format or lights differ.
+  int Load(const std::string &path, std::string &errorLog);
+
+  // Averages the accumulation on the host into linear float RGB or gamma
+  // corrected 8-bit RGB, laid out like the device's resolved output
+  void Resolve(bool floatOutput, std::vector<unsigned char> &pixels) const;
+};
+
+#endif
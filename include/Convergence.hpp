@@ -0,0 +1,85 @@
+#ifndef CONVERGENCE_HPP
+#define CONVERGENCE_HPP
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Renderer.hpp"
+
+// Scenes every candidate is measured on
+#define CONVERGENCE_SCENES \
+  { "default", "lights", "random:100" }
+// Samples per pixel of the reference renders
+#define CONVERGENCE_REFERENCE_SAMPLES 4096
+// References draw samples from this index on, so that their noise does not
+// correlate with the candidate's
+#define CONVERGENCE_REFERENCE_OFFSET 0x40000000u
+// Offset of the squared reference in the denominator of relMSE, which keeps
+// dark pixels from dominating
+#define CONVERGENCE_REL_EPSILON 0.01
+
+// Pixels dimmer than this are held to ImageError::maxRelativeError as an
+// absolute error
+#define IMAGE_ERROR_MIN_MAGNITUDE 1.0
+
+// Error of an image against a reference, both in linear RGB color
+struct ImageError {
+  double rmse;
+  // Mean of the squared error relative to the squared reference
+  double relMse;
+  double psnr;
+  // Largest error of a channel, and the largest relative to the sum of the
+  // reference pixel's channels, at least IMAGE_ERROR_MIN_MAGNITUDE
+  double maxError;
+  double maxRelativeError;
+
+  static ImageError Measure(const std::vector<float> &pixels,
+                            const std::vector<float> &reference);
+};
+
+// Measures how fast a configuration converges. For each scene it renders a
+// high sample reference with the exact precision profile and interleaved
+// float samples, then renders the candidate settings progressively and
+// records its error against the reference and the elapsed render time at
+// 1, 2, 4, ... samples per pixel. Rendering changes can then be compared by
+// the time they take to reach a given quality.
+class ConvergenceHarness {
+ public:
+  ConvergenceHarness(cl_platform_id platform, cl_device_id device,
+                     int referenceSamples = CONVERGENCE_REFERENCE_SAMPLES)
+      : platform(platform),
+        device(device),
+        referenceSamples(referenceSamples) {}
+
+  // Column names of the rows Run writes
+  static void WriteHeader(std::ostream &csv);
+
+  // Writes a row per measurement of candidate up to maxSamples samples per
+  // pixel on scene. The sample count of the candidate settings is the pass
+  // size, the most samples traced at a time.
+  cl_int Run(const std::string &sceneName, const RenderSettings &candidate,
+             const CLTypes::Camera &camera, int maxSamples, std::ostream &csv,
+             std::string &errorLog);
+
+ private:
+  // Receives the samples per pixel rendered so far, the render time they
+  // took without readbacks and the linear image
+  typedef std::function<void(int, double, const std::vector<float> &)>
+      ImageCallback;
+
+  // Accumulates samples of the spheres in passes and hands the image to
+  // onImage after each of the sample counts in readAt
+  cl_int Render(const RenderSettings &settings,
+                const std::vector<CLTypes::Sphere> &spheres,
+                const CLTypes::Camera &camera, cl_uint sampleOffset,
+                const std::vector<int> &readAt, const ImageCallback &onImage,
+                std::string &errorLog);
+
+  cl_platform_id platform;
+  cl_device_id device;
+  int referenceSamples;
+};
+
+#endif
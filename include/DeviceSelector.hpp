@@ -0,0 +1,66 @@
+#ifndef DEVICE_SELECTOR_HPP
+#define DEVICE_SELECTOR_HPP
+
+#include <string>
+#include <vector>
+
+// Include this first to init GLEW
+#include "OpenCLProgram.hpp"
+
+// Calibration trace used to score devices for "fastest"
+#define CALIBRATION_RESOLUTION 128
+#define CALIBRATION_DEPTH 8
+#define CALIBRATION_RUNS 3
+
+// An OpenCL device together with the platform it belongs to
+struct DeviceCandidate {
+  cl_platform_id platform;
+  cl_device_id device;
+  std::string platformName;
+  std::string deviceName;
+  std::string driverVersion;
+  cl_device_type type;
+
+  std::string TypeName() const;
+};
+
+// Picks a platform and device without user input. Selections are written as
+//   <index>                 position in the list printed by PrintCandidates
+//   gpu, cpu, accelerator   first device of that type
+//   fastest                 highest calibration score
+//   <name>                  exact device or platform name, or a substring of
+//                           one
+class DeviceSelector {
+ public:
+  // Lists every device of every platform, in the order the driver reports
+  // them so that indices stay stable between runs
+  static cl_int Enumerate(std::vector<DeviceCandidate> &candidates);
+
+  static void PrintCandidates(const std::vector<DeviceCandidate> &candidates);
+
+  // Keeps the candidates matching a platform selection. Returns 0 on success.
+  static int FilterPlatforms(const std::string &selection,
+                             std::vector<DeviceCandidate> &candidates);
+
+  // Resolves a device selection against the candidates. Scores for "fastest"
+  // are read from and added to the file at scoreCachePath. Returns 0 on
+  // success.
+  static int Select(const std::string &selection,
+                    const std::vector<DeviceCandidate> &candidates,
+                    const std::string &scoreCachePath,
+                    DeviceCandidate &selected);
+
+  // Traces a small frame of the default scene and returns samples per
+  // second, or a negative score if the device cannot run the ray tracer
+  static double Calibrate(const DeviceCandidate &candidate);
+
+  // Default location of the score cache, in the user's home directory
+  static std::string DefaultScoreCachePath();
+
+ private:
+  static int SelectFastest(const std::vector<DeviceCandidate> &candidates,
+                           const std::string &scoreCachePath,
+                           DeviceCandidate &selected);
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef FRAME_STREAM_HPP
+#define FRAME_STREAM_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "OpenCLProgram.hpp"
+
+// Frames that may be queued for the writer before the renderer waits. Each
+// queued frame holds on to one mapped readback buffer.
+#define STREAM_QUEUE_FRAMES 3
+
+enum StreamFormat {
+  // YUV4MPEG2 with full resolution 4:4:4 chroma, read by ffmpeg and most
+  // encoders without further options
+  STREAM_Y4M,
+  // Headerless 8-bit RGB, e.g. for ffmpeg -f rawvideo -pixel_format rgb24
+  STREAM_RGB
+};
+
+// Writes resolved 8-bit RGB frames to stdout or a file such as a named pipe
+// on a writer thread. Frames are written straight from the memory they are
+// submitted with, so a slow consumer makes AcquireSlot block once
+// STREAM_QUEUE_FRAMES frames are queued instead of buffering without bound.
+class FrameStream {
+ public:
+  FrameStream(StreamFormat format, int width, int height, int fps);
+  ~FrameStream();
+
+  FrameStream(const FrameStream &) = delete;
+  FrameStream &operator=(const FrameStream &) = delete;
+
+  static bool ParseFormat(const std::string &name, StreamFormat &format);
+
+  // A path of "-" writes to stdout
+  int Open(const std::string &path);
+
+  // Waits until fewer than STREAM_QUEUE_FRAMES frames are queued and returns
+  // the slot the next frame should be read back into. The memory last
+  // submitted from that slot is no longer in use. Fails once writing failed,
+  // e.g. because the consumer went away.
+  int AcquireSlot(int &slot);
+
+  // Queues width * height RGB pixels for writing once ready has completed.
+  // The writer releases ready.
+  void Submit(const unsigned char *pixels, cl_event ready);
+
+  // Writes the queued frames and closes the output
+  int Close();
+
+  // Frames written in full, valid after Close
+  inline unsigned long FramesWritten() const { return written; }
+
+ private:
+  struct Frame {
+    const unsigned char *pixels;
+    cl_event ready;
+  };
+
+  void WriterLoop();
+  int WriteFrame(const Frame &frame);
+
+  StreamFormat format;
+  int width;
+  int height;
+  int fps;
+  int fd = -1;
+
+  std::thread writer;
+  std::mutex queueMutex;
+  std::condition_variable queueCondition;
+  std::deque<Frame> queue;
+  // Frames queued by Submit and frames the writer is done with, whether
+  // they were written or dropped after a failure
+  unsigned long submitted = 0;
+  unsigned long completed = 0;
+  unsigned long written = 0;
+  bool closing = false;
+  bool failed = false;
+
+  // Planar YUV of one frame, only used by the writer thread
+  std::vector<unsigned char> planes;
+};
+
+#endif
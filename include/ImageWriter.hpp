@@ -0,0 +1,91 @@
+#ifndef IMAGE_WRITER_HPP
+#define IMAGE_WRITER_HPP
+
+#include <memory>
+#include <string>
+
+// Resolved pixels handed to an image writer. Rows are stored top to bottom
+// with three channels per pixel. Writers that need float data read the
+// linear rgbFloat pointer, all others read the gamma corrected rgb8 pointer.
+struct Image {
+  int width;
+  int height;
+  const unsigned char *rgb8;
+  const float *rgbFloat;
+
+  Image(int width, int height, const unsigned char *rgb8,
+        const float *rgbFloat = nullptr)
+      : width(width), height(height), rgb8(rgb8), rgbFloat(rgbFloat) {}
+};
+
+// Common interface of all output formats. Write is const so that one writer
+// can be shared by several encoder threads. Returns 0 on success.
+class ImageWriter {
+ public:
+  virtual ~ImageWriter() {}
+
+  virtual int Write(const std::string &path, const Image &image) const = 0;
+
+  // Whether Write reads linear float data instead of 8-bit data
+  virtual bool NeedsFloatData() const { return false; }
+
+  // Wraps resolved pixels in the layout this writer reads
+  Image MakeImage(int width, int height, const void *pixels) const;
+
+  // Creates the writer for a format name ("png", "qoi", "ppm", "pfm", "hdr"
+  // or "raw"). An empty name picks the format from the extension of path.
+  // threads is the number of threads a single Write call may use.
+  static std::unique_ptr<ImageWriter> Create(const std::string &format,
+                                             const std::string &path,
+                                             unsigned int threads);
+};
+
+// PNG encoder that filters rows and deflates independent segments of the
+// image in parallel, then stitches the segments into a single zlib stream
+class PNGWriter : public ImageWriter {
+ public:
+  explicit PNGWriter(unsigned int threads, int compressionLevel = 6)
+      : threads(threads), compressionLevel(compressionLevel) {}
+
+  int Write(const std::string &path, const Image &image) const override;
+
+ private:
+  unsigned int threads;
+  int compressionLevel;
+};
+
+// Quite OK Image format (https://qoiformat.org), a single pass encoder that
+// is much faster than deflate at a moderate size cost
+class QOIWriter : public ImageWriter {
+ public:
+  int Write(const std::string &path, const Image &image) const override;
+};
+
+// Binary 8-bit portable pixmap (P6)
+class PPMWriter : public ImageWriter {
+ public:
+  int Write(const std::string &path, const Image &image) const override;
+};
+
+// Portable float map with linear color
+class PFMWriter : public ImageWriter {
+ public:
+  int Write(const std::string &path, const Image &image) const override;
+  bool NeedsFloatData() const override { return true; }
+};
+
+// Radiance RGBE with linear color
+class HDRWriter : public ImageWriter {
+ public:
+  int Write(const std::string &path, const Image &image) const override;
+  bool NeedsFloatData() const override { return true; }
+};
+
+// Headerless 32-bit float RGB, rows top to bottom, in host byte order
+class RawFloatWriter : public ImageWriter {
+ public:
+  int Write(const std::string &path, const Image &image) const override;
+  bool NeedsFloatData() const override { return true; }
+};
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef KERNEL_HANDLE_HPP
+#define KERNEL_HANDLE_HPP
+
+#include <bitset>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Metrics.hpp"
+#include "OpenCLProgram.hpp"
+
+// A loaded kernel whose arguments have the host types Args, in order: cl_mem
+// for buffers and images and the cl_ scalar and vector types for values.
+// Arguments are checked against Args when compiling, kept on the host so
+// that setting an unchanged value skips clSetKernelArg, and the kernel is
+// enqueued without looking it up by name. Handles are obtained from
+// OpenCLProgram::LoadKernel and stay valid until the program is unloaded.
+// Arguments of a kernel with a handle should only be set through it, or the
+// cached values go stale.
+template <typename... Args>
+class KernelHandle {
+ public:
+  template <cl_uint I>
+  using ArgType = typename std::tuple_element<I, std::tuple<Args...>>::type;
+
+  // Sets argument I unless it already holds value
+  template <cl_uint I>
+  cl_int Set(const ArgType<I> &value) {
+    static_assert(std::is_trivially_copyable<ArgType<I>>::value,
+                  "kernel arguments are copied byte by byte");
+    ArgType<I> &cached = std::get<I>(values);
+    if (bound[I] && std::memcmp(&cached, &value, sizeof(value)) == 0) {
+      return CL_SUCCESS;
+    }
+    CL_ERROR_RETURN(clSetKernelArg(kernel, I, sizeof(value), &value));
+    cached = value;
+    bound[I] = true;
+    return CL_SUCCESS;
+  }
+
+  // Sets every argument, stopping at the first error
+  cl_int Bind(const Args &... args) {
+    return BindAll(std::index_sequence_for<Args...>(), args...);
+  }
+
+  // Same as OpenCLProgram::ExecuteKernel
+  cl_int Execute(const std::vector<size_t> &globalWorkSizes,
+                 const std::vector<size_t> *globalWorkOffsets,
+                 const std::vector<size_t> *localWorkSizes = nullptr) const {
+    if (kernel == nullptr) {
+      return CL_INVALID_KERNEL;
+    }
+    cl_event timed;
+    CL_ERROR_RETURN(clEnqueueNDRangeKernel(
+        queue, kernel, globalWorkSizes.size(),
+        globalWorkOffsets == nullptr ? NULL : globalWorkOffsets->data(),
+        globalWorkSizes.data(),
+        localWorkSizes == nullptr ? NULL : localWorkSizes->data(), 0, NULL,
+        profiled ? &timed : NULL));
+    return profiled ? Metrics::TimeCommand(timed, COMMAND_KERNEL) : CL_SUCCESS;
+  }
+
+ private:
+  friend class OpenCLProgram;
+
+  void Attach(cl_kernel newKernel, cl_command_queue newQueue, bool profile) {
+    kernel = newKernel;
+    queue = newQueue;
+    profiled = profile;
+    bound.reset();
+  }
+
+  template <size_t... I>
+  cl_int BindAll(std::index_sequence<I...>, const Args &... args) {
+    cl_int result = CL_SUCCESS;
+    // Expands to a Set per argument in order
+    int expand[] = {0, (result = result ? result : Set<I>(args), 0)...};
+    (void)expand;
+    return result;
+  }
+
+  cl_kernel kernel = nullptr;
+  cl_command_queue queue = nullptr;
+  bool profiled = false;
+  std::tuple<Args...> values;
+  std::bitset<sizeof...(Args)> bound;
+};
+
+template <typename... Args>
+cl_int OpenCLProgram::LoadKernel(const std::string &kernelName,
+                                 KernelHandle<Args...> &handle) {
+  if (loadedKernels.find(kernelName) == loadedKernels.end()) {
+    CL_ERROR_RETURN(LoadKernel(kernelName));
+  }
+  cl_kernel kernel = loadedKernels[kernelName];
+  // The argument count is the part of the signature the runtime can check
+  cl_uint numArgs;
+  CL_ERROR_RETURN(clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(numArgs),
+                                  &numArgs, NULL));
+  if (numArgs != sizeof...(Args)) {
+    return CL_INVALID_KERNEL_ARGS;
+  }
+  handle.Attach(kernel, queue, profiling);
+  return CL_SUCCESS;
+}
+
+#endif
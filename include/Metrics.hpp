@@ -0,0 +1,65 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <ostream>
+#include <thread>
+
+#include "OpenCLProgram.hpp"
+
+// Frame time histogram buckets below the implicit +Inf bucket
+#define FRAME_TIME_BUCKETS 14
+
+// Seconds a scrape connection may stall reading its request or taking the
+// response before it is dropped, so one silent client cannot block the rest
+#define METRICS_IO_TIMEOUT 2
+
+enum ProgramCache {
+  // Device binaries on disk, see Renderer::SetBinaryCacheDirectory
+  CACHE_BINARY,
+  // Programs kept warm by the render server
+  CACHE_SERVER,
+  PROGRAM_CACHES
+};
+
+// Process-wide render telemetry. Every counter is a relaxed atomic, so the
+// render loop and OpenCL callbacks record without taking a lock, and a
+// snapshot read while rendering may be a few updates apart between metrics.
+class Metrics {
+ public:
+  // A frame, or a pass of a progressive render, that traced samples
+  // samples in seconds
+  static void RecordFrame(double seconds, unsigned long long samples);
+  static void RecordDeviceBytes(long long liveChange, long long pooledChange);
+  static void RecordCacheLookup(ProgramCache cache, bool hit);
+  static void SetStreamQueueDepth(unsigned long frames);
+
+  // Adds the device time of event, which must come from a queue with
+  // profiling enabled, once it completes. Takes over the caller's reference
+  // to event.
+  static cl_int TimeCommand(cl_event event, DeviceCommand command);
+
+  // Prometheus text exposition format
+  static void Write(std::ostream &out);
+};
+
+// Serves Metrics::Write over HTTP on a local TCP port from its own thread
+class MetricsEndpoint {
+ public:
+  MetricsEndpoint() = default;
+  ~MetricsEndpoint();
+
+  MetricsEndpoint(const MetricsEndpoint &) = delete;
+  MetricsEndpoint &operator=(const MetricsEndpoint &) = delete;
+
+  // Listens on 127.0.0.1:port
+  int Start(int port);
+  void Stop();
+
+ private:
+  void ServeLoop();
+
+  int listener = -1;
+  std::thread server;
+};
+
+#endif
@@ -1,15 +1,25 @@
 #ifndef OPENCL_PROGRAM_HPP
 #define OPENCL_PROGRAM_HPP
 
+#include <map>
+#include <ostream>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
+#include <utility>
 #include <vector>
 
 // Include this first to init GLEW first
 #include "OpenGLProgram.hpp"
 //
+#if defined(__APPLE__) || defined(MACOSX)
 #include <OpenCL/opencl.h>
+#else
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 120
+#endif
+#include <CL/cl.h>
+#include <CL/cl_gl.h>
+#endif
 
 // Helper macros
 #define CL_ERROR_CHECK(x)                                                 \
@@ -24,6 +34,40 @@
     return result;           \
   }
 
+// Released buffers are kept for reuse by later requests of the same flags
+// and size class, up to this many idle bytes. Size classes are four per
+// power of two, so a reused buffer is at most a quarter larger than needed.
+#define BUFFER_POOL_MAX_BYTES (256u << 20)
+#define BUFFER_POOL_MIN_CLASS 256
+
+// Device memory held by a program's buffers
+struct BufferStats {
+  // Bytes of buffers in use, and of released buffers kept by the pool
+  size_t liveBytes;
+  size_t pooledBytes;
+  // Most bytes held at once
+  size_t peakBytes;
+  // Buffers created on the device, requests served by the pool, and
+  // sub-buffers carved out of the arena
+  unsigned long allocations;
+  unsigned long poolReuses;
+  unsigned long subBuffers;
+
+  BufferStats()
+      : liveBytes(0),
+        pooledBytes(0),
+        peakBytes(0),
+        allocations(0),
+        poolReuses(0),
+        subBuffers(0) {}
+};
+
+// Kinds of commands timed for Metrics
+enum DeviceCommand { COMMAND_KERNEL, COMMAND_TRANSFER, DEVICE_COMMANDS };
+
+template <typename... Args>
+class KernelHandle;
+
 class OpenCLProgram {
  public:
   static cl_int GetAvailablePlatforms(
@@ -47,13 +91,57 @@ class OpenCLProgram {
               std::string &errorLog);
   cl_int Unload();
 
-  cl_int LoadKernel(const std::string &kernelName);
+  // Directory where device binaries of built programs are kept. When set,
+  // Init loads a matching binary instead of compiling the source, and stores
+  // the binary of any program it had to compile.
+  inline void SetBinaryCacheDirectory(const std::string &directory) {
+    binaryCacheDirectory = directory;
+  }
+  // Compiler flags such as -cl-fast-relaxed-math passed to every program
+  // built afterwards, ahead of the definitions
+  inline void SetCompilerOptions(const std::string &options) {
+    compilerOptions = options;
+  }
+  // Whether programs built afterwards time their kernels and transfers for
+  // Metrics, which takes a profiling queue and an event per command
+  inline void SetProfiling(bool enable) { profiling = enable; }
+  // Whether the last Init was served from the binary cache
+  inline bool LoadedFromBinaryCache() const { return loadedFromBinaryCache; }
 
+  cl_int LoadKernel(const std::string &kernelName);
+  // Largest work group the device runs kernelName with
+  cl_int GetKernelWorkGroupSize(const std::string &kernelName, size_t &size);
+  cl_int GetComputeUnits(cl_uint &units) const;
+  // Loads the kernel if needed and attaches handle to it, failing if the
+  // kernel does not take as many arguments as the handle. Defined in
+  // KernelHandle.hpp.
+  template <typename... Args>
+  cl_int LoadKernel(const std::string &kernelName,
+                    KernelHandle<Args...> &handle);
+
+  // Buffers are taken from the pool when one of the same flags and size
+  // class is free. Host data is copied into a reused buffer with a write that
+  // is queued behind earlier work, so it cannot disturb kernels still using
+  // the buffer's previous contents. Buffers with host data that the host
+  // may not write, and buffers wrapping host memory, are never pooled.
   cl_int CreateBuffer(cl_mem_flags flags, size_t bufSize, void *data,
                       cl_mem *newBuffer);
 
+  // Returns pooled buffers to the pool, all others to the device
   cl_int ReleaseBuffer(cl_mem buf);
 
+  // The arena is a single device allocation of at least size bytes that
+  // CreateArenaBuffer carves sub-buffers out of, for buffers that live and
+  // die together. Creating an arena replaces the previous one, whose
+  // sub-buffers stay valid until released.
+  cl_int CreateArena(cl_mem_flags flags, size_t size);
+  // Size an arena needs for sub-buffers of sizes, each aligned for the device
+  cl_int ArenaSize(const std::vector<size_t> &sizes, size_t &size) const;
+  cl_int CreateArenaBuffer(size_t bufSize, cl_mem *newBuffer);
+
+  inline const BufferStats &GetBufferStats() const { return bufferStats; }
+  void DumpBufferStats(std::ostream &out) const;
+
   cl_int SetArgument(const std::string &kernelName, cl_uint argNum,
                      size_t argSize, void *data);
 
@@ -61,20 +149,47 @@ class OpenCLProgram {
                               cl_mem_flags flags, size_t argSize, void *data,
                               cl_mem *newBuffer);
 
+  // Maps the first mapSize bytes of buffer into host memory. For buffers
+  // created with CL_MEM_ALLOC_HOST_PTR this is zero-copy on devices sharing
+  // memory with the host and a pinned transfer elsewhere. When not blocking,
+  // the pointer may only be used once event has completed.
   cl_int MapBuffer(cl_mem buffer, cl_bool blocking, cl_map_flags flags,
-                   size_t mapSize, void *mappedPointer);
+                   size_t mapSize, void **mappedPointer,
+                   cl_event *event = nullptr);
 
-  cl_int UnmapBuffer(cl_mem buffer, void *mappedPointer);
+  cl_int UnmapBuffer(cl_mem buffer, void *mappedPointer,
+                     cl_event *event = nullptr);
 
+  // Without localWorkSizes the implementation picks the work group size
   cl_int ExecuteKernel(const std::string &kernelName,
                        const std::vector<size_t> &globalWorkSizes,
-                       const std::vector<size_t> *globalWorkOffsets);
+                       const std::vector<size_t> *globalWorkOffsets,
+                       const std::vector<size_t> *localWorkSizes = nullptr);
 
   cl_int FinishKernelExecution();
+  // Submits queued work to the device without waiting for it to complete
+  cl_int FlushKernelExecution();
 
+  // When event is not null it receives an event that completes with the read,
+  // and the caller is responsible for releasing it
   cl_int ReadKernelOutput(cl_mem buf, bool blocking, size_t outputSize,
+                          void *output, cl_event *event = nullptr);
+
+  // Blocking read of size bytes of buf starting at offset
+  cl_int ReadBufferRegion(cl_mem buf, size_t offset, size_t size,
                           void *output);
 
+  cl_int WriteBuffer(cl_mem buf, bool blocking, size_t inputSize,
+                     const void *input);
+
+  // Fills the first size bytes of buf with a repeated pattern
+  cl_int FillBuffer(cl_mem buf, const void *pattern, size_t patternSize,
+                    size_t size);
+
+  // Waits for and releases an event returned by a non-blocking operation.
+  // Safe to call from any host thread.
+  static cl_int WaitForEvent(cl_event event);
+
   // OpenGL interop
   cl_int CreateGLImageObject(cl_mem_flags flags, GLenum target, GLint mipLevel,
                              GLuint texture, cl_mem *newImage);
@@ -82,13 +197,51 @@ class OpenCLProgram {
   cl_int ReleaseGLObjects(cl_uint numObjects, const cl_mem *objects);
 
  private:
+  cl_int BinaryCachePath(const std::string &programSource,
+                         const std::string &options, std::string &path) const;
+  cl_int LoadProgramBinary(const std::string &path,
+                           const std::string &options);
+  cl_int SaveProgramBinary(const std::string &path) const;
+
+  // Bytes a request of size is rounded up to in the pool
+  static size_t PoolSizeClass(size_t size);
+  // Queues a write of size bytes of data to buf without blocking
+  cl_int WriteHostCopy(cl_mem buf, size_t size, const void *data);
+  cl_int ArenaAlignment(size_t &alignment) const;
+  // When profiling, a command enqueued with the returned event is timed by
+  // RecordCommand, whether or not the caller asked for an event
+  cl_event *CommandEvent(cl_event *event, cl_event &timed) const;
+  cl_int RecordCommand(cl_int errorCode, DeviceCommand command,
+                       cl_event *event, cl_event timed) const;
+  void TrackBytes(long long liveChange, long long pooledChange);
+
+  // How a tracked memory object was created and where its memory goes
+  // when it is released
+  struct BufferInfo {
+    // Device bytes the object owns, 0 for images and sub-buffers
+    size_t bytes;
+    // Pool key for poolable buffers
+    cl_mem_flags poolFlags;
+    bool pooled;
+  };
+  typedef std::pair<cl_mem_flags, size_t> PoolKey;
+
   cl_platform_id platform;
   cl_device_id device;
-  cl_context context;
-  cl_program program;
-  cl_command_queue queue;
+  cl_context context = nullptr;
+  cl_program program = nullptr;
+  cl_command_queue queue = nullptr;
   std::unordered_map<std::string, cl_kernel> loadedKernels;
-  std::unordered_set<cl_mem> loadedBuffers;
+  std::unordered_map<cl_mem, BufferInfo> loadedBuffers;
+  std::map<PoolKey, std::vector<cl_mem>> bufferPool;
+  cl_mem arena = nullptr;
+  size_t arenaSize = 0;
+  size_t arenaUsed = 0;
+  BufferStats bufferStats;
+  std::string binaryCacheDirectory;
+  std::string compilerOptions;
+  bool loadedFromBinaryCache = false;
+  bool profiling = false;
 };
 
 #endif
@@ -3,7 +3,11 @@
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#if defined(__APPLE__) || defined(MACOSX)
 #include <OpenGL/OpenGL.h>
+#elif !defined(_WIN64) && !defined(_WIN32)
+#include <GL/glx.h>
+#endif
 
 #include <string>
 
@@ -51,10 +55,21 @@
     }                                \
   }
 
+// Frames uploaded from the host ping-pong between this many pixel buffers
+#define PIXEL_BUFFER_COUNT 2
+
 class OpenGLProgram {
  public:
   OpenGLProgram()
-      : m_window(nullptr), baseResX(0), baseResY(0), m_fbo(0), m_texture(0) {}
+      : m_window(nullptr),
+        baseResX(0),
+        baseResY(0),
+        m_fbo(0),
+        m_texture(0),
+        m_pixelBuffers{0, 0},
+        m_pixelPointers{nullptr, nullptr},
+        m_uploadFences{nullptr, nullptr},
+        m_persistentPixelBuffers(false) {}
 
   int Init(unsigned int sizeX, unsigned int sizeY);
   int Shutdown();
@@ -62,7 +77,25 @@ class OpenGLProgram {
   int AllocateImageFramebuffer();
   inline GLuint GetFramebufferTexture() { return m_texture; }
 
+  // Pixel buffers for displaying frames that OpenCL cannot write into the
+  // framebuffer texture itself, holding RGB8 rows from the top down. They
+  // stay mapped when the driver supports persistent mapping.
+  int AllocatePixelBuffers();
+  // Host memory for the next frame of buffer index, available once the
+  // upload of the frame written there before has finished
+  int MapPixelBuffer(int index, void** pointer);
+  // Starts copying buffer index into the framebuffer texture without waiting
+  // for the copy to finish
+  int UploadPixelBuffer(int index);
+  inline bool HasPersistentPixelBuffers() const {
+    return m_persistentPixelBuffers;
+  }
+
   int BlitFramebuffer();
+  // Scales the srcX x srcY lower left corner of the framebuffer to the
+  // window, upside down for frames uploaded through pixel buffers
+  int BlitFramebuffer(unsigned int srcX, unsigned int srcY,
+                      bool flipped = false);
   inline int SwapBuffers() {
     GLFW_VOID_ERROR_RETURN(glfwSwapBuffers(m_window));
     return GLFW_NO_ERROR;
@@ -86,18 +119,32 @@ class OpenGLProgram {
 
   int GetWindowPixelSize(int* width, int* height);
 
+  inline bool IsKeyPressed(int key) {
+    return glfwGetKey(m_window, key) == GLFW_PRESS;
+  }
+
  private:
   inline int InitGLFW(unsigned int sizeX, unsigned int sizeY);
   inline int InitGLEW();
   inline int InitOpenGL();
 
   inline int CleanUpFramebuffer();
+  int CleanUpPixelBuffers();
+  inline GLsizeiptr PixelBufferSize() const {
+    return (GLsizeiptr)baseResX * baseResY * 3;
+  }
 
   GLFWwindow* m_window;
   unsigned int baseResX;
   unsigned int baseResY;
   GLuint m_fbo;
   GLuint m_texture;
+  GLuint m_pixelBuffers[PIXEL_BUFFER_COUNT];
+  // Mapped memory of each pixel buffer, or null while unmapped
+  void* m_pixelPointers[PIXEL_BUFFER_COUNT];
+  // Completion of the last upload from each pixel buffer
+  GLsync m_uploadFences[PIXEL_BUFFER_COUNT];
+  bool m_persistentPixelBuffers;
 };
 
 #endif
@@ -0,0 +1,35 @@
+#ifndef RENDER_COORDINATOR_HPP
+#define RENDER_COORDINATOR_HPP
+
+#include <string>
+#include <vector>
+
+#include "Checkpoint.hpp"
+#include "RenderServer.hpp"
+
+// Splits a render job into bands of rows and renders them on render servers
+// acting as workers, each in its own process and possibly on its own device
+// or node. Workers are Unix socket paths or TCP host:port addresses.
+// Every pixel is rendered whole by one worker with the same passes and seeds
+// as in a single process, so the merged accumulation is bit-identical no
+// matter how the rows are split.
+class RenderCoordinator {
+ public:
+  explicit RenderCoordinator(const std::vector<std::string> &workerAddresses)
+      : workerAddresses(workerAddresses) {}
+
+  // Renders all samples of job into checkpoint, fetching the bands from the
+  // workers in parallel. Returns 0 on success.
+  int Render(const RenderJob &job, Checkpoint &checkpoint,
+             std::string &errorLog) const;
+
+  // Splits height rows into at most workers bands of whole tiles, as
+  // beginnings and counts
+  static void Partition(int height, int workers, std::vector<int> &rowBegins,
+                        std::vector<int> &rowCounts);
+
+ private:
+  std::vector<std::string> workerAddresses;
+};
+
+#endif
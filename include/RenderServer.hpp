@@ -0,0 +1,160 @@
+#ifndef RENDER_SERVER_HPP
+#define RENDER_SERVER_HPP
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Renderer.hpp"
+
+// Compiled programs kept warm by the server before the least recently used
+// one is released
+#define MAX_CACHED_RENDERERS 8
+
+// Seconds a client may stall sending its request or taking the response
+// before the server drops it, and the longest request line it reads
+#define RENDER_SERVER_TIMEOUT 10
+#define RENDER_SERVER_MAX_LINE 16384
+
+// Request prefix asking the server to return the raw accumulation of a job
+// instead of writing an image
+#define ACCUMULATE_REQUEST "accumulate "
+
+// One render request. On the job socket it is a single line of space
+// separated key=value pairs, e.g.
+//   scene=default width=256 height=256 spp=64 depth=50 origin=0,0,2
+//   lookat=0,0,-1 fov=90 output=/tmp/thumb.png format=qoi
+// Keys that are left out keep their default value. rows=<BEGIN>,<COUNT>
+// limits the job to a band of rows. sample_format, precision, scene_cache,
+// tile_culling and persistent_threads take the values of the matching
+// command line options. Values with spaces, quotes or line
+// breaks are double quoted with backslash escapes, e.g.
+//   output="/tmp/my renders/thumb.png"
+struct RenderJob {
+  std::string scene;
+  int width;
+  int height;
+  int samples;
+  int depth;
+  CLTypes::Vector3 origin;
+  CLTypes::Vector3 lookAt;
+  float fov;
+  std::string outputPath;
+  std::string format;
+  int rowBegin;
+  // Rows of the band, 0 for the whole image
+  int rowCount;
+  // Renderer settings that change the samples or how they are traced, which
+  // every worker of a split render must share
+  SampleFormat sampleFormat;
+  PrecisionProfile precision;
+  KernelFeature sceneCache;
+  KernelFeature tileCulling;
+  KernelFeature persistentThreads;
+
+  RenderJob()
+      : scene("default"),
+        width(BASE_RESOLUTION),
+        height(BASE_RESOLUTION),
+        samples(BASE_SAMPLES),
+        depth(50),
+        origin(0, 0, 2),
+        lookAt(0, 0, -1),
+        fov(90),
+        rowBegin(0),
+        rowCount(0),
+        sampleFormat(SAMPLE_PLANAR),
+        precision(PRECISION_EXACT),
+        sceneCache(FEATURE_AUTO),
+        tileCulling(FEATURE_AUTO),
+        persistentThreads(FEATURE_AUTO) {}
+
+  inline int BandRows() const { return rowCount > 0 ? rowCount : height; }
+  // Jobs render in passes of at most BASE_SAMPLES samples, so the program
+  // does not depend on the sample count
+  inline RenderSettings Settings() const {
+    return RenderSettings(width, height, BASE_SAMPLES, depth, CL_TRUE,
+                          sceneCache, tileCulling, sampleFormat, precision,
+                          persistentThreads);
+  }
+
+  std::string Serialize() const;
+  // Returns 0 on success
+  int Parse(const std::string &request);
+};
+
+// Long-lived process that keeps OpenCL contexts, compiled programs and
+// uploaded scenes alive between render jobs received over a Unix domain
+// socket, or over TCP for an address of the form host:port. Jobs are
+// rendered one after another, since they share the device.
+//
+// TCP has no authentication, so it listens on loopback unless remote clients
+// are allowed, TCP jobs only write files by name into the output directory,
+// and the server only shuts down on request over the Unix socket.
+class RenderServer {
+ public:
+  RenderServer(cl_platform_id platform, cl_device_id device)
+      : platform(platform),
+        device(device),
+        useCounter(0),
+        tcp(false),
+        allowRemote(false) {}
+  ~RenderServer();
+
+  // Whether a TCP address may bind interfaces other than loopback
+  inline void SetAllowRemote(bool allow) { allowRemote = allow; }
+  // Directory the outputs of TCP jobs are written to, without which TCP
+  // jobs can only return accumulations
+  inline void SetOutputDirectory(const std::string &directory) {
+    outputDirectory = directory;
+  }
+
+  // Serves jobs on socketPath until a "shutdown" request arrives. Socket
+  // arguments are Unix socket paths or TCP host:port addresses, where an
+  // empty host means loopback.
+  int Run(const std::string &socketPath);
+
+  // Client side of the protocol: sends one request line and waits for the
+  // response line
+  static int Submit(const std::string &socketPath, const std::string &request,
+                    std::string &response);
+  // Sends job as an accumulate request and receives the float4 sums and
+  // sample counts of its band of rows, as in Checkpoint::accumulation.
+  // Samples are raw floats in host byte order, so workers must share the
+  // coordinator's. Returns 0 on success, or 1 with the response in errorLog.
+  static int FetchAccumulation(const std::string &socketPath,
+                               const RenderJob &job,
+                               std::vector<cl_float4> &rows,
+                               std::string &errorLog);
+
+ private:
+  struct CachedRenderer {
+    std::unique_ptr<Renderer> renderer;
+    unsigned long lastUsed;
+  };
+
+  std::string HandleRequest(const std::string &request);
+  std::string RenderToFile(const RenderJob &job);
+  // Enqueues rendering job into the accumulation of renderer. Returns an
+  // empty string on success and the error response otherwise.
+  std::string RenderAccumulation(const RenderJob &job, Renderer *renderer);
+  // Answers an accumulate request on connection with a response line and,
+  // on success, the raw accumulation of the band. Returns the response line.
+  std::string SendAccumulation(int connection, const std::string &request);
+  // Returns the renderer for the job's settings and scene, compiling one
+  // if none is cached. Fails with the reason in errorLog when the program
+  // cannot be built or the device cannot honor the job's forced settings.
+  Renderer *GetRenderer(const RenderJob &job, bool &cacheHit,
+                        std::string &errorLog);
+
+  cl_platform_id platform;
+  cl_device_id device;
+  std::unordered_map<std::string, CachedRenderer> renderers;
+  unsigned long useCounter;
+  bool tcp;
+  bool allowRemote;
+  std::string outputDirectory;
+};
+
+#endif
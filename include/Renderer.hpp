@@ -0,0 +1,393 @@
+#ifndef RENDERER_HPP
+#define RENDERER_HPP
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Include this first to init GLEW
+#include "OpenCLProgram.hpp"
+//
+#include "CLTypes.hpp"
+#include "Checkpoint.hpp"
+#include "KernelHandle.hpp"
+
+// File paths
+#define CL_KERNEL_PATH "./cl_src/main.cl"
+#define KERNEL_INCLUDE "./cl_header/"
+// Required OpenCL definition parameters
+#define WIDTH "WIDTH"
+#define HEIGHT "HEIGHT"
+#define SAMPLES "SAMPLES"
+#define DEPTH "DEPTH"
+#define NUM_SPHERES "NUM_SPHERES"
+#define NUM_LIGHTS "NUM_LIGHTS"
+#define USE_PINHOLE_CAMERA "USE_PINHOLE_CAMERA"
+#define SCENE_IN_GLOBAL_MEMORY "SCENE_IN_GLOBAL_MEMORY"
+#define SCENE_CACHE_SIZE "SCENE_CACHE_SIZE"
+#define TILE_SIZE "TILE_SIZE"
+#define TILE_CANDIDATES "TILE_CANDIDATES"
+#define SAMPLE_FORMAT "SAMPLE_FORMAT"
+#define PRECISION "PRECISION"
+#define SCALAR_SPHERES "SCALAR_SPHERES"
+// Kernel names
+#define RAYTRACE_KERNEL "raytrace"
+#define COLOR_BUFFER_KERNEL "color_compress_buffer"
+#define COLOR_IMAGE_KERNEL "color_compress_image"
+#define COLOR_FLOAT_KERNEL "color_resolve_float"
+#define ACCUMULATE_KERNEL "accumulate_samples"
+#define ACCUMULATION_BUFFER_KERNEL "accumulation_compress_buffer"
+#define ACCUMULATION_FLOAT_KERNEL "accumulation_resolve_float"
+#define FUSED_BUFFER_KERNEL "trace_resolve_buffer"
+#define FUSED_IMAGE_KERNEL "trace_resolve_image"
+#define FUSED_FLOAT_KERNEL "trace_resolve_float"
+#define TEMPORAL_TRACE_KERNEL "trace_frame"
+#define TEMPORAL_RESOLVE_KERNEL "temporal_resolve"
+#define PERSISTENT_KERNEL "raytrace_persistent"
+
+// Work is broken down into smaller chunks so that the GPU does not time out
+// for large combinations of resolution and sample count
+#define BASE_RESOLUTION 512
+#define BASE_SAMPLES 16
+
+// Resolved output is only written by kernels and read back by the host, so it
+// is allocated in host accessible memory and mapped instead of copied
+#define READBACK_BUFFER_FLAGS \
+  (CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR | CL_MEM_HOST_READ_ONLY)
+
+// Spheres a work group loads into local memory at a time when the scene is
+// cached, as a float4 each. A multiple of SPHERE_BATCH_SIZE.
+#define SCENE_CACHE_SPHERES 256
+
+// Spheres the kernels intersect at once, from batches of their center
+// coordinates and radii stored after the spheres in the scene buffer
+#define SPHERE_BATCH_SIZE 4
+
+// Primary rays are traced in square tiles of this many pixels per side, each
+// culling the scene to the spheres inside its frustum first. A tile keeps at
+// most TILE_CANDIDATE_CAPACITY candidates and tests the whole scene beyond.
+#define TILE_PIXELS 8
+#define TILE_CANDIDATE_CAPACITY 256
+// Smallest scene for which automatic tile culling is worth its barriers
+#define TILE_CULLING_MIN_SPHERES 16
+
+// Persistent tracing launches this many work groups per compute unit, enough
+// for the device to hide memory latency, of at most PERSISTENT_GROUP_SIZE
+// work items each
+#define PERSISTENT_GROUPS_PER_UNIT 4
+#define PERSISTENT_GROUP_SIZE 64
+
+// Largest error in linear color, against interleaved float, that a trace
+// buffer format may add to a channel of a resolved pixel, relative to the sum
+// of the reference pixel's channels. Samples are not bounded, emissive
+// spheres reach 80, but half rounds each channel and RGBE each sample's
+// brightest channel to a fixed number of bits, so the error grows with the
+// samples and their mean. Pixels dimmer than 1.0 are held to these as
+// absolute errors, which also covers half's denormals.
+#define SAMPLE_ERROR_BUDGET_FLOAT 1e-6
+#define SAMPLE_ERROR_BUDGET_HALF 1e-3
+#define SAMPLE_ERROR_BUDGET_RGBE 5e-3
+
+// Storage formats of the trace buffer, passed to the kernel as SAMPLE_FORMAT:
+//   SAMPLE_FLOAT    interleaved float RGB, 12 bytes per sample
+//   SAMPLE_PLANAR   one float plane per channel, 12 bytes with coalesced
+//                   access
+//   SAMPLE_HALF     one half float plane per channel, 6 bytes
+//   SAMPLE_RGBE     8-bit mantissas with a shared exponent, 4 bytes
+enum SampleFormat { SAMPLE_FLOAT, SAMPLE_PLANAR, SAMPLE_HALF, SAMPLE_RGBE };
+
+// Default bound on the RMSE in linear color a precision profile may add to a
+// frame against the exact profile, at the same samples per pixel
+#define PRECISION_MAX_RMSE 0.01
+
+// Precision profiles the program is built with, passed to the kernel as
+// PRECISION:
+//   PRECISION_EXACT       full precision math, no compiler relaxations
+//   PRECISION_FAST        -cl-fast-relaxed-math and -cl-mad-enable, with
+//                         native_* math and fast_normalize in the kernels
+//   PRECISION_AGGRESSIVE  fast, with denormals flushed to zero and random
+//                         numbers converted to float by bit manipulation
+enum PrecisionProfile {
+  PRECISION_EXACT,
+  PRECISION_FAST,
+  PRECISION_AGGRESSIVE
+};
+
+// Optional kernel variants. The automatic mode lets the renderer decide from
+// the scene and device.
+enum KernelFeature { FEATURE_AUTO, FEATURE_ON, FEATURE_OFF };
+
+// Settings the ray tracing program is compiled for
+struct RenderSettings {
+  int sizeX;
+  int sizeY;
+  // Samples per pixel the trace buffer holds, the most a single Trace call
+  // can cover
+  int samples;
+  int depth;
+  cl_bool usePinholeCamera;
+  // Cooperative caching of the scene in local memory, automatically for
+  // scenes too large for constant memory
+  KernelFeature sceneCache;
+  // Per-tile frustum culling of primary rays, automatically for pinhole
+  // cameras and scenes of at least TILE_CULLING_MIN_SPHERES spheres
+  KernelFeature tileCulling;
+  // Tracing with only enough work groups to fill the device, which pull
+  // batches of samples until the pass is done. Experimental and opt-in: the
+  // automatic mode leaves it off, as its gain has never been measured.
+  KernelFeature persistentThreads;
+  SampleFormat sampleFormat;
+  PrecisionProfile precision;
+
+  RenderSettings(int sizeX, int sizeY, int samples, int depth,
+                 cl_bool usePinholeCamera = CL_TRUE,
+                 KernelFeature sceneCache = FEATURE_AUTO,
+                 KernelFeature tileCulling = FEATURE_AUTO,
+                 SampleFormat sampleFormat = SAMPLE_PLANAR,
+                 PrecisionProfile precision = PRECISION_EXACT,
+                 KernelFeature persistentThreads = FEATURE_AUTO)
+      : sizeX(sizeX),
+        sizeY(sizeY),
+        samples(samples),
+        depth(depth),
+        usePinholeCamera(usePinholeCamera),
+        sceneCache(sceneCache),
+        tileCulling(tileCulling),
+        persistentThreads(persistentThreads),
+        sampleFormat(sampleFormat),
+        precision(precision) {}
+};
+
+// Owns a compiled ray tracing program together with the scene, camera and
+// sample buffers it renders from, so that several frames or jobs can be
+// rendered without recompiling or re-uploading the scene.
+class Renderer {
+ public:
+  Renderer()
+      : settings(0, 0, 0, 0),
+        numSpheres(0),
+        sceneCached(false),
+        tileCulled(false),
+        persistent(false),
+        persistentGroups(0),
+        persistentGroupSize(0),
+        traceResultsBuffer(nullptr),
+        workCounterBuffer(nullptr),
+        sceneBuffer(nullptr),
+        cameraBuffer(nullptr),
+        previousCameraBuffer(nullptr),
+        accumulationBuffer(nullptr),
+        temporalFrames{nullptr, nullptr},
+        temporalHistory{nullptr, nullptr},
+        temporalIndex(0),
+        previousViewX(0),
+        previousViewY(0),
+        temporalValid(false) {}
+
+  static void CalculateWorkIterations(
+      int sizeX, int sizeY, int ns, std::vector<std::vector<size_t>> &workSizes,
+      std::vector<std::vector<size_t>> &workOffsets);
+
+  // Returns the kernel source embedded at build time, or reads it from
+  // CL_KERNEL_PATH in builds without EMBED_KERNELS
+  static cl_int LoadKernelSource(std::string &source);
+
+  // Device binaries of every program built afterwards are cached in
+  // directory, an empty string turns the cache off
+  static inline void SetBinaryCacheDirectory(const std::string &directory) {
+    binaryCacheDirectory = directory;
+  }
+  // The user's cache directory, created if needed, or an empty string
+  static std::string DefaultBinaryCacheDirectory();
+  // Whether Unload prints how much device memory the renderer's buffers took
+  static inline void SetPrintBufferStats(bool print) {
+    printBufferStats = print;
+  }
+  // Whether programs built afterwards time their device commands for Metrics
+  static inline void SetRecordDeviceTimes(bool record) {
+    recordDeviceTimes = record;
+  }
+  // Whether programs built afterwards intersect one sphere at a time instead
+  // of SPHERE_BATCH_SIZE at once, to benchmark the batches against
+  static inline void SetScalarSpheres(bool scalar) { scalarSpheres = scalar; }
+
+  // Trace buffer formats by name: float, planar, half or rgbe. Parse returns
+  // false for unknown names.
+  static bool ParseSampleFormat(const std::string &name, SampleFormat &format);
+  static std::string SampleFormatName(SampleFormat format);
+  static size_t SampleBytes(SampleFormat format);
+  static double SampleErrorBudget(SampleFormat format);
+  // Kernel feature switches by name: auto, on or off. Parse returns false
+  // for unknown names.
+  static bool ParseFeature(const std::string &name, KernelFeature &feature);
+  static std::string FeatureName(KernelFeature feature);
+  // Precision profiles by name: exact, fast or aggressive. Parse returns
+  // false for unknown names.
+  static bool ParsePrecision(const std::string &name,
+                             PrecisionProfile &precision);
+  static std::string PrecisionName(PrecisionProfile precision);
+  // Compiler flags of a profile
+  static std::string PrecisionCompilerOptions(PrecisionProfile precision);
+
+  cl_int Init(cl_platform_id platform, cl_device_id device,
+              const RenderSettings &renderSettings,
+              const std::vector<CLTypes::Sphere> &world,
+              const std::unordered_map<cl_context_properties,
+                                       cl_context_properties> &properties,
+              std::string &errorLog);
+  cl_int Unload();
+
+  // Replaces the camera used by traces enqueued after this call. The replaced
+  // camera is kept as the previous one for temporal reuse.
+  cl_int SetCamera(const CLTypes::Camera &camera);
+
+  // Enqueues tracing of ns samples per pixel into the trace buffer. Samples
+  // are numbered from sampleOffset, which seeds their random sequences.
+  cl_int Trace(int ns, cl_uint sampleOffset = 0);
+  // Trace restricted to rowCount rows from rowBegin, for renders split into
+  // bands of rows. Pixels trace the same samples as in a full Trace.
+  cl_int TraceRows(int ns, cl_uint sampleOffset, int rowBegin, int rowCount);
+
+  // Enqueues averaging of the traced samples into output, either as gamma
+  // corrected 8-bit color or as linear float color
+  cl_int Resolve(bool floatOutput, cl_mem output);
+
+  // Whether ns samples per pixel can be traced and resolved in one kernel,
+  // which splits the image like Trace but keeps every sample of a pixel in
+  // one work item
+  inline bool CanFuse(int ns) const { return ns <= BASE_SAMPLES; }
+  // Enqueues tracing of ns samples per pixel resolved straight into output
+  // or into a GL image, fused into one kernel that skips the trace buffer
+  // whenever CanFuse allows and as Trace and Resolve otherwise
+  cl_int TraceResolved(int ns, bool floatOutput, cl_mem output,
+                       cl_uint sampleOffset = 0);
+  // The image may also be traced at a smaller viewX x viewY resolution into
+  // its lower left corner, which needs the fused kernel
+  cl_int TraceResolvedImage(int ns, cl_mem image, int viewX, int viewY,
+                            cl_uint sampleOffset = 0);
+
+  // Like TraceResolvedImage, but blends the frame with the previous one
+  // reprojected from the previous camera, so a moving view keeps the samples
+  // of the surfaces that stay visible. Needs CanFuse(ns) and a pinhole
+  // camera. The sample offset should advance every frame so that still views
+  // keep converging.
+  cl_int TraceTemporalImage(int ns, cl_mem image, int viewX, int viewY,
+                            cl_uint sampleOffset);
+  // Starts the next temporal frame without history
+  inline void ResetTemporal() { temporalValid = false; }
+
+  // Accumulation of several traces in a float4 per pixel, holding the sum of
+  // samples in xyz and their count in w
+  cl_int ClearAccumulation();
+  cl_int UploadAccumulation(const Checkpoint &checkpoint);
+  cl_int ReadAccumulation(Checkpoint &checkpoint);
+  // Enqueues adding ns traced samples per pixel to the accumulation
+  cl_int Accumulate(cl_uint ns);
+  // Accumulate and read back restricted to a band of rows, with rows holding
+  // the band's pixels afterwards
+  cl_int AccumulateRows(cl_uint ns, int rowBegin, int rowCount);
+  cl_int ReadAccumulationRows(int rowBegin, int rowCount,
+                              std::vector<cl_float4> &rows);
+  cl_int ResolveAccumulation(bool floatOutput, cl_mem output);
+
+  // Traces runs passes of the full trace buffer after an untimed warm-up
+  // pass and reports traced samples per second
+  cl_int Benchmark(int runs, double &samplesPerSecond);
+
+  // Creates a buffer the host can map to read resolved output
+  cl_int CreateReadbackBuffer(bool floatOutput, cl_mem *buffer);
+  size_t ResolvedSize(bool floatOutput) const;
+  size_t TraceBufferSize() const;
+
+  inline OpenCLProgram &GetProgram() { return program; }
+  inline const RenderSettings &GetSettings() const { return settings; }
+  inline cl_mem GetTraceResultsBuffer() const { return traceResultsBuffer; }
+  // Whether the program was built with the local memory scene cache
+  inline bool IsSceneCached() const { return sceneCached; }
+  // Whether primary rays are traced in tiles culled against the scene
+  inline bool IsTileCulled() const { return tileCulled; }
+  // Whether Trace runs persistent work groups
+  inline bool IsPersistent() const { return persistent; }
+
+ private:
+  // Argument types of the kernels. Trace kernels start with the camera,
+  // spheres and output, resolve kernels take their input and output.
+  typedef KernelHandle<cl_mem, cl_mem, cl_mem, cl_uint> RaytraceKernel;
+  // Raytrace followed by the work counter and the chunk's origin and size
+  typedef KernelHandle<cl_mem, cl_mem, cl_mem, cl_uint, cl_mem, cl_uint4,
+                       cl_uint4>
+      PersistentKernel;
+  typedef KernelHandle<cl_mem, cl_mem> ResolveKernel;
+  typedef KernelHandle<cl_mem, cl_mem, cl_uint> AccumulateKernel;
+  // Sample offset and count follow the output, and a view size for kernels
+  // that may trace part of the image
+  typedef KernelHandle<cl_mem, cl_mem, cl_mem, cl_uint, cl_uint> FusedKernel;
+  typedef KernelHandle<cl_mem, cl_mem, cl_mem, cl_uint, cl_uint, cl_uint2>
+      FusedViewKernel;
+  // Cameras, frames and histories, output image, sample count, view sizes
+  // and whether there is history
+  typedef KernelHandle<cl_mem, cl_mem, cl_mem, cl_mem, cl_mem, cl_mem, cl_mem,
+                       cl_uint, cl_uint2, cl_uint2, cl_uint>
+      TemporalResolveKernel;
+
+  // Copies the spheres followed by their batches into data
+  static void PackScene(const std::vector<CLTypes::Sphere> &scene,
+                        std::vector<cl_float4> &data);
+  cl_int CreateAccumulation(void *data);
+  // Trace of the chunks with persistent work groups
+  cl_int TracePersistent(cl_uint sampleOffset,
+                         const std::vector<std::vector<size_t>> &chunkSizes,
+                         const std::vector<std::vector<size_t>> &chunkOffsets);
+  // Runs a 2D kernel over sizeX x sizeY pixels in the same chunks as Trace,
+  // padded to whole tiles when tiles are culled
+  template <typename Kernel>
+  cl_int ExecutePixelKernel(const Kernel &kernel, int sizeX, int sizeY);
+  template <typename Kernel>
+  cl_int SetFusedArguments(Kernel &kernel, int ns, cl_mem output,
+                           cl_uint sampleOffset);
+  cl_int CreateTemporalBuffers();
+
+  OpenCLProgram program;
+  RaytraceKernel raytraceKernel;
+  PersistentKernel persistentKernel;
+  ResolveKernel colorBufferKernel;
+  ResolveKernel colorImageKernel;
+  ResolveKernel colorFloatKernel;
+  AccumulateKernel accumulateKernel;
+  ResolveKernel accumulationBufferKernel;
+  ResolveKernel accumulationFloatKernel;
+  FusedKernel fusedBufferKernel;
+  FusedViewKernel fusedImageKernel;
+  FusedKernel fusedFloatKernel;
+  FusedViewKernel temporalTraceKernel;
+  TemporalResolveKernel temporalResolveKernel;
+  RenderSettings settings;
+  int numSpheres;
+  bool sceneCached;
+  bool tileCulled;
+  bool persistent;
+  size_t persistentGroups;
+  size_t persistentGroupSize;
+  cl_mem traceResultsBuffer;
+  // Next unclaimed item of a persistent trace
+  cl_mem workCounterBuffer;
+  cl_mem sceneBuffer;
+  cl_mem cameraBuffer;
+  cl_mem previousCameraBuffer;
+  cl_mem accumulationBuffer;
+  // Temporal reuse ping-pongs between two frames of color and first hit
+  // distance, and two histories, indexed by temporalIndex for the latest
+  cl_mem temporalFrames[2];
+  cl_mem temporalHistory[2];
+  int temporalIndex;
+  int previousViewX;
+  int previousViewY;
+  bool temporalValid;
+
+  static std::string binaryCacheDirectory;
+  static bool printBufferStats;
+  static bool recordDeviceTimes;
+  static bool scalarSpheres;
+};
+
+#endif
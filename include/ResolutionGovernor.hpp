@@ -0,0 +1,43 @@
+#ifndef RESOLUTION_GOVERNOR_HPP
+#define RESOLUTION_GOVERNOR_HPP
+
+// Lowest scale of each side of the image the governor goes down to
+#define RESOLUTION_MIN_SCALE 0.25f
+// Weight of the newest frame in the smoothed render time
+#define RESOLUTION_SMOOTHING 0.25
+// The scale drops once the smoothed render time exceeds the frame budget by
+// this factor, and only rises again below RESOLUTION_HEADROOM of the budget
+#define RESOLUTION_OVER_BUDGET 1.05
+#define RESOLUTION_HEADROOM 0.8
+// Largest factor the scale rises by at a time, so a cheap view is approached
+// gradually instead of overshooting the budget
+#define RESOLUTION_MAX_STEP_UP 1.1f
+// Frames to wait after a change before judging the new scale
+#define RESOLUTION_SETTLE_FRAMES 8
+
+// Picks the internal resolution of interactive frames so that rendering one
+// holds a target frame rate. Trace time grows with the number of pixels, so
+// each side scales with the square root of the budget over the measured time.
+class ResolutionGovernor {
+ public:
+  // A target of 0 or less keeps the full resolution
+  explicit ResolutionGovernor(double targetFps,
+                              float minScale = RESOLUTION_MIN_SCALE);
+
+  // Records how long the last frame took to render
+  void Update(double frameSeconds);
+
+  inline float GetScale() const { return scale; }
+  // Scaled resolution of a sizeX x sizeY image, at least a pixel per side
+  void ScaledSize(int sizeX, int sizeY, int &scaledX, int &scaledY) const;
+
+ private:
+  double frameBudget;
+  float minScale;
+  float scale;
+  // Smoothed render time at the current scale, 0 until the first frame
+  double averageSeconds;
+  int settleFrames;
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SAMPLE_BUDGET_HPP
+#define SAMPLE_BUDGET_HPP
+
+// Share of the frame budget samples may fill while the camera moves and
+// while it is still. Moving frames are replaced quickly, so they trade noise
+// for headroom against views that suddenly get more expensive.
+#define SAMPLE_BUDGET_MOVING 0.5
+#define SAMPLE_BUDGET_STILL 0.9
+// Weight of the newest frame in the smoothed cost of a sample
+#define SAMPLE_BUDGET_SMOOTHING 0.25
+
+// Picks the samples per pixel of each interactive frame from the render time
+// of the previous ones, so that frames stay within the budget of a target
+// frame rate. Only the sample count of the trace changes, never the program.
+class SampleBudget {
+ public:
+  // A target of 0 or less always traces maxSamples
+  SampleBudget(double targetFps, int maxSamples);
+
+  // Samples per pixel to trace in the next frame
+  inline int GetSamples() const { return samples; }
+
+  // Records the render time of a frame traced with GetSamples() samples.
+  // Returns that time scaled to a single sample per pixel.
+  double Update(double frameSeconds, bool cameraMoving);
+
+ private:
+  double frameBudget;
+  int maxSamples;
+  int samples;
+  // Smoothed render time per sample per pixel, 0 until the first frame
+  double sampleSeconds;
+};
+
+#endif
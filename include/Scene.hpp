@@ -0,0 +1,21 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <string>
+#include <vector>
+
+#include "CLTypes.hpp"
+
+// Sphere list uploaded to the ray tracing program
+struct Scene {
+  std::vector<CLTypes::Sphere> spheres;
+
+  // Builds one of the built-in scenes by name, "default", "lights" or
+  // "random:<N>".
+  // Returns 0 on success.
+  int Load(const std::string &name);
+  // Emissive spheres, which the kernel samples directly when there are any
+  int NumLights() const;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads for host-side work (readback, image
+// encoding) that should overlap with device execution. Tasks return an int
+// status code like the rest of the program.
+class ThreadPool {
+ public:
+  explicit ThreadPool(unsigned int numThreads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  template <typename F>
+  std::future<int> Enqueue(F &&task) {
+    auto packaged =
+        std::make_shared<std::packaged_task<int()>>(std::forward<F>(task));
+    std::future<int> result = packaged->get_future();
+    {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      tasks.emplace([packaged]() { (*packaged)(); });
+    }
+    queueCondition.notify_one();
+    return result;
+  }
+
+  inline unsigned int GetThreadCount() const { return workers.size(); }
+
+  // Number of threads left for host work when one core drives the device
+  static unsigned int RemainingCores();
+
+ private:
+  void WorkerLoop();
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex queueMutex;
+  std::condition_variable queueCondition;
+  bool stopping;
+};
+
+#endif
@@ -1,9 +1,18 @@
 #ifndef VECTOR_3_HPP
 #define VECTOR_3_HPP
 
+#if defined(__APPLE__) || defined(MACOSX)
 #include <OpenCL/opencl.h>
+#else
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 120
+#endif
+#include <CL/cl.h>
+#endif
 
+#include <cstdio>
 #include <glm/ext.hpp>
+#include <string>
 
 namespace CLTypes {
 
@@ -47,6 +56,16 @@ class Vector3 {
 
   inline cl_float3 GetCLVector() const { return data; }
 
+  // Reads a vector written as "x,y,z"
+  static bool Parse(const std::string& text, Vector3& result) {
+    float x, y, z;
+    if (sscanf(text.c_str(), "%f,%f,%f", &x, &y, &z) != 3) {
+      return false;
+    }
+    result = Vector3(x, y, z);
+    return true;
+  }
+
  private:
   cl_float3 data;
 };
@@ -0,0 +1,143 @@
+#include "Checkpoint.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+const char CHECKPOINT_MAGIC[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '3'};
+
+// Followed by sceneLength bytes of scene name, then the accumulation
+struct CheckpointHeader {
+  char magic[8];
+  cl_uint width;
+  cl_uint height;
+  cl_uint samples;
+  cl_uint depth;
+  cl_float origin[3];
+  cl_float lookAt[3];
+  cl_float fov;
+  cl_uint precision;
+  cl_uint sampleFormat;
+  cl_uint numLights;
+  cl_uint sceneLength;
+};
+
+std::string describe(const CheckpointHeader &header,
+                     const std::string &scene) {
+  std::ostringstream text;
+  text << header.width << "x" << header.height << " of scene " << scene
+       << " at depth " << header.depth << " from " << header.origin[0] << ","
+       << header.origin[1] << "," << header.origin[2] << " towards "
+       << header.lookAt[0] << "," << header.lookAt[1] << ","
+       << header.lookAt[2] << " with fov " << header.fov << ", precision "
+       << header.precision << ", sample format " << header.sampleFormat
+       << " and " << header.numLights << " lights";
+  return text.str();
+}
+
+}  // namespace
+
+int Checkpoint::Save(const std::string &path) const {
+  CheckpointHeader header;
+  memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.width = width;
+  header.height = height;
+  header.samples = samples;
+  header.depth = depth;
+  header.origin[0] = origin.x();
+  header.origin[1] = origin.y();
+  header.origin[2] = origin.z();
+  header.lookAt[0] = lookAt.x();
+  header.lookAt[1] = lookAt.y();
+  header.lookAt[2] = lookAt.z();
+  header.fov = fov;
+  header.precision = precision;
+  header.sampleFormat = sampleFormat;
+  header.numLights = numLights;
+  header.sceneLength = scene.size();
+
+  std::string temporaryPath = path + ".tmp";
+  {
+    std::ofstream file(temporaryPath, std::ofstream::binary);
+    file.write((const char *)&header, sizeof(header));
+    file.write(scene.data(), scene.size());
+    file.write((const char *)accumulation.data(),
+               accumulation.size() * sizeof(cl_float4));
+    if (!file.good()) {
+      return 1;
+    }
+  }
+  return rename(temporaryPath.c_str(), path.c_str()) == 0 ? 0 : 1;
+}
+
+int Checkpoint::Load(const std::string &path, std::string &errorLog) {
+  std::ifstream file(path, std::ifstream::binary);
+  CheckpointHeader header;
+  if (!file.read((char *)&header, sizeof(header)) ||
+      memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+    errorLog = "not a checkpoint of this version";
+    return 1;
+  }
+  std::string savedScene(header.sceneLength, '\0');
+  if (!file.read(&savedScene[0], savedScene.size())) {
+    errorLog = "truncated checkpoint";
+    return 1;
+  }
+
+  CheckpointHeader expected;
+  memcpy(&expected, &header, sizeof(expected));
+  expected.width = width;
+  expected.height = height;
+  expected.depth = depth;
+  expected.origin[0] = origin.x();
+  expected.origin[1] = origin.y();
+  expected.origin[2] = origin.z();
+  expected.lookAt[0] = lookAt.x();
+  expected.lookAt[1] = lookAt.y();
+  expected.lookAt[2] = lookAt.z();
+  expected.fov = fov;
+  expected.precision = precision;
+  expected.sampleFormat = sampleFormat;
+  expected.numLights = numLights;
+  expected.sceneLength = scene.size();
+  if (memcmp(&expected, &header, sizeof(header)) != 0 ||
+      savedScene != scene) {
+    errorLog = "rendered " + describe(header, savedScene) + ", not " +
+               describe(expected, scene);
+    return 1;
+  }
+
+  samples = header.samples;
+  accumulation.resize((size_t)width * height);
+  if (!file.read((char *)accumulation.data(),
+                 accumulation.size() * sizeof(cl_float4))) {
+    errorLog = "truncated checkpoint";
+    return 1;
+  }
+  return 0;
+}
+
+void Checkpoint::Resolve(bool floatOutput,
+                         std::vector<unsigned char> &pixels) const {
+  const size_t channels = accumulation.size() * 3;
+  pixels.resize(channels * (floatOutput ? sizeof(float) : 1));
+  float *linear = (float *)pixels.data();
+  for (size_t i = 0; i < accumulation.size(); ++i) {
+    const cl_float4 &sum = accumulation[i];
+    const float count = std::max(sum.s[3], 1.0f);
+    for (int c = 0; c < 3; ++c) {
+      float color = sum.s[c] / count;
+      if (floatOutput) {
+        linear[i * 3 + c] = color;
+      } else {
+        // Same gamma and quantization as the resolve kernels
+        pixels[i * 3 + c] = (unsigned char)(255.99 * std::sqrt(color));
+      }
+    }
+  }
+}
@@ -0,0 +1,130 @@
+#include "Convergence.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "Scene.hpp"
+
+ImageError ImageError::Measure(const std::vector<float> &pixels,
+                               const std::vector<float> &reference) {
+  ImageError result;
+  result.maxError = 0.0;
+  result.maxRelativeError = 0.0;
+  double squaredError = 0.0;
+  double relativeError = 0.0;
+  const size_t count = std::min(pixels.size(), reference.size());
+  for (size_t i = 0; i < count; ++i) {
+    double error = std::fabs((double)pixels[i] - reference[i]);
+    // NaN and infinite colors count as infinitely wrong
+    if (!std::isfinite(pixels[i])) {
+      error = INFINITY;
+    }
+    squaredError += error * error;
+    relativeError += error * error / ((double)reference[i] * reference[i] +
+                                      CONVERGENCE_REL_EPSILON);
+    const size_t pixel = i - i % 3;
+    double magnitude = IMAGE_ERROR_MIN_MAGNITUDE;
+    if (pixel + 2 < count) {
+      magnitude = std::max(magnitude, (double)reference[pixel] +
+                                          reference[pixel + 1] +
+                                          reference[pixel + 2]);
+    }
+    result.maxError = std::max(result.maxError, error);
+    result.maxRelativeError =
+        std::max(result.maxRelativeError, error / magnitude);
+  }
+  result.rmse = std::sqrt(squaredError / std::max(count, (size_t)1));
+  result.relMse = relativeError / std::max(count, (size_t)1);
+  result.psnr = result.rmse > 0.0 ? 20.0 * std::log10(1.0 / result.rmse)
+                                  : INFINITY;
+  return result;
+}
+
+void ConvergenceHarness::WriteHeader(std::ostream &csv) {
+  csv << "scene,precision,sample_format,spp,seconds,rmse,relmse,psnr"
+      << std::endl;
+}
+
+cl_int ConvergenceHarness::Run(const std::string &sceneName,
+                               const RenderSettings &candidate,
+                               const CLTypes::Camera &camera, int maxSamples,
+                               std::ostream &csv, std::string &errorLog) {
+  Scene scene;
+  if (scene.Load(sceneName) != 0) {
+    errorLog = "unknown scene " + sceneName;
+    return CL_INVALID_VALUE;
+  }
+
+  // The reference is rendered the most precise way, so that the candidate's
+  // error includes what its settings lose
+  RenderSettings referenceSettings = candidate;
+  referenceSettings.precision = PRECISION_EXACT;
+  referenceSettings.sampleFormat = SAMPLE_FLOAT;
+  std::vector<float> reference;
+  CL_ERROR_RETURN(Render(
+      referenceSettings, scene.spheres, camera, CONVERGENCE_REFERENCE_OFFSET,
+      {referenceSamples},
+      [&](int, double, const std::vector<float> &image) { reference = image; },
+      errorLog));
+
+  std::vector<int> readAt;
+  for (int samples = 1; samples < maxSamples; samples *= 2) {
+    readAt.push_back(samples);
+  }
+  readAt.push_back(maxSamples);
+  return Render(
+      candidate, scene.spheres, camera, 0, readAt,
+      [&](int samples, double seconds, const std::vector<float> &image) {
+        ImageError error = ImageError::Measure(image, reference);
+        csv << sceneName << "," << Renderer::PrecisionName(candidate.precision)
+            << "," << Renderer::SampleFormatName(candidate.sampleFormat) << ","
+            << samples << "," << seconds << "," << error.rmse << ","
+            << error.relMse << "," << error.psnr << std::endl;
+      },
+      errorLog);
+}
+
+cl_int ConvergenceHarness::Render(const RenderSettings &settings,
+                                  const std::vector<CLTypes::Sphere> &spheres,
+                                  const CLTypes::Camera &camera,
+                                  cl_uint sampleOffset,
+                                  const std::vector<int> &readAt,
+                                  const ImageCallback &onImage,
+                                  std::string &errorLog) {
+  Renderer renderer;
+  CL_ERROR_RETURN(
+      renderer.Init(platform, device, settings, spheres, {}, errorLog));
+  OpenCLProgram &program = renderer.GetProgram();
+  CL_ERROR_RETURN(renderer.SetCamera(camera));
+  CL_ERROR_RETURN(renderer.ClearAccumulation());
+  cl_mem output;
+  CL_ERROR_RETURN(renderer.CreateReadbackBuffer(true, &output));
+  std::vector<float> pixels(renderer.ResolvedSize(true) / sizeof(float));
+
+  // An untimed pass absorbs one-time driver work, as in Benchmark
+  CL_ERROR_RETURN(renderer.Trace(settings.samples, sampleOffset));
+  CL_ERROR_RETURN(program.FinishKernelExecution());
+
+  double seconds = 0.0;
+  int samples = 0;
+  for (int target : readAt) {
+    auto start = std::chrono::high_resolution_clock::now();
+    while (samples < target) {
+      int pass = std::min(settings.samples, target - samples);
+      CL_ERROR_RETURN(renderer.Trace(pass, sampleOffset + samples));
+      CL_ERROR_RETURN(renderer.Accumulate(pass));
+      samples += pass;
+    }
+    CL_ERROR_RETURN(program.FinishKernelExecution());
+    std::chrono::duration<double> elapsed =
+        std::chrono::high_resolution_clock::now() - start;
+    seconds += elapsed.count();
+
+    CL_ERROR_RETURN(renderer.ResolveAccumulation(true, output));
+    CL_ERROR_RETURN(program.ReadKernelOutput(
+        output, true, renderer.ResolvedSize(true), pixels.data()));
+    onImage(samples, seconds, pixels);
+  }
+  return renderer.Unload();
+}
@@ -0,0 +1,294 @@
+#include "DeviceSelector.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+#include "Camera.hpp"
+#include "Renderer.hpp"
+#include "Scene.hpp"
+
+namespace {
+
+cl_int platform_string(cl_platform_id platform, cl_platform_info info,
+                       std::string &value) {
+  size_t size;
+  CL_ERROR_RETURN(clGetPlatformInfo(platform, info, 0, NULL, &size));
+  std::vector<char> buffer(size);
+  CL_ERROR_RETURN(clGetPlatformInfo(platform, info, size, buffer.data(), NULL));
+  value = std::string(buffer.data());
+  return CL_SUCCESS;
+}
+
+cl_int device_string(cl_device_id device, cl_device_info info,
+                     std::string &value) {
+  size_t size;
+  CL_ERROR_RETURN(clGetDeviceInfo(device, info, 0, NULL, &size));
+  std::vector<char> buffer(size);
+  CL_ERROR_RETURN(clGetDeviceInfo(device, info, size, buffer.data(), NULL));
+  value = std::string(buffer.data());
+  return CL_SUCCESS;
+}
+
+bool parse_index(const std::string &selection, size_t &index) {
+  if (selection.empty() ||
+      selection.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  index = std::stoul(selection);
+  return true;
+}
+
+// Scores are only reused for the same device, driver and kernel source, as
+// any of them changes the throughput
+std::string score_key(const DeviceCandidate &candidate,
+                      const std::string &kernelSource) {
+  return candidate.platformName + "/" + candidate.deviceName + "/" +
+         candidate.driverVersion + "/" +
+         std::to_string(std::hash<std::string>()(kernelSource));
+}
+
+// The cache holds one "key<TAB>score" line per device
+void read_scores(const std::string &path,
+                 std::unordered_map<std::string, double> &scores) {
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t tab = line.rfind('\t');
+    if (tab != std::string::npos) {
+      scores[line.substr(0, tab)] = std::atof(line.c_str() + tab + 1);
+    }
+  }
+}
+
+void write_scores(const std::string &path,
+                  const std::unordered_map<std::string, double> &scores) {
+  std::ofstream out(path, std::ofstream::trunc);
+  for (auto &score : scores) {
+    out << score.first << "\t" << score.second << "\n";
+  }
+}
+
+}  // namespace
+
+std::string DeviceCandidate::TypeName() const {
+  if (type & CL_DEVICE_TYPE_GPU) {
+    return "gpu";
+  }
+  if (type & CL_DEVICE_TYPE_CPU) {
+    return "cpu";
+  }
+  if (type & CL_DEVICE_TYPE_ACCELERATOR) {
+    return "accelerator";
+  }
+  return "other";
+}
+
+cl_int DeviceSelector::Enumerate(std::vector<DeviceCandidate> &candidates) {
+  candidates.clear();
+  cl_uint numPlatforms;
+  CL_ERROR_RETURN(clGetPlatformIDs(0, NULL, &numPlatforms));
+  std::vector<cl_platform_id> platformIds(numPlatforms);
+  CL_ERROR_RETURN(clGetPlatformIDs(numPlatforms, platformIds.data(), NULL));
+
+  for (cl_platform_id platform : platformIds) {
+    std::string platformName;
+    CL_ERROR_RETURN(platform_string(platform, CL_PLATFORM_NAME, platformName));
+    cl_uint numDevices;
+    // A platform without devices is skipped rather than treated as an error
+    if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices) !=
+        CL_SUCCESS) {
+      continue;
+    }
+    std::vector<cl_device_id> deviceIds(numDevices);
+    CL_ERROR_RETURN(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, numDevices,
+                                   deviceIds.data(), NULL));
+    for (cl_device_id device : deviceIds) {
+      DeviceCandidate candidate;
+      candidate.platform = platform;
+      candidate.device = device;
+      candidate.platformName = platformName;
+      CL_ERROR_RETURN(
+          device_string(device, CL_DEVICE_NAME, candidate.deviceName));
+      CL_ERROR_RETURN(
+          device_string(device, CL_DRIVER_VERSION, candidate.driverVersion));
+      CL_ERROR_RETURN(clGetDeviceInfo(device, CL_DEVICE_TYPE,
+                                      sizeof(cl_device_type), &candidate.type,
+                                      NULL));
+      candidates.push_back(candidate);
+    }
+  }
+  return CL_SUCCESS;
+}
+
+void DeviceSelector::PrintCandidates(
+    const std::vector<DeviceCandidate> &candidates) {
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    std::cout << "\t" << i << ": " << candidates[i].deviceName << " ("
+              << candidates[i].TypeName() << ", "
+              << candidates[i].platformName << ")" << std::endl;
+  }
+}
+
+int DeviceSelector::FilterPlatforms(const std::string &selection,
+                                    std::vector<DeviceCandidate> &candidates) {
+  // Platforms are numbered in the order they first appear
+  std::vector<std::string> platformNames;
+  for (auto &candidate : candidates) {
+    if (std::find(platformNames.begin(), platformNames.end(),
+                  candidate.platformName) == platformNames.end()) {
+      platformNames.push_back(candidate.platformName);
+    }
+  }
+
+  std::string platformName;
+  size_t index;
+  if (parse_index(selection, index)) {
+    if (index >= platformNames.size()) {
+      return 1;
+    }
+    platformName = platformNames[index];
+  } else {
+    for (auto &name : platformNames) {
+      if (name == selection ||
+          (platformName.empty() && name.find(selection) != std::string::npos)) {
+        platformName = name;
+      }
+    }
+  }
+  if (platformName.empty()) {
+    return 1;
+  }
+
+  candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                  [&](const DeviceCandidate &candidate) {
+                                    return candidate.platformName !=
+                                           platformName;
+                                  }),
+                   candidates.end());
+  return 0;
+}
+
+int DeviceSelector::Select(const std::string &selection,
+                           const std::vector<DeviceCandidate> &candidates,
+                           const std::string &scoreCachePath,
+                           DeviceCandidate &selected) {
+  if (candidates.empty()) {
+    return 1;
+  }
+  if (selection == "fastest") {
+    return SelectFastest(candidates, scoreCachePath, selected);
+  }
+
+  size_t index;
+  if (parse_index(selection, index)) {
+    if (index >= candidates.size()) {
+      return 1;
+    }
+    selected = candidates[index];
+    return 0;
+  }
+
+  for (auto &candidate : candidates) {
+    if (candidate.TypeName() == selection) {
+      selected = candidate;
+      return 0;
+    }
+  }
+  // Exact names win over partial matches
+  for (auto &candidate : candidates) {
+    if (candidate.deviceName == selection ||
+        candidate.platformName == selection) {
+      selected = candidate;
+      return 0;
+    }
+  }
+  for (auto &candidate : candidates) {
+    if (candidate.deviceName.find(selection) != std::string::npos ||
+        candidate.platformName.find(selection) != std::string::npos) {
+      selected = candidate;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int DeviceSelector::SelectFastest(
+    const std::vector<DeviceCandidate> &candidates,
+    const std::string &scoreCachePath, DeviceCandidate &selected) {
+  if (candidates.size() == 1) {
+    selected = candidates[0];
+    return 0;
+  }
+
+  std::string kernelSource;
+  Renderer::LoadKernelSource(kernelSource);
+  std::unordered_map<std::string, double> scores;
+  read_scores(scoreCachePath, scores);
+
+  bool scoresChanged = false;
+  double bestScore = 0.0;
+  bool found = false;
+  for (auto &candidate : candidates) {
+    std::string key = score_key(candidate, kernelSource);
+    auto cached = scores.find(key);
+    double score;
+    if (cached != scores.end()) {
+      score = cached->second;
+    } else {
+      std::cout << "Calibrating " << candidate.deviceName << "..."
+                << std::endl;
+      score = Calibrate(candidate);
+      scores[key] = score;
+      scoresChanged = true;
+    }
+    std::cout << "\t" << candidate.deviceName << ": ";
+    if (score < 0.0) {
+      std::cout << "unusable" << std::endl;
+    } else {
+      std::cout << score / 1e6 << " Msamples/s" << std::endl;
+    }
+    if (score >= 0.0 && (!found || score > bestScore)) {
+      selected = candidate;
+      bestScore = score;
+      found = true;
+    }
+  }
+
+  if (scoresChanged && !scoreCachePath.empty()) {
+    write_scores(scoreCachePath, scores);
+  }
+  return found ? 0 : 1;
+}
+
+double DeviceSelector::Calibrate(const DeviceCandidate &candidate) {
+  Scene scene;
+  scene.Load("default");
+  Renderer renderer;
+  std::string errorLog;
+  RenderSettings settings(CALIBRATION_RESOLUTION, CALIBRATION_RESOLUTION,
+                          BASE_SAMPLES, CALIBRATION_DEPTH);
+  Camera cam(CLTypes::Vector3(0, 0, 2), CLTypes::Vector3(0, 0, -1),
+             CLTypes::Vector3(0, 1, 0), 90, 1.0f);
+  // A renderer whose Init failed has nothing to unload
+  if (renderer.Init(candidate.platform, candidate.device, settings,
+                    scene.spheres, {}, errorLog) != CL_SUCCESS) {
+    return -1.0;
+  }
+  if (renderer.SetCamera(cam.Calculate()) != CL_SUCCESS) {
+    renderer.Unload();
+    return -1.0;
+  }
+  double samplesPerSecond;
+  cl_int result = renderer.Benchmark(CALIBRATION_RUNS, samplesPerSecond);
+  renderer.Unload();
+  return result == CL_SUCCESS ? samplesPerSecond : -1.0;
+}
+
+std::string DeviceSelector::DefaultScoreCachePath() {
+  const char *home = std::getenv("HOME");
+  std::string directory = home != nullptr ? home : ".";
+  return directory + "/.raytracer_device_scores";
+}
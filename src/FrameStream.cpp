@@ -0,0 +1,186 @@
+#include "FrameStream.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <sstream>
+
+#include "Metrics.hpp"
+
+namespace {
+
+bool write_all(int fd, const void *data, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t result =
+        write(fd, (const char *)data + written, size - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    written += result;
+  }
+  return true;
+}
+
+// BT.601 limited range, as players assume for Y4M without a color tag
+inline unsigned char luma(int r, int g, int b) {
+  return (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+inline unsigned char chroma_blue(int r, int g, int b) {
+  return (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+inline unsigned char chroma_red(int r, int g, int b) {
+  return (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+}  // namespace
+
+FrameStream::FrameStream(StreamFormat format, int width, int height, int fps)
+    : format(format), width(width), height(height), fps(fps) {
+  if (format == STREAM_Y4M) {
+    planes.resize((size_t)width * height * 3);
+  }
+}
+
+FrameStream::~FrameStream() { Close(); }
+
+bool FrameStream::ParseFormat(const std::string &name, StreamFormat &format) {
+  if (name == "y4m") {
+    format = STREAM_Y4M;
+  } else if (name == "rgb") {
+    format = STREAM_RGB;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int FrameStream::Open(const std::string &path) {
+  if (path == "-") {
+    fd = STDOUT_FILENO;
+  } else {
+    // A named pipe blocks here until a reader opens it
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return 1;
+    }
+  }
+  // A consumer that exits early should fail the write, not end the process
+  signal(SIGPIPE, SIG_IGN);
+
+  if (format == STREAM_Y4M) {
+    std::ostringstream header;
+    header << "YUV4MPEG2 W" << width << " H" << height << " F" << fps
+           << ":1 Ip A1:1 C444\n";
+    if (!write_all(fd, header.str().data(), header.str().size())) {
+      return 1;
+    }
+  }
+  writer = std::thread(&FrameStream::WriterLoop, this);
+  return 0;
+}
+
+int FrameStream::AcquireSlot(int &slot) {
+  std::unique_lock<std::mutex> lock(queueMutex);
+  queueCondition.wait(lock, [this]() {
+    return failed || submitted - completed < STREAM_QUEUE_FRAMES;
+  });
+  if (failed) {
+    return 1;
+  }
+  slot = submitted % STREAM_QUEUE_FRAMES;
+  return 0;
+}
+
+void FrameStream::Submit(const unsigned char *pixels, cl_event ready) {
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    queue.push_back({pixels, ready});
+    ++submitted;
+    Metrics::SetStreamQueueDepth(submitted - completed);
+  }
+  queueCondition.notify_all();
+}
+
+int FrameStream::Close() {
+  if (writer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      closing = true;
+    }
+    queueCondition.notify_all();
+    writer.join();
+  }
+  if (fd >= 0 && fd != STDOUT_FILENO) {
+    close(fd);
+  }
+  fd = -1;
+  return failed ? 1 : 0;
+}
+
+void FrameStream::WriterLoop() {
+  while (true) {
+    Frame frame;
+    bool dropFrame;
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueCondition.wait(lock, [this]() { return closing || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      frame = queue.front();
+      queue.pop_front();
+      dropFrame = failed;
+    }
+    // Frames queued after a failure are only waited for, so that their
+    // events are released and the renderer can unmap their memory
+    int result = OpenCLProgram::WaitForEvent(frame.ready);
+    if (!dropFrame && result == CL_SUCCESS) {
+      result = WriteFrame(frame);
+    }
+    {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      ++completed;
+      Metrics::SetStreamQueueDepth(submitted - completed);
+      if (dropFrame || result != 0) {
+        failed = true;
+      } else {
+        ++written;
+      }
+    }
+    queueCondition.notify_all();
+  }
+}
+
+int FrameStream::WriteFrame(const Frame &frame) {
+  size_t numPixels = (size_t)width * height;
+  if (format == STREAM_RGB) {
+    return write_all(fd, frame.pixels, numPixels * 3) ? 0 : 1;
+  }
+
+  static const char frameHeader[] = "FRAME\n";
+  unsigned char *y = planes.data();
+  unsigned char *u = y + numPixels;
+  unsigned char *v = u + numPixels;
+  const unsigned char *rgb = frame.pixels;
+  for (size_t i = 0; i < numPixels; ++i, rgb += 3) {
+    int r = rgb[0];
+    int g = rgb[1];
+    int b = rgb[2];
+    y[i] = luma(r, g, b);
+    u[i] = chroma_blue(r, g, b);
+    v[i] = chroma_red(r, g, b);
+  }
+  if (!write_all(fd, frameHeader, sizeof(frameHeader) - 1) ||
+      !write_all(fd, planes.data(), planes.size())) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,388 @@
+#include "ImageWriter.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+namespace {
+
+// Segments smaller than this compress noticeably worse than a single stream
+const size_t MIN_PNG_SEGMENT_BYTES = 256 * 1024;
+// Deflate window, used to prime each segment with the data before it
+const size_t DEFLATE_WINDOW_BYTES = 32 * 1024;
+const int PNG_BYTES_PER_PIXEL = 3;
+
+std::string lowercase_extension(const std::string &path) {
+  size_t extension = path.find_last_of('.');
+  size_t directory = path.find_last_of('/');
+  if (extension == std::string::npos ||
+      (directory != std::string::npos && extension < directory)) {
+    return "";
+  }
+  std::string result = path.substr(extension + 1);
+  std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+  return result;
+}
+
+// Runs task(0..count-1) with one thread per index, using the calling thread
+// for the first index
+template <typename F>
+void run_parallel(unsigned int count, F task) {
+  std::vector<std::thread> threads;
+  for (unsigned int i = 1; i < count; ++i) {
+    threads.emplace_back(task, i);
+  }
+  task(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void put_u32_be(std::vector<unsigned char> &out, uint32_t value) {
+  out.push_back((value >> 24) & 0xFF);
+  out.push_back((value >> 16) & 0xFF);
+  out.push_back((value >> 8) & 0xFF);
+  out.push_back(value & 0xFF);
+}
+
+void write_png_chunk(std::ofstream &file, const char type[4],
+                     const unsigned char *data, size_t size) {
+  std::vector<unsigned char> header;
+  put_u32_be(header, (uint32_t)size);
+  header.insert(header.end(), type, type + 4);
+  uLong crc = crc32(0L, (const Bytef *)type, 4);
+  // crc32 takes a uInt length, so feed large chunks in pieces
+  for (size_t offset = 0; offset < size;) {
+    uInt piece = (uInt)std::min(size - offset, (size_t)1 << 30);
+    crc = crc32(crc, data + offset, piece);
+    offset += piece;
+  }
+  std::vector<unsigned char> footer;
+  put_u32_be(footer, (uint32_t)crc);
+
+  file.write((const char *)header.data(), header.size());
+  file.write((const char *)data, size);
+  file.write((const char *)footer.data(), footer.size());
+}
+
+inline unsigned char paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return (unsigned char)a;
+  }
+  return (unsigned char)(pb <= pc ? b : c);
+}
+
+// Filters one row with all five PNG filters and keeps the one with the
+// smallest sum of absolute values, the usual libpng heuristic. out receives
+// the filter type byte followed by the filtered row.
+void filter_png_row(const unsigned char *row, const unsigned char *prior,
+                    int rowBytes, unsigned char *out,
+                    std::vector<unsigned char> &scratch) {
+  scratch.resize(rowBytes);
+  long bestScore = -1;
+  for (int filter = 0; filter < 5; ++filter) {
+    long score = 0;
+    for (int i = 0; i < rowBytes; ++i) {
+      int a = i >= PNG_BYTES_PER_PIXEL ? row[i - PNG_BYTES_PER_PIXEL] : 0;
+      int b = prior != nullptr ? prior[i] : 0;
+      int c = (prior != nullptr && i >= PNG_BYTES_PER_PIXEL)
+                  ? prior[i - PNG_BYTES_PER_PIXEL]
+                  : 0;
+      unsigned char value;
+      switch (filter) {
+        case 0:
+          value = row[i];
+          break;
+        case 1:
+          value = row[i] - a;
+          break;
+        case 2:
+          value = row[i] - b;
+          break;
+        case 3:
+          value = row[i] - ((a + b) >> 1);
+          break;
+        default:
+          value = row[i] - paeth(a, b, c);
+          break;
+      }
+      scratch[i] = value;
+      score += (signed char)value < 0 ? -(signed char)value : value;
+    }
+    if (bestScore < 0 || score < bestScore) {
+      bestScore = score;
+      out[0] = (unsigned char)filter;
+      memcpy(out + 1, scratch.data(), rowBytes);
+    }
+  }
+}
+
+// Raw deflate of one segment. Every segment but the last ends on a sync flush
+// so the segments can be concatenated into a single deflate stream.
+int deflate_png_segment(const unsigned char *data, size_t size,
+                        const unsigned char *dictionary, size_t dictionarySize,
+                        bool last, int level, std::vector<unsigned char> &out) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return 1;
+  }
+  if (dictionarySize > 0) {
+    deflateSetDictionary(&stream, dictionary, (uInt)dictionarySize);
+  }
+
+  // Room for the flush marker on top of the worst case bound
+  out.resize(deflateBound(&stream, size) + 16);
+  stream.next_in = (Bytef *)data;
+  stream.avail_in = (uInt)size;
+  stream.next_out = out.data();
+  stream.avail_out = (uInt)out.size();
+  int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  bool complete = last ? result == Z_STREAM_END
+                       : (result == Z_OK && stream.avail_in == 0);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return complete ? 0 : 1;
+}
+
+}  // namespace
+
+std::unique_ptr<ImageWriter> ImageWriter::Create(const std::string &format,
+                                                 const std::string &path,
+                                                 unsigned int threads) {
+  std::string name = format.empty() ? lowercase_extension(path) : format;
+  if (name == "qoi") {
+    return std::unique_ptr<ImageWriter>(new QOIWriter());
+  } else if (name == "ppm") {
+    return std::unique_ptr<ImageWriter>(new PPMWriter());
+  } else if (name == "pfm") {
+    return std::unique_ptr<ImageWriter>(new PFMWriter());
+  } else if (name == "hdr") {
+    return std::unique_ptr<ImageWriter>(new HDRWriter());
+  } else if (name == "raw") {
+    return std::unique_ptr<ImageWriter>(new RawFloatWriter());
+  } else if (name == "png" || format.empty()) {
+    // PNG stays the default for unknown extensions
+    return std::unique_ptr<ImageWriter>(new PNGWriter(threads));
+  }
+  return nullptr;
+}
+
+Image ImageWriter::MakeImage(int width, int height, const void *pixels) const {
+  if (NeedsFloatData()) {
+    return Image(width, height, nullptr, (const float *)pixels);
+  }
+  return Image(width, height, (const unsigned char *)pixels);
+}
+
+int PNGWriter::Write(const std::string &path, const Image &image) const {
+  const int rowBytes = image.width * PNG_BYTES_PER_PIXEL;
+  const size_t filteredRowBytes = rowBytes + 1;
+  const size_t filteredSize = filteredRowBytes * image.height;
+
+  // Split on row boundaries, but keep segments large enough to compress well
+  size_t maxSegments =
+      std::max((size_t)1, filteredSize / MIN_PNG_SEGMENT_BYTES);
+  unsigned int segments = (unsigned int)std::min(
+      {(size_t)std::max(threads, 1u), maxSegments, (size_t)image.height});
+
+  // Filtering only looks one row back, so segments filter independently
+  std::vector<unsigned char> filtered(filteredSize);
+  run_parallel(segments, [&](unsigned int s) {
+    int rowBegin = image.height * s / segments;
+    int rowEnd = image.height * (s + 1) / segments;
+    std::vector<unsigned char> scratch;
+    for (int y = rowBegin; y < rowEnd; ++y) {
+      const unsigned char *row = image.rgb8 + (size_t)y * rowBytes;
+      const unsigned char *prior = y > 0 ? row - rowBytes : nullptr;
+      filter_png_row(row, prior, rowBytes,
+                     filtered.data() + (size_t)y * filteredRowBytes, scratch);
+    }
+  });
+
+  // Deflate segments, each primed with the window of data preceding it so
+  // that splitting barely costs any compression ratio
+  std::vector<std::vector<unsigned char>> compressed(segments);
+  std::vector<uLong> checksums(segments);
+  std::vector<int> results(segments);
+  run_parallel(segments, [&](unsigned int s) {
+    size_t begin = filteredRowBytes * (image.height * s / segments);
+    size_t end = filteredRowBytes * (image.height * (s + 1) / segments);
+    size_t dictionarySize = std::min(begin, DEFLATE_WINDOW_BYTES);
+    checksums[s] = adler32(1L, filtered.data() + begin, (uInt)(end - begin));
+    results[s] = deflate_png_segment(
+        filtered.data() + begin, end - begin,
+        filtered.data() + begin - dictionarySize, dictionarySize,
+        s + 1 == segments, compressionLevel, compressed[s]);
+  });
+
+  for (int result : results) {
+    if (result != 0) {
+      return 1;
+    }
+  }
+  uLong checksum = checksums[0];
+  for (unsigned int s = 1; s < segments; ++s) {
+    size_t begin = filteredRowBytes * (image.height * s / segments);
+    size_t end = filteredRowBytes * (image.height * (s + 1) / segments);
+    checksum = adler32_combine(checksum, checksums[s], (z_off_t)(end - begin));
+  }
+
+  std::ofstream file(path, std::ofstream::binary);
+  if (!file) {
+    return 1;
+  }
+  static const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                             '\r', '\n', 0x1A, '\n'};
+  file.write((const char *)signature, sizeof(signature));
+
+  std::vector<unsigned char> header;
+  put_u32_be(header, image.width);
+  put_u32_be(header, image.height);
+  // 8-bit depth, truecolor, deflate, adaptive filtering, no interlace
+  header.insert(header.end(), {8, 2, 0, 0, 0});
+  write_png_chunk(file, "IHDR", header.data(), header.size());
+
+  // The zlib stream may be spread across consecutive IDAT chunks, so the
+  // header, each segment and the checksum are written as they are
+  static const unsigned char zlibHeader[2] = {0x78, 0x9C};
+  write_png_chunk(file, "IDAT", zlibHeader, sizeof(zlibHeader));
+  for (auto &segment : compressed) {
+    write_png_chunk(file, "IDAT", segment.data(), segment.size());
+  }
+  std::vector<unsigned char> trailer;
+  put_u32_be(trailer, (uint32_t)checksum);
+  write_png_chunk(file, "IDAT", trailer.data(), trailer.size());
+  write_png_chunk(file, "IEND", nullptr, 0);
+
+  return file.good() ? 0 : 1;
+}
+
+int QOIWriter::Write(const std::string &path, const Image &image) const {
+  enum {
+    QOI_OP_INDEX = 0x00,
+    QOI_OP_DIFF = 0x40,
+    QOI_OP_LUMA = 0x80,
+    QOI_OP_RUN = 0xC0,
+    QOI_OP_RGB = 0xFE
+  };
+  struct Pixel {
+    unsigned char r, g, b, a;
+    bool operator==(const Pixel &p) const {
+      return r == p.r && g == p.g && b == p.b && a == p.a;
+    }
+  };
+
+  const size_t pixelCount = (size_t)image.width * image.height;
+  std::vector<unsigned char> out;
+  // Worst case is one RGB op per pixel plus header and end marker
+  out.reserve(14 + pixelCount * 4 + 8);
+  out.insert(out.end(), {'q', 'o', 'i', 'f'});
+  put_u32_be(out, image.width);
+  put_u32_be(out, image.height);
+  // 3 channels, sRGB
+  out.insert(out.end(), {3, 0});
+
+  // Alpha is always opaque, but the index starts out transparent black and
+  // the hash includes alpha, so it is tracked to stay in step with decoders
+  Pixel index[64];
+  memset(index, 0, sizeof(index));
+  Pixel previous = {0, 0, 0, 255};
+  int run = 0;
+  for (size_t i = 0; i < pixelCount; ++i) {
+    const unsigned char *source = image.rgb8 + i * 3;
+    Pixel pixel = {source[0], source[1], source[2], 255};
+
+    if (pixel == previous) {
+      ++run;
+      if (run == 62 || i + 1 == pixelCount) {
+        out.push_back(QOI_OP_RUN | (run - 1));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      out.push_back(QOI_OP_RUN | (run - 1));
+      run = 0;
+    }
+
+    int hash = (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64;
+    if (index[hash] == pixel) {
+      out.push_back(QOI_OP_INDEX | hash);
+    } else {
+      index[hash] = pixel;
+      signed char dr = pixel.r - previous.r;
+      signed char dg = pixel.g - previous.g;
+      signed char db = pixel.b - previous.b;
+      signed char drDg = dr - dg;
+      signed char dbDg = db - dg;
+      if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+        out.push_back(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+      } else if (dg >= -32 && dg <= 31 && drDg >= -8 && drDg <= 7 &&
+                 dbDg >= -8 && dbDg <= 7) {
+        out.push_back(QOI_OP_LUMA | (dg + 32));
+        out.push_back((drDg + 8) << 4 | (dbDg + 8));
+      } else {
+        out.insert(out.end(), {QOI_OP_RGB, pixel.r, pixel.g, pixel.b});
+      }
+    }
+    previous = pixel;
+  }
+  out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+
+  std::ofstream file(path, std::ofstream::binary);
+  file.write((const char *)out.data(), out.size());
+  return file.good() ? 0 : 1;
+}
+
+int PPMWriter::Write(const std::string &path, const Image &image) const {
+  std::ofstream file(path, std::ofstream::binary);
+  file << "P6\n" << image.width << " " << image.height << "\n255\n";
+  file.write((const char *)image.rgb8, (size_t)image.width * image.height * 3);
+  return file.good() ? 0 : 1;
+}
+
+int PFMWriter::Write(const std::string &path, const Image &image) const {
+  std::ofstream file(path, std::ofstream::binary);
+  // A negative scale marks little-endian data
+  uint16_t endianTest = 1;
+  bool littleEndian = *(unsigned char *)&endianTest == 1;
+  file << "PF\n"
+       << image.width << " " << image.height << "\n"
+       << (littleEndian ? "-1.0" : "1.0") << "\n";
+  // PFM rows are stored bottom to top
+  const size_t rowSize = (size_t)image.width * 3 * sizeof(float);
+  for (int y = image.height - 1; y >= 0; --y) {
+    file.write((const char *)(image.rgbFloat + (size_t)y * image.width * 3),
+               rowSize);
+  }
+  return file.good() ? 0 : 1;
+}
+
+int HDRWriter::Write(const std::string &path, const Image &image) const {
+  return stbi_write_hdr(path.c_str(), image.width, image.height, 3,
+                        image.rgbFloat) == 0
+             ? 1
+             : 0;
+}
+
+int RawFloatWriter::Write(const std::string &path, const Image &image) const {
+  std::ofstream file(path, std::ofstream::binary);
+  file.write((const char *)image.rgbFloat,
+             (size_t)image.width * image.height * 3 * sizeof(float));
+  return file.good() ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+#include "Metrics.hpp"
+
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+namespace {
+
+const double frameTimeBuckets[FRAME_TIME_BUCKETS] = {
+    0.001, 0.0025, 0.005, 0.01, 0.0167, 0.025, 0.05,
+    0.1,   0.25,   0.5,   1.0,  2.5,    5.0,   10.0};
+
+const char *commandNames[DEVICE_COMMANDS] = {"kernel", "transfer"};
+const char *cacheNames[PROGRAM_CACHES] = {"binary", "server"};
+
+typedef std::atomic<unsigned long long> Counter;
+typedef std::atomic<long long> Gauge;
+
+// Frame counts per bucket, not yet cumulative
+Counter frameBuckets[FRAME_TIME_BUCKETS + 1];
+Counter frameMicroseconds(0);
+Counter samples(0);
+Counter commandNanoseconds[DEVICE_COMMANDS];
+Counter commandCount[DEVICE_COMMANDS];
+Gauge commandsInFlight(0);
+Gauge liveBytes(0);
+Gauge pooledBytes(0);
+Counter cacheHits[PROGRAM_CACHES];
+Counter cacheMisses[PROGRAM_CACHES];
+Gauge streamQueueDepth(0);
+
+inline void add(Counter &counter, unsigned long long value) {
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+inline void add(Gauge &gauge, long long value) {
+  gauge.fetch_add(value, std::memory_order_relaxed);
+}
+
+inline unsigned long long value(const Counter &counter) {
+  return counter.load(std::memory_order_relaxed);
+}
+
+inline long long value(const Gauge &gauge) {
+  return gauge.load(std::memory_order_relaxed);
+}
+
+void CL_CALLBACK command_complete(cl_event event, cl_int status,
+                                  void *command) {
+  cl_ulong start;
+  cl_ulong end;
+  if (status == CL_COMPLETE &&
+      clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                              sizeof(start), &start, NULL) == CL_SUCCESS &&
+      clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end),
+                              &end, NULL) == CL_SUCCESS &&
+      end >= start) {
+    size_t index = (size_t)command;
+    add(commandNanoseconds[index], end - start);
+    add(commandCount[index], 1);
+  }
+  add(commandsInFlight, -1);
+}
+
+void write_header(std::ostream &out, const char *name, const char *type,
+                  const char *help) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+}
+
+}  // namespace
+
+void Metrics::RecordFrame(double seconds, unsigned long long frameSamples) {
+  int bucket = 0;
+  while (bucket < FRAME_TIME_BUCKETS &&
+         seconds > frameTimeBuckets[bucket]) {
+    ++bucket;
+  }
+  add(frameBuckets[bucket], 1);
+  add(frameMicroseconds, (unsigned long long)(seconds * 1e6));
+  add(samples, frameSamples);
+}
+
+void Metrics::RecordDeviceBytes(long long liveChange, long long pooledChange) {
+  add(liveBytes, liveChange);
+  add(pooledBytes, pooledChange);
+}
+
+void Metrics::RecordCacheLookup(ProgramCache cache, bool hit) {
+  add(hit ? cacheHits[cache] : cacheMisses[cache], 1);
+}
+
+void Metrics::SetStreamQueueDepth(unsigned long frames) {
+  streamQueueDepth.store(frames, std::memory_order_relaxed);
+}
+
+cl_int Metrics::TimeCommand(cl_event event, DeviceCommand command) {
+  add(commandsInFlight, 1);
+  cl_int errorCode = clSetEventCallback(event, CL_COMPLETE, command_complete,
+                                        (void *)(size_t)command);
+  if (errorCode != CL_SUCCESS) {
+    add(commandsInFlight, -1);
+  }
+  clReleaseEvent(event);
+  return errorCode;
+}
+
+void Metrics::Write(std::ostream &out) {
+  // Totals of long runs would lose digits at the default precision
+  out.precision(15);
+  write_header(out, "raytracer_frame_seconds", "histogram",
+               "Time to render a frame or progressive pass.");
+  unsigned long long frames = 0;
+  for (int i = 0; i <= FRAME_TIME_BUCKETS; ++i) {
+    frames += value(frameBuckets[i]);
+    out << "raytracer_frame_seconds_bucket{le=\"";
+    if (i < FRAME_TIME_BUCKETS) {
+      out << frameTimeBuckets[i];
+    } else {
+      out << "+Inf";
+    }
+    out << "\"} " << frames << "\n";
+  }
+  out << "raytracer_frame_seconds_sum " << value(frameMicroseconds) / 1e6
+      << "\n";
+  out << "raytracer_frame_seconds_count " << frames << "\n";
+
+  write_header(out, "raytracer_samples_total", "counter",
+               "Samples traced, each one camera ray and its bounces.");
+  out << "raytracer_samples_total " << value(samples) << "\n";
+
+  write_header(out, "raytracer_device_seconds_total", "counter",
+               "Device time of completed kernels and transfers.");
+  for (int i = 0; i < DEVICE_COMMANDS; ++i) {
+    out << "raytracer_device_seconds_total{command=\"" << commandNames[i]
+        << "\"} " << value(commandNanoseconds[i]) / 1e9 << "\n";
+  }
+  write_header(out, "raytracer_device_commands_total", "counter",
+               "Completed kernels and transfers.");
+  for (int i = 0; i < DEVICE_COMMANDS; ++i) {
+    out << "raytracer_device_commands_total{command=\"" << commandNames[i]
+        << "\"} " << value(commandCount[i]) << "\n";
+  }
+  write_header(out, "raytracer_device_queue_depth", "gauge",
+               "Kernels and transfers enqueued but not completed.");
+  out << "raytracer_device_queue_depth " << value(commandsInFlight) << "\n";
+
+  write_header(out, "raytracer_device_memory_bytes", "gauge",
+               "Device memory held by buffers in use and by the pool.");
+  out << "raytracer_device_memory_bytes{state=\"live\"} " << value(liveBytes)
+      << "\n";
+  out << "raytracer_device_memory_bytes{state=\"pooled\"} "
+      << value(pooledBytes) << "\n";
+
+  write_header(out, "raytracer_program_cache_lookups_total", "counter",
+               "Program cache lookups by cache and result.");
+  for (int i = 0; i < PROGRAM_CACHES; ++i) {
+    out << "raytracer_program_cache_lookups_total{cache=\"" << cacheNames[i]
+        << "\",result=\"hit\"} " << value(cacheHits[i]) << "\n";
+    out << "raytracer_program_cache_lookups_total{cache=\"" << cacheNames[i]
+        << "\",result=\"miss\"} " << value(cacheMisses[i]) << "\n";
+  }
+
+  write_header(out, "raytracer_stream_queue_frames", "gauge",
+               "Frames waiting for the stream writer.");
+  out << "raytracer_stream_queue_frames " << value(streamQueueDepth) << "\n";
+}
+
+MetricsEndpoint::~MetricsEndpoint() { Stop(); }
+
+int MetricsEndpoint::Start(int port) {
+  // Scrapers that hang up early must not take the renderer down
+  signal(SIGPIPE, SIG_IGN);
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) {
+    return 1;
+  }
+  int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (bind(listener, (sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, 8) != 0) {
+    close(listener);
+    listener = -1;
+    return 1;
+  }
+  server = std::thread(&MetricsEndpoint::ServeLoop, this);
+  return 0;
+}
+
+void MetricsEndpoint::Stop() {
+  if (listener < 0) {
+    return;
+  }
+  // Wakes the blocked accept
+  shutdown(listener, SHUT_RDWR);
+  if (server.joinable()) {
+    server.join();
+  }
+  close(listener);
+  listener = -1;
+}
+
+void MetricsEndpoint::ServeLoop() {
+  while (true) {
+    int connection = accept(listener, nullptr, nullptr);
+    if (connection < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    timeval timeout;
+    timeout.tv_sec = METRICS_IO_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // Every request gets the metrics, so only the request line is read
+    char request[1024];
+    ssize_t received = read(connection, request, sizeof(request));
+    if (received > 0) {
+      std::ostringstream body;
+      Metrics::Write(body);
+      std::ostringstream response;
+      response << "HTTP/1.0 200 OK\r\n"
+               << "Content-Type: text/plain; version=0.0.4\r\n"
+               << "Content-Length: " << body.str().size() << "\r\n"
+               << "Connection: close\r\n\r\n"
+               << body.str();
+      std::string text = response.str();
+      size_t written = 0;
+      while (written < text.size()) {
+        ssize_t result =
+            write(connection, text.data() + written, text.size() - written);
+        if (result <= 0) {
+          break;
+        }
+        written += result;
+      }
+    }
+    close(connection);
+  }
+}
@@ -1,7 +1,12 @@
 #include "OpenCLProgram.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <sstream>
 
+#include "Metrics.hpp"
+
 cl_int OpenCLProgram::GetAvailablePlatforms(
     std::unordered_map<std::string, cl_platform_id> &platforms) {
   // Detect number of available platforms
@@ -34,11 +39,11 @@ cl_int OpenCLProgram::GetAvailableDevices(
   // Detect number of available devices
   cl_uint numDevices;
   CL_ERROR_RETURN(
-      clGetDeviceIDs(platformId, CL_DEVICE_TYPE_GPU, 0, NULL, &numDevices));
+      clGetDeviceIDs(platformId, CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices));
 
   // Grab devices
   cl_device_id deviceIds[numDevices];
-  CL_ERROR_RETURN(clGetDeviceIDs(platformId, CL_DEVICE_TYPE_GPU, numDevices,
+  CL_ERROR_RETURN(clGetDeviceIDs(platformId, CL_DEVICE_TYPE_ALL, numDevices,
                                  &deviceIds[0], NULL));
 
   size_t deviceNameSize;
@@ -109,14 +114,9 @@ cl_int OpenCLProgram::Init(
       clCreateContext(&propertiesArr[0], 1, &device, NULL, NULL, &errorCode);
   CL_ERROR_RETURN(errorCode)
 
-  // Create program
-  const char *src = programSource.c_str();
-  const size_t srcSize = programSource.size();
-  program = clCreateProgramWithSource(context, 1, &src, &srcSize, &errorCode);
-  CL_ERROR_RETURN(errorCode)
-
-  // Compile the program
+  // Compile options
   std::stringstream buildOptions;
+  buildOptions << compilerOptions;
   for (auto define = definitions.begin(); define != definitions.end();
        ++define) {
     buildOptions << " -D " << define->first << "=" << define->second;
@@ -126,6 +126,33 @@ cl_int OpenCLProgram::Init(
     buildOptions << " -I " << *include;
   }
   std::string optionsString = buildOptions.str();
+  cl_command_queue_properties queueProperties =
+      profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+
+  // A cached device binary skips the front end compile entirely
+  std::string binaryPath;
+  loadedFromBinaryCache = false;
+  if (!binaryCacheDirectory.empty()) {
+    CL_ERROR_RETURN(
+        BinaryCachePath(programSource, optionsString, binaryPath));
+    loadedFromBinaryCache =
+        LoadProgramBinary(binaryPath, optionsString) == CL_SUCCESS;
+    Metrics::RecordCacheLookup(CACHE_BINARY, loadedFromBinaryCache);
+    if (loadedFromBinaryCache) {
+      queue = clCreateCommandQueue(context, device, queueProperties,
+                                   &errorCode);
+      CL_ERROR_RETURN(errorCode);
+      return CL_SUCCESS;
+    }
+  }
+
+  // Create program
+  const char *src = programSource.c_str();
+  const size_t srcSize = programSource.size();
+  program = clCreateProgramWithSource(context, 1, &src, &srcSize, &errorCode);
+  CL_ERROR_RETURN(errorCode)
+
+  // Compile the program
 
   if (cl_int result = clBuildProgram(program, 1, &device, optionsString.c_str(),
                                      NULL, NULL) != CL_SUCCESS) {
@@ -138,32 +165,63 @@ cl_int OpenCLProgram::Init(
     errorLog = std::string(log);
     return result;
   }
+  if (!binaryPath.empty()) {
+    // Failing to cache only costs the next startup a compile
+    SaveProgramBinary(binaryPath);
+  }
 
   // Create command queue
-  queue = clCreateCommandQueue(context, device, 0, &errorCode);
+  queue = clCreateCommandQueue(context, device, queueProperties, &errorCode);
   CL_ERROR_RETURN(errorCode);
   return CL_SUCCESS;
 }
 
 cl_int OpenCLProgram::Unload() {
-  // Ensure we are done running operations
-  CL_ERROR_RETURN(FinishKernelExecution());
-  // Release any buffers still in use
+  // Handles are null when Init never created them
+  if (queue != nullptr) {
+    // Ensure we are done running operations
+    CL_ERROR_RETURN(FinishKernelExecution());
+  }
+  // Release any buffers still in use, then the idle ones and the arena
   for (auto buf : loadedBuffers) {
-    CL_ERROR_RETURN(clReleaseMemObject(buf));
+    CL_ERROR_RETURN(clReleaseMemObject(buf.first));
   }
   loadedBuffers.clear();
+  for (auto &entry : bufferPool) {
+    for (cl_mem buf : entry.second) {
+      CL_ERROR_RETURN(clReleaseMemObject(buf));
+    }
+  }
+  bufferPool.clear();
+  if (arena != nullptr) {
+    CL_ERROR_RETURN(clReleaseMemObject(arena));
+    arena = nullptr;
+  }
+  Metrics::RecordDeviceBytes(-(long long)bufferStats.liveBytes,
+                             -(long long)bufferStats.pooledBytes);
+  bufferStats.liveBytes = 0;
+  bufferStats.pooledBytes = 0;
   // Release kernels
   for (auto kernel : loadedKernels) {
     CL_ERROR_RETURN(clReleaseKernel(kernel.second));
   }
   loadedKernels.clear();
   // Release command queue
-  CL_ERROR_RETURN(clReleaseCommandQueue(queue));
+  if (queue != nullptr) {
+    CL_ERROR_RETURN(clReleaseCommandQueue(queue));
+    queue = nullptr;
+  }
   // Release program
-  CL_ERROR_RETURN(clReleaseProgram(program));
+  if (program != nullptr) {
+    CL_ERROR_RETURN(clReleaseProgram(program));
+    program = nullptr;
+  }
   // Release context
-  return clReleaseContext(context);
+  if (context != nullptr) {
+    CL_ERROR_RETURN(clReleaseContext(context));
+    context = nullptr;
+  }
+  return CL_SUCCESS;
 }
 
 cl_int OpenCLProgram::LoadKernel(const std::string &kernelName) {
@@ -177,27 +235,240 @@ cl_int OpenCLProgram::LoadKernel(const std::string &kernelName) {
   return CL_SUCCESS;
 }
 
+// Frees the host copy of a pooled buffer's initial contents once the write
+// from it has completed
+static void CL_CALLBACK free_staging(cl_event, cl_int, void *staging) {
+  delete static_cast<std::vector<char> *>(staging);
+}
+
+cl_int OpenCLProgram::GetKernelWorkGroupSize(const std::string &kernelName,
+                                             size_t &size) {
+  if (loadedKernels.find(kernelName) == loadedKernels.end()) {
+    return CL_INVALID_KERNEL;
+  }
+  return clGetKernelWorkGroupInfo(loadedKernels[kernelName], device,
+                                  CL_KERNEL_WORK_GROUP_SIZE, sizeof(size),
+                                  &size, NULL);
+}
+
+cl_int OpenCLProgram::GetComputeUnits(cl_uint &units) const {
+  return clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units),
+                         &units, NULL);
+}
+
 cl_int OpenCLProgram::CreateBuffer(cl_mem_flags flags, size_t bufSize,
                                    void *data, cl_mem *newBuffer) {
-  // Create the buffer
-  cl_int errorCode;
-  cl_mem temp = clCreateBuffer(context, flags, bufSize, data, &errorCode);
-  CL_ERROR_RETURN(errorCode);
-  loadedBuffers.insert(temp);
+  // Buffers wrapping host memory belong to that memory and are not pooled.
+  // Pooled buffers are filled with a host write, which buffers the host may
+  // not write reject, so those are created at their exact size instead.
+  const bool copyData = (flags & CL_MEM_COPY_HOST_PTR) != 0;
+  const bool writable =
+      (flags & (CL_MEM_HOST_READ_ONLY | CL_MEM_HOST_NO_ACCESS)) == 0;
+  const bool poolable = (flags & CL_MEM_USE_HOST_PTR) == 0 && bufSize > 0 &&
+                        (!copyData || writable);
+  const cl_mem_flags poolFlags = flags & ~(cl_mem_flags)CL_MEM_COPY_HOST_PTR;
+  const size_t classSize = poolable ? PoolSizeClass(bufSize) : bufSize;
+
+  cl_mem temp = nullptr;
+  auto idle = bufferPool.find(PoolKey(poolFlags, classSize));
+  if (poolable && idle != bufferPool.end() && !idle->second.empty()) {
+    temp = idle->second.back();
+    if (copyData) {
+      CL_ERROR_RETURN(WriteHostCopy(temp, bufSize, data));
+    }
+    idle->second.pop_back();
+    TrackBytes(classSize, -(long long)classSize);
+    ++bufferStats.poolReuses;
+  } else {
+    // Pooled buffers are allocated at their class size so they can serve
+    // any request of the class later
+    cl_int errorCode;
+    if (copyData && classSize != bufSize) {
+      temp = clCreateBuffer(context, poolFlags, classSize, nullptr,
+                            &errorCode);
+      CL_ERROR_RETURN(errorCode);
+      errorCode = WriteHostCopy(temp, bufSize, data);
+      if (errorCode != CL_SUCCESS) {
+        clReleaseMemObject(temp);
+        return errorCode;
+      }
+    } else {
+      temp = clCreateBuffer(context, flags, classSize, data, &errorCode);
+      CL_ERROR_RETURN(errorCode);
+    }
+    TrackBytes(classSize, 0);
+    ++bufferStats.allocations;
+  }
+
+  BufferInfo info;
+  info.bytes = classSize;
+  info.poolFlags = poolFlags;
+  info.pooled = poolable;
+  loadedBuffers[temp] = info;
   if (newBuffer != nullptr) {
     *newBuffer = temp;
   }
   return CL_SUCCESS;
 }
 
+cl_int OpenCLProgram::WriteHostCopy(cl_mem buf, size_t size,
+                                    const void *data) {
+  // The caller may free data as soon as CreateBuffer returns, so the write
+  // reads from a copy. The queue is in order, so the write lands after any
+  // kernel still reading a reused buffer's previous contents.
+  std::vector<char> *staging =
+      new std::vector<char>(static_cast<const char *>(data),
+                            static_cast<const char *>(data) + size);
+  cl_event written;
+  cl_int errorCode = clEnqueueWriteBuffer(queue, buf, CL_FALSE, 0, size,
+                                          staging->data(), 0, NULL, &written);
+  if (errorCode != CL_SUCCESS) {
+    delete staging;
+    return errorCode;
+  }
+  errorCode = clSetEventCallback(written, CL_COMPLETE, free_staging, staging);
+  RecordCommand(CL_SUCCESS, COMMAND_TRANSFER, &written, nullptr);
+  clReleaseEvent(written);
+  if (errorCode != CL_SUCCESS) {
+    // The write may still be reading the copy
+    clFinish(queue);
+    delete staging;
+  }
+  return errorCode;
+}
+
 cl_int OpenCLProgram::ReleaseBuffer(cl_mem buf) {
-  if (loadedBuffers.find(buf) == loadedBuffers.end()) {
+  auto found = loadedBuffers.find(buf);
+  if (found == loadedBuffers.end()) {
     return CL_INVALID_MEM_OBJECT;
   }
-  loadedBuffers.erase(buf);
+  const BufferInfo info = found->second;
+  loadedBuffers.erase(found);
+  if (info.pooled &&
+      bufferStats.pooledBytes + info.bytes <= BUFFER_POOL_MAX_BYTES) {
+    bufferPool[PoolKey(info.poolFlags, info.bytes)].push_back(buf);
+    TrackBytes(-(long long)info.bytes, info.bytes);
+    return CL_SUCCESS;
+  }
+  TrackBytes(-(long long)info.bytes, 0);
   return clReleaseMemObject(buf);
 }
 
+cl_int OpenCLProgram::CreateArena(cl_mem_flags flags, size_t size) {
+  cl_int errorCode;
+  cl_mem temp = clCreateBuffer(context, flags, size, nullptr, &errorCode);
+  CL_ERROR_RETURN(errorCode);
+  ++bufferStats.allocations;
+  // Sub-buffers of the old arena keep its memory alive until released
+  if (arena != nullptr) {
+    TrackBytes(-(long long)arenaSize, 0);
+    CL_ERROR_RETURN(clReleaseMemObject(arena));
+  }
+  arena = temp;
+  arenaSize = size;
+  arenaUsed = 0;
+  TrackBytes(size, 0);
+  return CL_SUCCESS;
+}
+
+cl_int OpenCLProgram::ArenaSize(const std::vector<size_t> &sizes,
+                                size_t &size) const {
+  size_t alignment;
+  CL_ERROR_RETURN(ArenaAlignment(alignment));
+  size = 0;
+  for (size_t bufSize : sizes) {
+    size += (bufSize + alignment - 1) / alignment * alignment;
+  }
+  return CL_SUCCESS;
+}
+
+cl_int OpenCLProgram::CreateArenaBuffer(size_t bufSize, cl_mem *newBuffer) {
+  size_t alignment;
+  CL_ERROR_RETURN(ArenaAlignment(alignment));
+  if (arena == nullptr || bufSize == 0 || arenaUsed + bufSize > arenaSize) {
+    return CL_INVALID_BUFFER_SIZE;
+  }
+  cl_buffer_region region;
+  region.origin = arenaUsed;
+  region.size = bufSize;
+  cl_int errorCode;
+  // Sub-buffers inherit the arena's flags
+  cl_mem temp = clCreateSubBuffer(arena, 0, CL_BUFFER_CREATE_TYPE_REGION,
+                                  &region, &errorCode);
+  CL_ERROR_RETURN(errorCode);
+  arenaUsed += (bufSize + alignment - 1) / alignment * alignment;
+  ++bufferStats.subBuffers;
+
+  BufferInfo info;
+  info.bytes = 0;
+  info.poolFlags = 0;
+  info.pooled = false;
+  loadedBuffers[temp] = info;
+  if (newBuffer != nullptr) {
+    *newBuffer = temp;
+  }
+  return CL_SUCCESS;
+}
+
+void OpenCLProgram::DumpBufferStats(std::ostream &out) const {
+  out << "Device buffers: " << bufferStats.liveBytes << " bytes live, "
+      << bufferStats.pooledBytes << " pooled, " << bufferStats.peakBytes
+      << " peak" << std::endl;
+  out << "  " << bufferStats.allocations << " allocations, "
+      << bufferStats.poolReuses << " pool reuses, " << bufferStats.subBuffers
+      << " arena sub-buffers" << std::endl;
+}
+
+size_t OpenCLProgram::PoolSizeClass(size_t size) {
+  if (size <= BUFFER_POOL_MIN_CLASS) {
+    return BUFFER_POOL_MIN_CLASS;
+  }
+  // Four classes between each power of two and the next
+  size_t power = 1;
+  while (power <= size / 2) {
+    power *= 2;
+  }
+  const size_t step = power / 4;
+  return (size + step - 1) / step * step;
+}
+
+cl_int OpenCLProgram::ArenaAlignment(size_t &alignment) const {
+  // Sub-buffer origins must be aligned to this many bits
+  cl_uint alignBits;
+  CL_ERROR_RETURN(clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                                  sizeof(alignBits), &alignBits, NULL));
+  alignment = std::max<size_t>(alignBits / 8, 1);
+  return CL_SUCCESS;
+}
+
+void OpenCLProgram::TrackBytes(long long liveChange, long long pooledChange) {
+  Metrics::RecordDeviceBytes(liveChange, pooledChange);
+  bufferStats.liveBytes += liveChange;
+  bufferStats.pooledBytes += pooledChange;
+  bufferStats.peakBytes =
+      std::max(bufferStats.peakBytes,
+               bufferStats.liveBytes + bufferStats.pooledBytes);
+}
+
+cl_event *OpenCLProgram::CommandEvent(cl_event *event,
+                                      cl_event &timed) const {
+  timed = nullptr;
+  return profiling && event == nullptr ? &timed : event;
+}
+
+cl_int OpenCLProgram::RecordCommand(cl_int errorCode, DeviceCommand command,
+                                    cl_event *event, cl_event timed) const {
+  if (!profiling || errorCode != CL_SUCCESS) {
+    return errorCode;
+  }
+  // The caller keeps its own reference to an event it asked for
+  if (event != nullptr) {
+    timed = *event;
+    CL_ERROR_RETURN(clRetainEvent(timed));
+  }
+  return Metrics::TimeCommand(timed, command);
+}
+
 cl_int OpenCLProgram::SetArgument(const std::string &kernelName, cl_uint argNum,
                                   size_t argSize, void *data) {
   if (loadedKernels.find(kernelName) == loadedKernels.end()) {
@@ -222,17 +493,22 @@ cl_int OpenCLProgram::CreateBufferArgument(const std::string &kernelName,
 
 cl_int OpenCLProgram::MapBuffer(cl_mem buffer, cl_bool blocking,
                                 cl_map_flags flags, size_t mapSize,
-                                void *mappedPointer) {
+                                void **mappedPointer, cl_event *event) {
   cl_int err;
+  cl_event timed;
   void *temp = clEnqueueMapBuffer(queue, buffer, blocking, flags, 0, mapSize, 0,
-                                  NULL, NULL, &err);
-  CL_ERROR_RETURN(err);
-  mappedPointer = temp;
+                                  NULL, CommandEvent(event, timed), &err);
+  CL_ERROR_RETURN(RecordCommand(err, COMMAND_TRANSFER, event, timed));
+  *mappedPointer = temp;
   return CL_SUCCESS;
 }
 
-cl_int OpenCLProgram::UnmapBuffer(cl_mem buffer, void *mappedPointer) {
-  return clEnqueueUnmapMemObject(queue, buffer, mappedPointer, 0, NULL, NULL);
+cl_int OpenCLProgram::UnmapBuffer(cl_mem buffer, void *mappedPointer,
+                                  cl_event *event) {
+  cl_event timed;
+  cl_int errorCode = clEnqueueUnmapMemObject(queue, buffer, mappedPointer, 0,
+                                             NULL, CommandEvent(event, timed));
+  return RecordCommand(errorCode, COMMAND_TRANSFER, event, timed);
 }
 
 cl_int OpenCLProgram::CreateGLImageObject(cl_mem_flags flags, GLenum target,
@@ -242,7 +518,11 @@ cl_int OpenCLProgram::CreateGLImageObject(cl_mem_flags flags, GLenum target,
   cl_mem temp =
       clCreateFromGLTexture(context, flags, target, mipLevel, texture, &error);
   CL_ERROR_RETURN(error);
-  loadedBuffers.insert(temp);
+  BufferInfo info;
+  info.bytes = 0;
+  info.poolFlags = 0;
+  info.pooled = false;
+  loadedBuffers[temp] = info;
   if (newImage != nullptr) {
     *newImage = temp;
   }
@@ -251,31 +531,73 @@ cl_int OpenCLProgram::CreateGLImageObject(cl_mem_flags flags, GLenum target,
 
 cl_int OpenCLProgram::ExecuteKernel(
     const std::string &kernelName, const std::vector<size_t> &globalWorkSizes,
-    const std::vector<size_t> *globalWorkOffsets) {
+    const std::vector<size_t> *globalWorkOffsets,
+    const std::vector<size_t> *localWorkSizes) {
   if (loadedKernels.find(kernelName) == loadedKernels.end()) {
     return CL_INVALID_KERNEL;
   }
   auto offsets =
       globalWorkOffsets == nullptr ? NULL : (*globalWorkOffsets).data();
-  return clEnqueueNDRangeKernel(queue, loadedKernels[kernelName],
-                                globalWorkSizes.size(), offsets,
-                                globalWorkSizes.data(), NULL, 0, NULL, NULL);
+  auto localSizes =
+      localWorkSizes == nullptr ? NULL : (*localWorkSizes).data();
+  cl_event timed;
+  cl_int errorCode = clEnqueueNDRangeKernel(
+      queue, loadedKernels[kernelName], globalWorkSizes.size(), offsets,
+      globalWorkSizes.data(), localSizes, 0, NULL,
+      CommandEvent(nullptr, timed));
+  return RecordCommand(errorCode, COMMAND_KERNEL, nullptr, timed);
 }
 
 cl_int OpenCLProgram::FinishKernelExecution() { return clFinish(queue); }
 
+cl_int OpenCLProgram::FlushKernelExecution() { return clFlush(queue); }
+
 cl_int OpenCLProgram::ReadKernelOutput(cl_mem buf, bool blocking,
-                                       size_t outputSize, void *output) {
+                                       size_t outputSize, void *output,
+                                       cl_event *event) {
   cl_bool block;
   if (blocking) {
     block = CL_TRUE;
   } else {
     block = CL_FALSE;
   }
-  return clEnqueueReadBuffer(queue, buf, block, 0, outputSize, output, 0, NULL,
+  cl_event timed;
+  cl_int errorCode =
+      clEnqueueReadBuffer(queue, buf, block, 0, outputSize, output, 0, NULL,
+                          CommandEvent(event, timed));
+  return RecordCommand(errorCode, COMMAND_TRANSFER, event, timed);
+}
+
+cl_int OpenCLProgram::ReadBufferRegion(cl_mem buf, size_t offset, size_t size,
+                                       void *output) {
+  cl_event timed;
+  cl_int errorCode = clEnqueueReadBuffer(queue, buf, CL_TRUE, offset, size,
+                                         output, 0, NULL,
+                                         CommandEvent(nullptr, timed));
+  return RecordCommand(errorCode, COMMAND_TRANSFER, nullptr, timed);
+}
+
+cl_int OpenCLProgram::WriteBuffer(cl_mem buf, bool blocking, size_t inputSize,
+                                  const void *input) {
+  cl_event timed;
+  cl_int errorCode = clEnqueueWriteBuffer(
+      queue, buf, blocking ? CL_TRUE : CL_FALSE, 0, inputSize, input, 0, NULL,
+      CommandEvent(nullptr, timed));
+  return RecordCommand(errorCode, COMMAND_TRANSFER, nullptr, timed);
+}
+
+cl_int OpenCLProgram::FillBuffer(cl_mem buf, const void *pattern,
+                                 size_t patternSize, size_t size) {
+  return clEnqueueFillBuffer(queue, buf, pattern, patternSize, 0, size, 0, NULL,
                              NULL);
 }
 
+cl_int OpenCLProgram::WaitForEvent(cl_event event) {
+  cl_int waitResult = clWaitForEvents(1, &event);
+  CL_ERROR_RETURN(clReleaseEvent(event));
+  return waitResult;
+}
+
 cl_int OpenCLProgram::AcquireGLObjects(cl_uint numObjects,
                                        const cl_mem *objects) {
   return clEnqueueAcquireGLObjects(queue, numObjects, objects, 0, NULL, NULL);
@@ -285,3 +607,75 @@ cl_int OpenCLProgram::ReleaseGLObjects(cl_uint numObjects,
                                        const cl_mem *objects) {
   return clEnqueueReleaseGLObjects(queue, numObjects, objects, 0, NULL, NULL);
 }
+
+cl_int OpenCLProgram::BinaryCachePath(const std::string &programSource,
+                                      const std::string &options,
+                                      std::string &path) const {
+  // Binaries are only valid for the exact device, driver, source and options
+  std::string identity = programSource + options;
+  for (cl_device_info info : {CL_DEVICE_NAME, CL_DRIVER_VERSION}) {
+    size_t size;
+    CL_ERROR_RETURN(clGetDeviceInfo(device, info, 0, NULL, &size));
+    std::vector<char> value(size);
+    CL_ERROR_RETURN(clGetDeviceInfo(device, info, size, value.data(), NULL));
+    identity += value.data();
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.clbin",
+           (unsigned long long)std::hash<std::string>()(identity));
+  path = binaryCacheDirectory + "/" + name;
+  return CL_SUCCESS;
+}
+
+cl_int OpenCLProgram::LoadProgramBinary(const std::string &path,
+                                        const std::string &options) {
+  std::ifstream in(path, std::ifstream::binary);
+  if (!in) {
+    return CL_INVALID_BINARY;
+  }
+  std::vector<unsigned char> binary((std::istreambuf_iterator<char>(in)),
+                                    (std::istreambuf_iterator<char>()));
+  const unsigned char *binaryData = binary.data();
+  const size_t binarySize = binary.size();
+  cl_int binaryStatus;
+  cl_int errorCode;
+  program = clCreateProgramWithBinary(context, 1, &device, &binarySize,
+                                      &binaryData, &binaryStatus, &errorCode);
+  CL_ERROR_RETURN(errorCode);
+  // A binary from an older driver is rejected here or at build time, in
+  // which case the caller compiles from source instead
+  if (binaryStatus != CL_SUCCESS ||
+      clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL) !=
+          CL_SUCCESS) {
+    clReleaseProgram(program);
+    program = nullptr;
+    return CL_INVALID_BINARY;
+  }
+  return CL_SUCCESS;
+}
+
+cl_int OpenCLProgram::SaveProgramBinary(const std::string &path) const {
+  size_t binarySize;
+  CL_ERROR_RETURN(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+                                   sizeof(size_t), &binarySize, NULL));
+  std::vector<unsigned char> binary(binarySize);
+  unsigned char *binaryData = binary.data();
+  CL_ERROR_RETURN(clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                                   sizeof(unsigned char *), &binaryData,
+                                   NULL));
+  // Written next to the target and renamed, so concurrent processes never
+  // read a partial binary
+  std::string temporaryPath = path + ".tmp";
+  {
+    std::ofstream out(temporaryPath, std::ofstream::binary);
+    out.write((const char *)binary.data(), binary.size());
+    if (!out) {
+      return CL_INVALID_VALUE;
+    }
+  }
+  if (rename(temporaryPath.c_str(), path.c_str()) != 0) {
+    remove(temporaryPath.c_str());
+    return CL_INVALID_VALUE;
+  }
+  return CL_SUCCESS;
+}
@@ -43,6 +43,7 @@ int OpenGLProgram::InitOpenGL() {
 }
 
 int OpenGLProgram::Shutdown() {
+  GL_ERROR_RETURN(CleanUpPixelBuffers());
   GL_ERROR_RETURN(CleanUpFramebuffer());
 
   // Clean up GLFW
@@ -100,16 +101,116 @@ inline int OpenGLProgram::CleanUpFramebuffer() {
   return GL_NO_ERROR;
 }
 
+int OpenGLProgram::AllocatePixelBuffers() {
+  GL_ERROR_RETURN(CleanUpPixelBuffers());
+
+  // Persistent buffers are mapped once and written while the GPU may still
+  // read the other one. Otherwise each frame maps its buffer anew.
+  m_persistentPixelBuffers = GLEW_ARB_buffer_storage;
+  const GLbitfield persistentFlags =
+      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  GL_VOID_ERROR_RETURN(glGenBuffers(PIXEL_BUFFER_COUNT, m_pixelBuffers));
+  for (int i = 0; i < PIXEL_BUFFER_COUNT; ++i) {
+    GL_VOID_ERROR_RETURN(
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffers[i]));
+    if (m_persistentPixelBuffers) {
+      GL_VOID_ERROR_RETURN(glBufferStorage(
+          GL_PIXEL_UNPACK_BUFFER, PixelBufferSize(), NULL, persistentFlags));
+      GL_VOID_ERROR_RETURN(m_pixelPointers[i] = glMapBufferRange(
+                               GL_PIXEL_UNPACK_BUFFER, 0, PixelBufferSize(),
+                               persistentFlags));
+    } else {
+      GL_VOID_ERROR_RETURN(glBufferData(GL_PIXEL_UNPACK_BUFFER,
+                                        PixelBufferSize(), NULL,
+                                        GL_STREAM_DRAW));
+    }
+  }
+  GL_VOID_ERROR_RETURN(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+  return GL_NO_ERROR;
+}
+
+int OpenGLProgram::MapPixelBuffer(int index, void** pointer) {
+  if (m_uploadFences[index] != nullptr) {
+    GLenum status = glClientWaitSync(m_uploadFences[index],
+                                     GL_SYNC_FLUSH_COMMANDS_BIT,
+                                     GL_TIMEOUT_IGNORED);
+    GL_VOID_ERROR_RETURN(glDeleteSync(m_uploadFences[index]));
+    m_uploadFences[index] = nullptr;
+    if (status == GL_WAIT_FAILED) {
+      return GL_INVALID_OPERATION;
+    }
+  }
+  if (m_pixelPointers[index] == nullptr) {
+    // Invalidating lets the driver hand out fresh memory instead of waiting
+    GL_VOID_ERROR_RETURN(
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffers[index]));
+    GL_VOID_ERROR_RETURN(m_pixelPointers[index] = glMapBufferRange(
+                             GL_PIXEL_UNPACK_BUFFER, 0, PixelBufferSize(),
+                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+    GL_VOID_ERROR_RETURN(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+  }
+  *pointer = m_pixelPointers[index];
+  return GL_NO_ERROR;
+}
+
+int OpenGLProgram::UploadPixelBuffer(int index) {
+  GL_VOID_ERROR_RETURN(
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffers[index]));
+  if (!m_persistentPixelBuffers) {
+    GL_VOID_ERROR_RETURN(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+    m_pixelPointers[index] = nullptr;
+  }
+  // Rows of RGB8 are not padded to four bytes
+  GL_VOID_ERROR_RETURN(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+  GL_VOID_ERROR_RETURN(glBindTexture(GL_TEXTURE_2D, m_texture));
+  GL_VOID_ERROR_RETURN(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, baseResX,
+                                       baseResY, GL_RGB, GL_UNSIGNED_BYTE,
+                                       (const void*)0));
+  GL_VOID_ERROR_RETURN(glBindTexture(GL_TEXTURE_2D, 0));
+  GL_VOID_ERROR_RETURN(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+  GL_VOID_ERROR_RETURN(m_uploadFences[index] = glFenceSync(
+                           GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+  return GL_NO_ERROR;
+}
+
+int OpenGLProgram::CleanUpPixelBuffers() {
+  for (int i = 0; i < PIXEL_BUFFER_COUNT; ++i) {
+    if (m_uploadFences[i] != nullptr) {
+      GL_VOID_ERROR_RETURN(glDeleteSync(m_uploadFences[i]));
+      m_uploadFences[i] = nullptr;
+    }
+    if (m_pixelPointers[i] != nullptr) {
+      GL_VOID_ERROR_RETURN(
+          glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffers[i]));
+      GL_VOID_ERROR_RETURN(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+      m_pixelPointers[i] = nullptr;
+    }
+  }
+  GL_VOID_ERROR_RETURN(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+  if (m_pixelBuffers[0] != 0) {
+    GL_VOID_ERROR_RETURN(glDeleteBuffers(PIXEL_BUFFER_COUNT, m_pixelBuffers));
+  }
+  for (int i = 0; i < PIXEL_BUFFER_COUNT; ++i) {
+    m_pixelBuffers[i] = 0;
+  }
+  return GL_NO_ERROR;
+}
+
 int OpenGLProgram::BlitFramebuffer() {
+  return BlitFramebuffer(baseResX, baseResY);
+}
+
+int OpenGLProgram::BlitFramebuffer(unsigned int srcX, unsigned int srcY,
+                                   bool flipped) {
   GL_VOID_ERROR_RETURN(glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo));
 
   int windowWidth, windowHeight;
   GL_ERROR_RETURN(GetWindowPixelSize(&windowWidth, &windowHeight));
   // Resize the viewport while we are at it
   GL_VOID_ERROR_RETURN(glViewport(0, 0, windowWidth, windowHeight));
-  GL_VOID_ERROR_RETURN(glBlitFramebuffer(0, 0, baseResX, baseResY, 0, 0,
-                                         windowWidth, windowHeight,
-                                         GL_COLOR_BUFFER_BIT, GL_LINEAR));
+  GL_VOID_ERROR_RETURN(glBlitFramebuffer(
+      0, 0, srcX, srcY, 0, flipped ? windowHeight : 0, windowWidth,
+      flipped ? 0 : windowHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR));
 
   GL_VOID_ERROR_RETURN(glBindFramebuffer(GL_READ_FRAMEBUFFER, 0));
   GL_VOID_ERROR_RETURN(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0));
@@ -0,0 +1,84 @@
+#include "RenderCoordinator.hpp"
+
+#include <algorithm>
+#include <future>
+
+#include "Scene.hpp"
+
+void RenderCoordinator::Partition(int height, int workers,
+                                  std::vector<int> &rowBegins,
+                                  std::vector<int> &rowCounts) {
+  rowBegins.clear();
+  rowCounts.clear();
+  // Traces are padded to whole tiles, so bands of whole tiles keep workers
+  // from tracing rows of the next band
+  const int tiles = (height + TILE_PIXELS - 1) / TILE_PIXELS;
+  workers = std::max(workers, 1);
+  const int bandTiles = (tiles + workers - 1) / workers;
+  for (int begin = 0; begin < height; begin += bandTiles * TILE_PIXELS) {
+    rowBegins.push_back(begin);
+    rowCounts.push_back(std::min(bandTiles * TILE_PIXELS, height - begin));
+  }
+}
+
+int RenderCoordinator::Render(const RenderJob &job, Checkpoint &checkpoint,
+                              std::string &errorLog) const {
+  if (workerAddresses.empty()) {
+    errorLog = "no workers";
+    return 1;
+  }
+  std::vector<int> rowBegins;
+  std::vector<int> rowCounts;
+  Partition(job.height, workerAddresses.size(), rowBegins, rowCounts);
+
+  Scene scene;
+  if (scene.Load(job.scene) != 0) {
+    errorLog = "unknown scene " + job.scene;
+    return 1;
+  }
+  checkpoint = Checkpoint(job.width, job.height);
+  checkpoint.scene = job.scene;
+  checkpoint.depth = job.depth;
+  checkpoint.origin = job.origin;
+  checkpoint.lookAt = job.lookAt;
+  checkpoint.fov = job.fov;
+  checkpoint.precision = job.precision;
+  checkpoint.sampleFormat = job.sampleFormat;
+  checkpoint.numLights = scene.NumLights();
+  std::vector<std::future<int>> bands;
+  std::vector<std::string> bandErrors(rowBegins.size());
+  for (size_t i = 0; i < rowBegins.size(); ++i) {
+    RenderJob band = job;
+    band.outputPath.clear();
+    band.rowBegin = rowBegins[i];
+    band.rowCount = rowCounts[i];
+    const std::string &address = workerAddresses[i];
+    std::string &bandError = bandErrors[i];
+    // Each band is copied into its own rows of the accumulation, so the
+    // workers never touch the same pixels
+    bands.push_back(std::async(
+        std::launch::async, [band, address, &bandError, &checkpoint]() {
+          std::vector<cl_float4> rows;
+          if (RenderServer::FetchAccumulation(address, band, rows,
+                                              bandError) != 0) {
+            return 1;
+          }
+          std::copy(rows.begin(), rows.end(),
+                    checkpoint.accumulation.begin() +
+                        (size_t)band.width * band.rowBegin);
+          return 0;
+        }));
+  }
+
+  int failures = 0;
+  for (size_t i = 0; i < bands.size(); ++i) {
+    if (bands[i].get() != 0) {
+      errorLog += (failures++ > 0 ? "; " : "") + bandErrors[i];
+    }
+  }
+  if (failures > 0) {
+    return 1;
+  }
+  checkpoint.samples = job.samples;
+  return 0;
+}
@@ -0,0 +1,764 @@
+#include "RenderServer.hpp"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "Camera.hpp"
+#include "ImageWriter.hpp"
+#include "Metrics.hpp"
+#include "Scene.hpp"
+
+namespace {
+
+bool make_socket_address(const std::string &socketPath,
+                         sockaddr_un &address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+  return true;
+}
+
+// Addresses of the form host:port are TCP, anything with a slash or without
+// a colon is a Unix socket path. An empty host listens on every interface.
+bool split_tcp_address(const std::string &address, std::string &host,
+                       std::string &port) {
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos || address.find('/') != std::string::npos ||
+      colon + 1 == address.size()) {
+    return false;
+  }
+  host = address.substr(0, colon);
+  port = address.substr(colon + 1);
+  return true;
+}
+
+// Calls use on the addresses host:port resolves to until it returns a
+// socket, or returns -1
+template <typename F>
+int with_tcp_address(const std::string &host, const std::string &port,
+                     bool passive, F use) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  addrinfo *addresses;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                  &hints, &addresses) != 0) {
+    return -1;
+  }
+  int result = -1;
+  for (addrinfo *info = addresses; info != nullptr && result < 0;
+       info = info->ai_next) {
+    int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (use(fd, info->ai_addr, info->ai_addrlen)) {
+      result = fd;
+    } else {
+      close(fd);
+    }
+  }
+  freeaddrinfo(addresses);
+  return result;
+}
+
+// Fails on errors, including a receive timeout, and on lines longer than
+// RENDER_SERVER_MAX_LINE. A last line without a line break is accepted when
+// the peer closes the connection.
+bool read_line(int fd, std::string &line) {
+  line.clear();
+  char c;
+  while (true) {
+    ssize_t received = read(fd, &c, 1);
+    if (received < 0) {
+      return false;
+    }
+    if (received == 0) {
+      return !line.empty();
+    }
+    if (c == '\n') {
+      return true;
+    }
+    if (line.size() >= RENDER_SERVER_MAX_LINE) {
+      return false;
+    }
+    line.push_back(c);
+  }
+}
+
+bool write_all(int fd, const void *data, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t result =
+        write(fd, (const char *)data + written, size - written);
+    if (result <= 0) {
+      return false;
+    }
+    written += result;
+  }
+  return true;
+}
+
+bool read_all(int fd, void *data, size_t size) {
+  size_t received = 0;
+  while (received < size) {
+    ssize_t result = read(fd, (char *)data + received, size - received);
+    if (result <= 0) {
+      return false;
+    }
+    received += result;
+  }
+  return true;
+}
+
+bool write_line(int fd, const std::string &line) {
+  std::string data = line + "\n";
+  return write_all(fd, data.data(), data.size());
+}
+
+int connect_socket(const std::string &socketPath) {
+  std::string host;
+  std::string port;
+  if (split_tcp_address(socketPath, host, port)) {
+    return with_tcp_address(
+        host, port, false,
+        [](int fd, const sockaddr *address, socklen_t length) {
+          return connect(fd, address, length) == 0;
+        });
+  }
+  sockaddr_un address;
+  if (!make_socket_address(socketPath, address)) {
+    return -1;
+  }
+  int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connection < 0) {
+    return -1;
+  }
+  if (connect(connection, (sockaddr *)&address, sizeof(address)) != 0) {
+    close(connection);
+    return -1;
+  }
+  return connection;
+}
+
+bool is_loopback(const sockaddr *address) {
+  if (address->sa_family == AF_INET) {
+    const sockaddr_in *ipv4 = (const sockaddr_in *)address;
+    return (ntohl(ipv4->sin_addr.s_addr) >> 24) == 127;
+  }
+  if (address->sa_family == AF_INET6) {
+    const sockaddr_in6 *ipv6 = (const sockaddr_in6 *)address;
+    return IN6_IS_ADDR_LOOPBACK(&ipv6->sin6_addr);
+  }
+  return false;
+}
+
+// An empty host listens on the loopback interface. Other interfaces are only
+// bound with allowRemote, as anyone who can connect may submit jobs.
+int listen_tcp(const std::string &host, const std::string &port,
+               bool allowRemote) {
+  bool refused = false;
+  int listener = with_tcp_address(
+      host.empty() ? "127.0.0.1" : host, port, true,
+      [allowRemote, &refused](int fd, const sockaddr *address,
+                              socklen_t length) {
+        if (!allowRemote && !is_loopback(address)) {
+          refused = true;
+          return false;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        return bind(fd, address, length) == 0 && listen(fd, 16) == 0;
+      });
+  if (listener < 0 && refused) {
+    std::cout << host << " is not a loopback address, which needs "
+                 "--allow-remote."
+              << std::endl;
+  }
+  return listener;
+}
+
+// Bounds how long a stalled client can hold up the single threaded server
+void set_timeouts(int connection) {
+  timeval timeout;
+  timeout.tv_sec = RENDER_SERVER_TIMEOUT;
+  timeout.tv_usec = 0;
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Reduces a TCP job's output path to its file name inside outputDirectory,
+// so remote clients cannot write anywhere else. Fails for an empty name.
+bool confine_output(const std::string &outputDirectory,
+                    std::string &outputPath) {
+  std::string name = outputPath.substr(outputPath.rfind('/') + 1);
+  if (name.empty() || name == "." || name == "..") {
+    return false;
+  }
+  outputPath = outputDirectory + "/" + name;
+  return true;
+}
+
+int listen_unix(const std::string &socketPath) {
+  sockaddr_un address;
+  if (!make_socket_address(socketPath, address)) {
+    std::cout << "Socket path is too long: " << socketPath << std::endl;
+    return -1;
+  }
+  // Replace a socket left behind by a previous server, but never another
+  // kind of file
+  struct stat existing;
+  if (lstat(socketPath.c_str(), &existing) == 0) {
+    if (!S_ISSOCK(existing.st_mode)) {
+      std::cout << socketPath << " exists and is not a socket." << std::endl;
+      return -1;
+    }
+    unlink(socketPath.c_str());
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    return -1;
+  }
+  if (bind(listener, (sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, 16) != 0) {
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+// Kernel variants a job forces on or off that the renderer fell back from,
+// which would trace the job differently from a worker that honors them
+std::string unhonored_settings(const RenderSettings &settings,
+                               const Renderer &renderer) {
+  const struct {
+    const char *name;
+    KernelFeature requested;
+    bool enabled;
+  } features[] = {
+      {"scene_cache", settings.sceneCache, renderer.IsSceneCached()},
+      {"tile_culling", settings.tileCulling, renderer.IsTileCulled()},
+      {"persistent_threads", settings.persistentThreads,
+       renderer.IsPersistent()}};
+  for (const auto &feature : features) {
+    if ((feature.requested == FEATURE_ON && !feature.enabled) ||
+        (feature.requested == FEATURE_OFF && feature.enabled)) {
+      return std::string(feature.name) + "=" +
+             Renderer::FeatureName(feature.requested);
+    }
+  }
+  return "";
+}
+
+// Values with spaces, quotes, backslashes or line breaks, and empty ones,
+// are sent in double quotes with \" \\ and \n escapes, so that paths can
+// hold any character and the request stays on one line
+std::string quote_value(const std::string &value) {
+  if (!value.empty() && value.find_first_of(" \"\\\n") == std::string::npos) {
+    return value;
+  }
+  std::string result = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (c == '\n') {
+      result += "\\n";
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+// Reads the key=value field starting at or after pos, unquoting the value.
+// Returns false at the end of the request and sets malformed on bad input.
+bool next_field(const std::string &request, size_t &pos, std::string &key,
+                std::string &value, bool &malformed) {
+  malformed = false;
+  pos = request.find_first_not_of(' ', pos);
+  if (pos == std::string::npos) {
+    return false;
+  }
+  size_t equals = request.find('=', pos);
+  size_t space = request.find(' ', pos);
+  if (equals == std::string::npos || equals > space) {
+    malformed = true;
+    return false;
+  }
+  key = request.substr(pos, equals - pos);
+  pos = equals + 1;
+  value.clear();
+  if (pos >= request.size() || request[pos] != '"') {
+    space = request.find(' ', pos);
+    value = request.substr(pos, space - pos);
+    pos = space == std::string::npos ? request.size() : space;
+    return true;
+  }
+  for (++pos; pos < request.size(); ++pos) {
+    char c = request[pos];
+    if (c == '"') {
+      ++pos;
+      // A closing quote ends the field
+      if (pos < request.size() && request[pos] != ' ') {
+        malformed = true;
+        return false;
+      }
+      return true;
+    }
+    if (c == '\\') {
+      if (++pos >= request.size()) {
+        break;
+      }
+      c = request[pos] == 'n' ? '\n' : request[pos];
+    }
+    value += c;
+  }
+  // Unterminated quote
+  malformed = true;
+  return false;
+}
+
+std::string format_vector(const CLTypes::Vector3 &v) {
+  std::stringstream result;
+  result << v.x() << "," << v.y() << "," << v.z();
+  return result.str();
+}
+
+}  // namespace
+
+std::string RenderJob::Serialize() const {
+  std::stringstream request;
+  request << "scene=" << quote_value(scene) << " width=" << width
+          << " height=" << height << " spp=" << samples << " depth=" << depth
+          << " origin=" << format_vector(origin)
+          << " lookat=" << format_vector(lookAt) << " fov=" << fov;
+  if (!outputPath.empty()) {
+    request << " output=" << quote_value(outputPath);
+  }
+  if (!format.empty()) {
+    request << " format=" << quote_value(format);
+  }
+  if (rowCount > 0) {
+    request << " rows=" << rowBegin << "," << rowCount;
+  }
+  request << " sample_format=" << Renderer::SampleFormatName(sampleFormat)
+          << " precision=" << Renderer::PrecisionName(precision)
+          << " scene_cache=" << Renderer::FeatureName(sceneCache)
+          << " tile_culling=" << Renderer::FeatureName(tileCulling)
+          << " persistent_threads="
+          << Renderer::FeatureName(persistentThreads);
+  return request.str();
+}
+
+int RenderJob::Parse(const std::string &request) {
+  size_t pos = 0;
+  std::string key;
+  std::string value;
+  bool malformed;
+  try {
+    while (next_field(request, pos, key, value, malformed)) {
+      if (key == "scene") {
+        scene = value;
+      } else if (key == "width") {
+        width = std::stoi(value);
+      } else if (key == "height") {
+        height = std::stoi(value);
+      } else if (key == "spp") {
+        samples = std::stoi(value);
+      } else if (key == "depth") {
+        depth = std::stoi(value);
+      } else if (key == "origin") {
+        if (!CLTypes::Vector3::Parse(value, origin)) {
+          return 1;
+        }
+      } else if (key == "lookat") {
+        if (!CLTypes::Vector3::Parse(value, lookAt)) {
+          return 1;
+        }
+      } else if (key == "fov") {
+        fov = std::stof(value);
+      } else if (key == "output") {
+        outputPath = value;
+      } else if (key == "format") {
+        format = value;
+      } else if (key == "rows") {
+        size_t comma = value.find(',');
+        if (comma == std::string::npos) {
+          return 1;
+        }
+        rowBegin = std::stoi(value.substr(0, comma));
+        rowCount = std::stoi(value.substr(comma + 1));
+      } else if (key == "sample_format") {
+        if (!Renderer::ParseSampleFormat(value, sampleFormat)) {
+          return 1;
+        }
+      } else if (key == "precision") {
+        if (!Renderer::ParsePrecision(value, precision)) {
+          return 1;
+        }
+      } else if (key == "scene_cache") {
+        if (!Renderer::ParseFeature(value, sceneCache)) {
+          return 1;
+        }
+      } else if (key == "tile_culling") {
+        if (!Renderer::ParseFeature(value, tileCulling)) {
+          return 1;
+        }
+      } else if (key == "persistent_threads") {
+        if (!Renderer::ParseFeature(value, persistentThreads)) {
+          return 1;
+        }
+      } else {
+        return 1;
+      }
+    }
+  } catch (const std::exception &) {
+    return 1;
+  }
+  if (malformed) {
+    return 1;
+  }
+  return (width > 0 && height > 0 && samples > 0 && depth > 0 &&
+          rowBegin >= 0 && rowCount >= 0 && rowBegin + BandRows() <= height)
+             ? 0
+             : 1;
+}
+
+RenderServer::~RenderServer() {
+  for (auto &cached : renderers) {
+    cached.second.renderer->Unload();
+  }
+}
+
+int RenderServer::Run(const std::string &socketPath) {
+  // Clients that hang up early must not take the server down with them
+  signal(SIGPIPE, SIG_IGN);
+
+  std::string host;
+  std::string port;
+  tcp = split_tcp_address(socketPath, host, port);
+  int listener =
+      tcp ? listen_tcp(host, port, allowRemote) : listen_unix(socketPath);
+  if (listener < 0) {
+    std::cout << "Could not listen on " << socketPath << std::endl;
+    return 1;
+  }
+  std::cout << "Render server listening on " << socketPath << std::endl;
+
+  bool running = true;
+  while (running) {
+    int connection = accept(listener, nullptr, nullptr);
+    if (connection < 0) {
+      continue;
+    }
+    set_timeouts(connection);
+    std::string request;
+    if (read_line(connection, request)) {
+      std::string response;
+      // Accumulations are followed by binary data, so they answer directly
+      bool accumulate = request.compare(0, strlen(ACCUMULATE_REQUEST),
+                                        ACCUMULATE_REQUEST) == 0;
+      if (request == "shutdown") {
+        // Only local users who can reach the socket file may stop the server
+        running = tcp;
+        response = tcp ? "error shutdown is only accepted on a Unix socket"
+                       : "ok shutting down";
+      } else if (accumulate) {
+        response = SendAccumulation(
+            connection, request.substr(strlen(ACCUMULATE_REQUEST)));
+      } else {
+        response = HandleRequest(request);
+      }
+      std::cout << request << " -> " << response << std::endl;
+      if (!accumulate) {
+        write_line(connection, response);
+      }
+    }
+    close(connection);
+  }
+
+  close(listener);
+  if (!tcp) {
+    unlink(socketPath.c_str());
+  }
+  return 0;
+}
+
+int RenderServer::Submit(const std::string &socketPath,
+                         const std::string &request, std::string &response) {
+  int connection = connect_socket(socketPath);
+  if (connection < 0) {
+    return 1;
+  }
+  if (!write_line(connection, request) || !read_line(connection, response)) {
+    close(connection);
+    return 1;
+  }
+  close(connection);
+  return 0;
+}
+
+int RenderServer::FetchAccumulation(const std::string &socketPath,
+                                    const RenderJob &job,
+                                    std::vector<cl_float4> &rows,
+                                    std::string &errorLog) {
+  int connection = connect_socket(socketPath);
+  if (connection < 0) {
+    errorLog = "could not reach " + socketPath;
+    return 1;
+  }
+  std::string response;
+  if (!write_line(connection, ACCUMULATE_REQUEST + job.Serialize()) ||
+      !read_line(connection, response)) {
+    close(connection);
+    errorLog = "no response from " + socketPath;
+    return 1;
+  }
+  // "ok <BYTES> ..." precedes the data
+  const size_t expected =
+      sizeof(cl_float4) * (size_t)job.width * job.BandRows();
+  if (response.compare(0, 3, "ok ") != 0 ||
+      std::strtoull(response.c_str() + 3, nullptr, 10) != expected) {
+    close(connection);
+    errorLog = socketPath + ": " + response;
+    return 1;
+  }
+  rows.resize((size_t)job.width * job.BandRows());
+  bool received = read_all(connection, rows.data(), expected);
+  close(connection);
+  if (!received) {
+    errorLog = "incomplete accumulation from " + socketPath;
+    return 1;
+  }
+  return 0;
+}
+
+std::string RenderServer::HandleRequest(const std::string &request) {
+  RenderJob job;
+  if (job.Parse(request) != 0) {
+    return "error malformed job";
+  }
+  if (tcp && !job.outputPath.empty()) {
+    if (outputDirectory.empty()) {
+      return "error jobs over TCP need a server started with --output-dir";
+    }
+    if (!confine_output(outputDirectory, job.outputPath)) {
+      return "error invalid output";
+    }
+  }
+  return RenderToFile(job);
+}
+
+Renderer *RenderServer::GetRenderer(const RenderJob &job, bool &cacheHit,
+                                    std::string &errorLog) {
+  // Programs depend on every setting but the sample count
+  const RenderSettings settings = job.Settings();
+  std::stringstream keyStream;
+  keyStream << job.width << "x" << job.height << "/" << job.depth << "/"
+            << Renderer::SampleFormatName(settings.sampleFormat) << "/"
+            << Renderer::PrecisionName(settings.precision) << "/"
+            << Renderer::FeatureName(settings.sceneCache)
+            << Renderer::FeatureName(settings.tileCulling)
+            << Renderer::FeatureName(settings.persistentThreads) << "/"
+            << job.scene;
+  std::string key = keyStream.str();
+
+  auto cached = renderers.find(key);
+  cacheHit = cached != renderers.end();
+  Metrics::RecordCacheLookup(CACHE_SERVER, cacheHit);
+  if (cacheHit) {
+    cached->second.lastUsed = ++useCounter;
+    return cached->second.renderer.get();
+  }
+
+  Scene scene;
+  if (scene.Load(job.scene) != 0) {
+    errorLog = "unknown scene " + job.scene;
+    return nullptr;
+  }
+
+  if (renderers.size() >= MAX_CACHED_RENDERERS) {
+    auto oldest = std::min_element(
+        renderers.begin(), renderers.end(),
+        [](const std::pair<const std::string, CachedRenderer> &a,
+           const std::pair<const std::string, CachedRenderer> &b) {
+          return a.second.lastUsed < b.second.lastUsed;
+        });
+    oldest->second.renderer->Unload();
+    renderers.erase(oldest);
+  }
+
+  std::unique_ptr<Renderer> renderer(new Renderer());
+  std::string buildLog;
+  if (renderer->Init(platform, device, settings, scene.spheres, {},
+                     buildLog) != CL_SUCCESS) {
+    errorLog = "could not build program: " + buildLog;
+    // Releases whatever Init created before failing
+    renderer->Unload();
+    return nullptr;
+  }
+  errorLog = unhonored_settings(settings, *renderer);
+  if (!errorLog.empty()) {
+    errorLog = "cannot honor " + errorLog;
+    renderer->Unload();
+    return nullptr;
+  }
+  CachedRenderer &entry = renderers[key];
+  entry.renderer = std::move(renderer);
+  entry.lastUsed = ++useCounter;
+  return entry.renderer.get();
+}
+
+std::string RenderServer::RenderAccumulation(const RenderJob &job,
+                                             Renderer *renderer) {
+  Camera cam(job.origin, job.lookAt, CLTypes::Vector3(0, 1, 0), job.fov,
+             cl_float(job.width) / cl_float(job.height));
+  if (renderer->SetCamera(cam.Calculate()) != CL_SUCCESS ||
+      renderer->ClearAccumulation() != CL_SUCCESS) {
+    return "error could not set up the render";
+  }
+  // Passes do not depend on the band, so each pixel sums the same samples in
+  // the same order as in a render of the whole image
+  for (int done = 0; done < job.samples; done += BASE_SAMPLES) {
+    cl_uint passSamples = std::min(BASE_SAMPLES, job.samples - done);
+    if (renderer->TraceRows(passSamples, done, job.rowBegin,
+                            job.BandRows()) != CL_SUCCESS ||
+        renderer->AccumulateRows(passSamples, job.rowBegin,
+                                 job.BandRows()) != CL_SUCCESS) {
+      return "error trace failed";
+    }
+  }
+  return "";
+}
+
+std::string RenderServer::SendAccumulation(int connection,
+                                           const std::string &request) {
+  auto startOfJob = std::chrono::high_resolution_clock::now();
+  RenderJob job;
+  std::string response;
+  std::string errorLog;
+  Renderer *renderer = nullptr;
+  bool cacheHit = false;
+  std::vector<cl_float4> rows;
+  if (job.Parse(request) != 0) {
+    response = "error malformed job";
+  } else if ((renderer = GetRenderer(job, cacheHit, errorLog)) == nullptr) {
+    response = "error " + errorLog;
+  } else {
+    response = RenderAccumulation(job, renderer);
+    if (response.empty() &&
+        renderer->ReadAccumulationRows(job.rowBegin, job.BandRows(), rows) !=
+            CL_SUCCESS) {
+      response = "error readback failed";
+    }
+  }
+  if (!response.empty()) {
+    write_line(connection, response);
+    return response;
+  }
+
+  std::chrono::duration<double, std::milli> jobTime =
+      std::chrono::high_resolution_clock::now() - startOfJob;
+  Metrics::RecordFrame(jobTime.count() / 1000.0,
+                       (unsigned long long)job.width * job.BandRows() *
+                           job.samples);
+  const size_t bytes = sizeof(cl_float4) * rows.size();
+  std::stringstream header;
+  header << "ok " << bytes << " cached=" << (cacheHit ? 1 : 0)
+         << " render_ms=" << jobTime.count();
+  if (!write_line(connection, header.str()) ||
+      !write_all(connection, rows.data(), bytes)) {
+    return "error client hung up";
+  }
+  return header.str();
+}
+
+std::string RenderServer::RenderToFile(const RenderJob &job) {
+  auto startOfJob = std::chrono::high_resolution_clock::now();
+  if (job.outputPath.empty()) {
+    return "error missing output";
+  }
+  if (job.rowCount > 0) {
+    return "error bands of rows need an accumulate request";
+  }
+
+  std::unique_ptr<ImageWriter> writer = ImageWriter::Create(
+      job.format, job.outputPath, std::thread::hardware_concurrency());
+  if (!writer) {
+    return "error unknown format " + job.format;
+  }
+
+  bool cacheHit;
+  std::string errorLog;
+  Renderer *renderer = GetRenderer(job, cacheHit, errorLog);
+  if (renderer == nullptr) {
+    return "error " + errorLog;
+  }
+  OpenCLProgram &program = renderer->GetProgram();
+
+  auto startOfTrace = std::chrono::high_resolution_clock::now();
+  std::string error = RenderAccumulation(job, renderer);
+  if (!error.empty()) {
+    return error;
+  }
+
+  bool floatOutput = writer->NeedsFloatData();
+  cl_mem outputBuffer;
+  void *mappedOutput;
+  if (renderer->CreateReadbackBuffer(floatOutput, &outputBuffer) !=
+      CL_SUCCESS) {
+    return "error could not allocate output";
+  }
+  if (renderer->ResolveAccumulation(floatOutput, outputBuffer) != CL_SUCCESS ||
+      program.MapBuffer(outputBuffer, CL_TRUE, CL_MAP_READ,
+                        renderer->ResolvedSize(floatOutput),
+                        &mappedOutput) != CL_SUCCESS) {
+    program.ReleaseBuffer(outputBuffer);
+    return "error resolve failed";
+  }
+  auto endOfTrace = std::chrono::high_resolution_clock::now();
+
+  int writeResult = writer->Write(
+      job.outputPath, writer->MakeImage(job.width, job.height, mappedOutput));
+  auto endOfJob = std::chrono::high_resolution_clock::now();
+  program.UnmapBuffer(outputBuffer, mappedOutput);
+  program.ReleaseBuffer(outputBuffer);
+  if (writeResult != 0) {
+    return "error could not write " + job.outputPath;
+  }
+
+  std::chrono::duration<double, std::milli> setupTime =
+      startOfTrace - startOfJob;
+  std::chrono::duration<double, std::milli> traceTime =
+      endOfTrace - startOfTrace;
+  std::chrono::duration<double, std::milli> encodeTime = endOfJob - endOfTrace;
+  Metrics::RecordFrame(traceTime.count() / 1000.0,
+                       (unsigned long long)job.width * job.height *
+                           job.samples);
+  std::stringstream response;
+  response << "ok " << job.outputPath << " cached=" << (cacheHit ? 1 : 0)
+           << " setup_ms=" << setupTime.count()
+           << " trace_ms=" << traceTime.count()
+           << " encode_ms=" << encodeTime.count();
+  return response.str();
+}
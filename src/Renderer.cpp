@@ -0,0 +1,735 @@
+#include "Renderer.hpp"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#ifdef EMBED_KERNELS
+#include "EmbeddedKernels.hpp"
+#endif
+
+std::string Renderer::binaryCacheDirectory;
+bool Renderer::printBufferStats = false;
+bool Renderer::recordDeviceTimes = false;
+bool Renderer::scalarSpheres = false;
+
+void Renderer::CalculateWorkIterations(
+    int sizeX, int sizeY, int ns, std::vector<std::vector<size_t>> &workSizes,
+    std::vector<std::vector<size_t>> &workOffsets) {
+  workSizes.clear();
+  workOffsets.clear();
+
+  // X
+  std::vector<size_t> workX;
+  std::vector<size_t> offsetsX;
+  int numWorkX = sizeX / BASE_RESOLUTION;
+  for (int x = 0; x < numWorkX; ++x) {
+    workX.push_back(BASE_RESOLUTION);
+    offsetsX.push_back(x * BASE_RESOLUTION);
+  }
+  if (sizeX % BASE_RESOLUTION != 0) {
+    workX.push_back(sizeX % BASE_RESOLUTION);
+    offsetsX.push_back(numWorkX * BASE_RESOLUTION);
+  }
+
+  // Y
+  std::vector<std::vector<size_t>> workXY;
+  std::vector<std::vector<size_t>> offsetsXY;
+  int numWorkY = sizeY / BASE_RESOLUTION;
+  for (int y = 0; y < numWorkY; ++y) {
+    for (size_t x = 0; x < workX.size(); ++x) {
+      workXY.push_back({workX[x], BASE_RESOLUTION});
+      offsetsXY.push_back({offsetsX[x], (size_t)(y * BASE_RESOLUTION)});
+    }
+  }
+  int moduloBaseY = sizeY % BASE_RESOLUTION;
+  if (moduloBaseY != 0) {
+    for (size_t x = 0; x < workX.size(); ++x) {
+      workXY.push_back({workX[x], (size_t)moduloBaseY});
+      offsetsXY.push_back({offsetsX[x], (size_t)(numWorkY * BASE_RESOLUTION)});
+    }
+  }
+
+  // Samples
+  int numWorkSamples = ns / BASE_SAMPLES;
+  for (int s = 0; s < numWorkSamples; ++s) {
+    for (size_t y = 0; y < workXY.size(); ++y) {
+      workSizes.push_back({workXY[y][0], workXY[y][1], BASE_SAMPLES});
+      workOffsets.push_back(
+          {offsetsXY[y][0], offsetsXY[y][1], (size_t)(s * BASE_SAMPLES)});
+    }
+  }
+  int moduloBaseSamples = ns % BASE_SAMPLES;
+  if (moduloBaseSamples != 0) {
+    for (size_t y = 0; y < workXY.size(); ++y) {
+      workSizes.push_back(
+          {workXY[y][0], workXY[y][1], (size_t)moduloBaseSamples});
+      workOffsets.push_back({offsetsXY[y][0], offsetsXY[y][1],
+                             (size_t)(numWorkSamples * BASE_SAMPLES)});
+    }
+  }
+}
+
+cl_int Renderer::LoadKernelSource(std::string &source) {
+#ifdef EMBED_KERNELS
+  source = EMBEDDED_KERNEL_SOURCE;
+  return CL_SUCCESS;
+#else
+  std::ifstream in;
+  in.open(CL_KERNEL_PATH, std::ifstream::in);
+  if (!in) {
+    return CL_INVALID_VALUE;
+  }
+  source = std::string((std::istreambuf_iterator<char>(in)),
+                       (std::istreambuf_iterator<char>()));
+  return CL_SUCCESS;
+#endif
+}
+
+std::string Renderer::DefaultBinaryCacheDirectory() {
+  std::string directory;
+  if (const char *cacheHome = std::getenv("XDG_CACHE_HOME")) {
+    directory = cacheHome;
+  } else if (const char *home = std::getenv("HOME")) {
+    directory = std::string(home) + "/.cache";
+  } else {
+    return "";
+  }
+  // Creating a directory that already exists fails harmlessly
+  mkdir(directory.c_str(), 0755);
+  directory += "/raytracer";
+  mkdir(directory.c_str(), 0755);
+  return directory;
+}
+
+bool Renderer::ParseSampleFormat(const std::string &name,
+                                 SampleFormat &format) {
+  for (SampleFormat candidate :
+       {SAMPLE_FLOAT, SAMPLE_PLANAR, SAMPLE_HALF, SAMPLE_RGBE}) {
+    if (name == SampleFormatName(candidate)) {
+      format = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string Renderer::SampleFormatName(SampleFormat format) {
+  switch (format) {
+    case SAMPLE_FLOAT:
+      return "float";
+    case SAMPLE_PLANAR:
+      return "planar";
+    case SAMPLE_HALF:
+      return "half";
+    case SAMPLE_RGBE:
+      return "rgbe";
+  }
+  return "";
+}
+
+size_t Renderer::SampleBytes(SampleFormat format) {
+  switch (format) {
+    case SAMPLE_HALF:
+      return 3 * sizeof(cl_half);
+    case SAMPLE_RGBE:
+      return sizeof(cl_uint);
+    default:
+      return 3 * sizeof(cl_float);
+  }
+}
+
+double Renderer::SampleErrorBudget(SampleFormat format) {
+  switch (format) {
+    case SAMPLE_HALF:
+      return SAMPLE_ERROR_BUDGET_HALF;
+    case SAMPLE_RGBE:
+      return SAMPLE_ERROR_BUDGET_RGBE;
+    default:
+      return SAMPLE_ERROR_BUDGET_FLOAT;
+  }
+}
+
+bool Renderer::ParseFeature(const std::string &name, KernelFeature &feature) {
+  for (KernelFeature candidate : {FEATURE_AUTO, FEATURE_ON, FEATURE_OFF}) {
+    if (name == FeatureName(candidate)) {
+      feature = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string Renderer::FeatureName(KernelFeature feature) {
+  switch (feature) {
+    case FEATURE_AUTO:
+      return "auto";
+    case FEATURE_ON:
+      return "on";
+    case FEATURE_OFF:
+      return "off";
+  }
+  return "";
+}
+
+bool Renderer::ParsePrecision(const std::string &name,
+                              PrecisionProfile &precision) {
+  for (PrecisionProfile candidate :
+       {PRECISION_EXACT, PRECISION_FAST, PRECISION_AGGRESSIVE}) {
+    if (name == PrecisionName(candidate)) {
+      precision = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string Renderer::PrecisionName(PrecisionProfile precision) {
+  switch (precision) {
+    case PRECISION_EXACT:
+      return "exact";
+    case PRECISION_FAST:
+      return "fast";
+    case PRECISION_AGGRESSIVE:
+      return "aggressive";
+  }
+  return "";
+}
+
+std::string Renderer::PrecisionCompilerOptions(PrecisionProfile precision) {
+  switch (precision) {
+    case PRECISION_FAST:
+      return "-cl-fast-relaxed-math -cl-mad-enable";
+    case PRECISION_AGGRESSIVE:
+      return "-cl-fast-relaxed-math -cl-mad-enable -cl-denorms-are-zero";
+    default:
+      return "";
+  }
+}
+
+cl_int Renderer::Init(
+    cl_platform_id platform, cl_device_id device,
+    const RenderSettings &renderSettings,
+    const std::vector<CLTypes::Sphere> &world,
+    const std::unordered_map<cl_context_properties, cl_context_properties>
+        &properties,
+    std::string &errorLog) {
+  settings = renderSettings;
+  numSpheres = world.size();
+
+  // The light list is the front of the scene, so emissive spheres are moved
+  // there in their original order
+  std::vector<CLTypes::Sphere> scene(world);
+  const int numLights =
+      std::stable_partition(scene.begin(), scene.end(),
+                            [](const CLTypes::Sphere &sphere) {
+                              return sphere.m.type == CLTypes::EMISSIVE;
+                            }) -
+      scene.begin();
+
+  // Read our program source
+  std::string source;
+  if (LoadKernelSource(source) != CL_SUCCESS) {
+    errorLog = "Could not read " CL_KERNEL_PATH;
+    return CL_INVALID_VALUE;
+  }
+  // Set up our definitions for compilation
+  std::unordered_map<std::string, std::string> definitions = {
+      {WIDTH, std::to_string(settings.sizeX)},
+      {HEIGHT, std::to_string(settings.sizeY)},
+      {SAMPLES, std::to_string(settings.samples)},
+      {DEPTH, std::to_string(settings.depth)},
+      {NUM_SPHERES, std::to_string(numSpheres)},
+      {USE_PINHOLE_CAMERA, std::to_string(settings.usePinholeCamera)},
+      {SAMPLE_FORMAT, std::to_string(settings.sampleFormat)},
+      {PRECISION, std::to_string(settings.precision)}};
+  // Constant memory is cached and fastest, so only scenes that do not fit
+  // are read from global memory, which is where the local cache pays off
+  std::vector<cl_float4> sceneData;
+  PackScene(scene, sceneData);
+  const size_t sceneSize = sizeof(cl_float4) * sceneData.size();
+  cl_ulong constantBufferSize;
+  CL_ERROR_RETURN(clGetDeviceInfo(device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE,
+                                  sizeof(cl_ulong), &constantBufferSize,
+                                  NULL));
+  bool sceneInGlobalMemory = sceneSize > constantBufferSize;
+  sceneCached = settings.sceneCache == FEATURE_ON ||
+                (settings.sceneCache == FEATURE_AUTO && sceneInGlobalMemory);
+  if (sceneInGlobalMemory || sceneCached) {
+    definitions[SCENE_IN_GLOBAL_MEMORY] = "1";
+  }
+  if (sceneCached) {
+    definitions[SCENE_CACHE_SIZE] = std::to_string(SCENE_CACHE_SPHERES);
+  }
+  if (scalarSpheres) {
+    definitions[SCALAR_SPHERES] = "1";
+  }
+  // Scenes without lights skip light sampling entirely
+  if (numLights > 0) {
+    definitions[NUM_LIGHTS] = std::to_string(numLights);
+  }
+  // A thin lens spreads ray origins over the aperture, so tile frustums are
+  // only exact for pinhole cameras
+  tileCulled = settings.usePinholeCamera &&
+               (settings.tileCulling == FEATURE_ON ||
+                (settings.tileCulling == FEATURE_AUTO &&
+                 numSpheres >= TILE_CULLING_MIN_SPHERES));
+  // Experimental: never benchmarked against the regular trace, so only on
+  // request
+  persistent = settings.persistentThreads == FEATURE_ON;
+  if (tileCulled) {
+    definitions[TILE_SIZE] = std::to_string(TILE_PIXELS);
+    definitions[TILE_CANDIDATES] = std::to_string(TILE_CANDIDATE_CAPACITY);
+  }
+  // Set up include paths, which embedded source has already inlined
+#ifdef EMBED_KERNELS
+  std::vector<std::string> includePaths;
+#else
+  std::vector<std::string> includePaths = {KERNEL_INCLUDE};
+#endif
+  program.SetBinaryCacheDirectory(binaryCacheDirectory);
+  program.SetCompilerOptions(PrecisionCompilerOptions(settings.precision));
+  program.SetProfiling(recordDeviceTimes);
+  CL_ERROR_RETURN(program.Init(platform, device, source, definitions,
+                               includePaths, properties, errorLog));
+
+  CL_ERROR_RETURN(program.LoadKernel(RAYTRACE_KERNEL, raytraceKernel));
+  CL_ERROR_RETURN(program.LoadKernel(COLOR_BUFFER_KERNEL, colorBufferKernel));
+  CL_ERROR_RETURN(program.LoadKernel(COLOR_IMAGE_KERNEL, colorImageKernel));
+  CL_ERROR_RETURN(program.LoadKernel(COLOR_FLOAT_KERNEL, colorFloatKernel));
+  CL_ERROR_RETURN(program.LoadKernel(ACCUMULATE_KERNEL, accumulateKernel));
+  CL_ERROR_RETURN(program.LoadKernel(ACCUMULATION_BUFFER_KERNEL,
+                                     accumulationBufferKernel));
+  CL_ERROR_RETURN(program.LoadKernel(ACCUMULATION_FLOAT_KERNEL,
+                                     accumulationFloatKernel));
+  CL_ERROR_RETURN(program.LoadKernel(FUSED_BUFFER_KERNEL, fusedBufferKernel));
+  CL_ERROR_RETURN(program.LoadKernel(FUSED_IMAGE_KERNEL, fusedImageKernel));
+  CL_ERROR_RETURN(program.LoadKernel(FUSED_FLOAT_KERNEL, fusedFloatKernel));
+  CL_ERROR_RETURN(
+      program.LoadKernel(TEMPORAL_TRACE_KERNEL, temporalTraceKernel));
+  CL_ERROR_RETURN(
+      program.LoadKernel(TEMPORAL_RESOLVE_KERNEL, temporalResolveKernel));
+  CL_ERROR_RETURN(program.LoadKernel(PERSISTENT_KERNEL, persistentKernel));
+
+  // Persistent groups fill every compute unit a few times over
+  cl_uint computeUnits;
+  CL_ERROR_RETURN(program.GetComputeUnits(computeUnits));
+  CL_ERROR_RETURN(
+      program.GetKernelWorkGroupSize(PERSISTENT_KERNEL, persistentGroupSize));
+  persistentGroupSize =
+      std::min(persistentGroupSize, (size_t)PERSISTENT_GROUP_SIZE);
+  persistentGroups = (size_t)computeUnits * PERSISTENT_GROUPS_PER_UNIT;
+
+  // Scene and sample buffers, which live as long as the program
+  CL_ERROR_RETURN(program.CreateBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                       sceneSize, (void *)sceneData.data(),
+                                       &sceneBuffer));
+  CL_ERROR_RETURN(program.CreateBuffer(CL_MEM_READ_WRITE, TraceBufferSize(),
+                                       nullptr, &traceResultsBuffer));
+  CL_ERROR_RETURN(raytraceKernel.Set<1>(sceneBuffer));
+  CL_ERROR_RETURN(raytraceKernel.Set<2>(traceResultsBuffer));
+  CL_ERROR_RETURN(raytraceKernel.Set<3>(0));
+  CL_ERROR_RETURN(program.CreateBuffer(CL_MEM_READ_WRITE, sizeof(cl_uint),
+                                       nullptr, &workCounterBuffer));
+  CL_ERROR_RETURN(persistentKernel.Set<1>(sceneBuffer));
+  CL_ERROR_RETURN(persistentKernel.Set<2>(traceResultsBuffer));
+  CL_ERROR_RETURN(persistentKernel.Set<4>(workCounterBuffer));
+
+  // Fused kernels trace the same scene
+  CL_ERROR_RETURN(fusedBufferKernel.Set<1>(sceneBuffer));
+  CL_ERROR_RETURN(fusedImageKernel.Set<1>(sceneBuffer));
+  CL_ERROR_RETURN(fusedFloatKernel.Set<1>(sceneBuffer));
+  CL_ERROR_RETURN(temporalTraceKernel.Set<1>(sceneBuffer));
+
+  // Every resolve kernel reads the trace buffer
+  CL_ERROR_RETURN(colorBufferKernel.Set<0>(traceResultsBuffer));
+  CL_ERROR_RETURN(colorImageKernel.Set<0>(traceResultsBuffer));
+  CL_ERROR_RETURN(colorFloatKernel.Set<0>(traceResultsBuffer));
+  CL_ERROR_RETURN(accumulateKernel.Set<0>(traceResultsBuffer));
+  return CL_SUCCESS;
+}
+
+void Renderer::PackScene(const std::vector<CLTypes::Sphere> &scene,
+                         std::vector<cl_float4> &data) {
+  static_assert(sizeof(CLTypes::Sphere) % sizeof(cl_float4) == 0,
+                "batches follow the spheres at float4 alignment");
+  const size_t sphereFloats =
+      sizeof(CLTypes::Sphere) / sizeof(cl_float4) * scene.size();
+  const size_t numBatches =
+      (scene.size() + SPHERE_BATCH_SIZE - 1) / SPHERE_BATCH_SIZE;
+  // Padding lanes are never reported as hits, so they stay zero
+  data.assign(sphereFloats + numBatches * SPHERE_BATCH_SIZE, cl_float4());
+  std::copy_n(reinterpret_cast<const cl_float4 *>(scene.data()),
+              sphereFloats, data.begin());
+  // Batch b holds the x, y and z of the centers and the radii of spheres
+  // SPHERE_BATCH_SIZE * b onwards, one float4 each
+  for (size_t i = 0; i < scene.size(); ++i) {
+    cl_float4 *batch = &data[sphereFloats + i / SPHERE_BATCH_SIZE *
+                                                SPHERE_BATCH_SIZE];
+    const size_t lane = i % SPHERE_BATCH_SIZE;
+    for (int axis = 0; axis < 3; ++axis) {
+      batch[axis].s[lane] = scene[i].center.s[axis];
+    }
+    batch[3].s[lane] = scene[i].radius;
+  }
+}
+
+cl_int Renderer::Unload() {
+  traceResultsBuffer = nullptr;
+  workCounterBuffer = nullptr;
+  sceneBuffer = nullptr;
+  cameraBuffer = nullptr;
+  previousCameraBuffer = nullptr;
+  accumulationBuffer = nullptr;
+  for (int i = 0; i < 2; ++i) {
+    temporalFrames[i] = nullptr;
+    temporalHistory[i] = nullptr;
+  }
+  temporalValid = false;
+  if (printBufferStats) {
+    program.DumpBufferStats(std::cout);
+  }
+  return program.Unload();
+}
+
+cl_int Renderer::SetCamera(const CLTypes::Camera &camera) {
+  // A released buffer stays alive until the traces already enqueued with it
+  // have completed
+  if (previousCameraBuffer != nullptr) {
+    CL_ERROR_RETURN(program.ReleaseBuffer(previousCameraBuffer));
+  }
+  previousCameraBuffer = cameraBuffer;
+  cameraBuffer = nullptr;
+  CL_ERROR_RETURN(program.CreateBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                       sizeof(CLTypes::Camera),
+                                       (void *)&camera, &cameraBuffer));
+  CL_ERROR_RETURN(raytraceKernel.Set<0>(cameraBuffer));
+  CL_ERROR_RETURN(persistentKernel.Set<0>(cameraBuffer));
+  CL_ERROR_RETURN(fusedBufferKernel.Set<0>(cameraBuffer));
+  CL_ERROR_RETURN(fusedImageKernel.Set<0>(cameraBuffer));
+  CL_ERROR_RETURN(fusedFloatKernel.Set<0>(cameraBuffer));
+  CL_ERROR_RETURN(temporalTraceKernel.Set<0>(cameraBuffer));
+  return temporalResolveKernel.Set<0>(cameraBuffer);
+}
+
+cl_int Renderer::Trace(int ns, cl_uint sampleOffset) {
+  return TraceRows(ns, sampleOffset, 0, settings.sizeY);
+}
+
+cl_int Renderer::TraceRows(int ns, cl_uint sampleOffset, int rowBegin,
+                           int rowCount) {
+  if (rowBegin < 0 || rowCount < 1 || rowBegin + rowCount > settings.sizeY) {
+    return CL_INVALID_VALUE;
+  }
+  std::vector<std::vector<size_t>> globalWorkSizes;
+  std::vector<std::vector<size_t>> globalWorkOffsets;
+  CalculateWorkIterations(settings.sizeX, rowCount, ns, globalWorkSizes,
+                          globalWorkOffsets);
+  for (auto &offset : globalWorkOffsets) {
+    offset[1] += rowBegin;
+  }
+
+  if (persistent) {
+    return TracePersistent(sampleOffset, globalWorkSizes, globalWorkOffsets);
+  }
+
+  CL_ERROR_RETURN(raytraceKernel.Set<3>(sampleOffset));
+  // Tiles are work groups, so the image is padded to whole tiles and the
+  // kernel skips pixels outside of it
+  std::vector<size_t> tileSizes = {TILE_PIXELS, TILE_PIXELS, 1};
+  for (size_t i = 0; i < globalWorkSizes.size(); ++i) {
+    if (tileCulled) {
+      for (int d = 0; d < 2; ++d) {
+        globalWorkSizes[i][d] =
+            (globalWorkSizes[i][d] + TILE_PIXELS - 1) / TILE_PIXELS *
+            TILE_PIXELS;
+      }
+    }
+    CL_ERROR_RETURN(raytraceKernel.Execute(globalWorkSizes[i],
+                                           &globalWorkOffsets[i],
+                                           tileCulled ? &tileSizes : nullptr));
+  }
+  return CL_SUCCESS;
+}
+
+cl_int Renderer::TracePersistent(
+    cl_uint sampleOffset, const std::vector<std::vector<size_t>> &chunkSizes,
+    const std::vector<std::vector<size_t>> &chunkOffsets) {
+  CL_ERROR_RETURN(persistentKernel.Set<3>(sampleOffset));
+  const cl_uint zero = 0;
+  for (size_t i = 0; i < chunkSizes.size(); ++i) {
+    cl_uint4 origin = {};
+    cl_uint4 size = {};
+    size_t items = 1;
+    for (int d = 0; d < 3; ++d) {
+      origin.s[d] = chunkOffsets[i][d];
+      size.s[d] = chunkSizes[i][d];
+      items *= chunkSizes[i][d];
+    }
+    // The counter restarts for every chunk. The queue is in order, so it is
+    // not reset before the previous chunk has drained it.
+    CL_ERROR_RETURN(program.FillBuffer(workCounterBuffer, &zero, sizeof(zero),
+                                       sizeof(zero)));
+    CL_ERROR_RETURN(persistentKernel.Set<5>(origin));
+    CL_ERROR_RETURN(persistentKernel.Set<6>(size));
+    // Small chunks do not need every group
+    const size_t groups =
+        std::min(persistentGroups,
+                 (items + persistentGroupSize - 1) / persistentGroupSize);
+    std::vector<size_t> globalWorkSizes = {groups * persistentGroupSize};
+    std::vector<size_t> localWorkSizes = {persistentGroupSize};
+    CL_ERROR_RETURN(
+        persistentKernel.Execute(globalWorkSizes, nullptr, &localWorkSizes));
+  }
+  return CL_SUCCESS;
+}
+
+cl_int Renderer::Resolve(bool floatOutput, cl_mem output) {
+  ResolveKernel &kernel = floatOutput ? colorFloatKernel : colorBufferKernel;
+  CL_ERROR_RETURN(kernel.Set<1>(output));
+  std::vector<size_t> globalWorkSizes = {(size_t)settings.sizeX,
+                                         (size_t)settings.sizeY};
+  return kernel.Execute(globalWorkSizes, nullptr);
+}
+
+cl_int Renderer::TraceResolved(int ns, bool floatOutput, cl_mem output,
+                               cl_uint sampleOffset) {
+  if (!CanFuse(ns)) {
+    CL_ERROR_RETURN(Trace(ns, sampleOffset));
+    return Resolve(floatOutput, output);
+  }
+  FusedKernel &kernel = floatOutput ? fusedFloatKernel : fusedBufferKernel;
+  CL_ERROR_RETURN(SetFusedArguments(kernel, ns, output, sampleOffset));
+  return ExecutePixelKernel(kernel, settings.sizeX, settings.sizeY);
+}
+
+cl_int Renderer::TraceResolvedImage(int ns, cl_mem image, int viewX,
+                                    int viewY, cl_uint sampleOffset) {
+  bool scaled = viewX != settings.sizeX || viewY != settings.sizeY;
+  if (viewX < 1 || viewY < 1 || viewX > settings.sizeX ||
+      viewY > settings.sizeY || (scaled && !CanFuse(ns))) {
+    return CL_INVALID_VALUE;
+  }
+  if (!CanFuse(ns)) {
+    CL_ERROR_RETURN(Trace(ns, sampleOffset));
+    CL_ERROR_RETURN(colorImageKernel.Set<1>(image));
+    std::vector<size_t> globalWorkSizes = {(size_t)settings.sizeX,
+                                           (size_t)settings.sizeY};
+    return colorImageKernel.Execute(globalWorkSizes, nullptr);
+  }
+  CL_ERROR_RETURN(SetFusedArguments(fusedImageKernel, ns, image, sampleOffset));
+  cl_uint2 viewSize;
+  viewSize.s[0] = viewX;
+  viewSize.s[1] = viewY;
+  CL_ERROR_RETURN(fusedImageKernel.Set<5>(viewSize));
+  return ExecutePixelKernel(fusedImageKernel, viewX, viewY);
+}
+
+cl_int Renderer::CreateTemporalBuffers() {
+  // The frames and histories live as long as the renderer, so they share a
+  // single allocation
+  const size_t pixelsSize =
+      sizeof(cl_float4) * settings.sizeX * settings.sizeY;
+  size_t arenaSize;
+  CL_ERROR_RETURN(program.ArenaSize(std::vector<size_t>(4, pixelsSize),
+                                    arenaSize));
+  CL_ERROR_RETURN(program.CreateArena(CL_MEM_READ_WRITE, arenaSize));
+  for (int i = 0; i < 2; ++i) {
+    CL_ERROR_RETURN(
+        program.CreateArenaBuffer(pixelsSize, &temporalFrames[i]));
+    CL_ERROR_RETURN(
+        program.CreateArenaBuffer(pixelsSize, &temporalHistory[i]));
+  }
+  return CL_SUCCESS;
+}
+
+cl_int Renderer::TraceTemporalImage(int ns, cl_mem image, int viewX,
+                                    int viewY, cl_uint sampleOffset) {
+  if (!CanFuse(ns) || !settings.usePinholeCamera || viewX < 1 || viewY < 1 ||
+      viewX > settings.sizeX || viewY > settings.sizeY) {
+    return CL_INVALID_VALUE;
+  }
+  if (temporalFrames[0] == nullptr) {
+    CL_ERROR_RETURN(CreateTemporalBuffers());
+  }
+  // Without a previous camera there is nothing to reproject from
+  cl_uint hasHistory = temporalValid && previousCameraBuffer != nullptr;
+  int previous = temporalIndex;
+  int current = 1 - temporalIndex;
+
+  cl_uint2 viewSize;
+  viewSize.s[0] = viewX;
+  viewSize.s[1] = viewY;
+  cl_uint2 previousViewSize;
+  previousViewSize.s[0] = hasHistory ? previousViewX : viewX;
+  previousViewSize.s[1] = hasHistory ? previousViewY : viewY;
+  CL_ERROR_RETURN(SetFusedArguments(temporalTraceKernel, ns,
+                                    temporalFrames[current], sampleOffset));
+  CL_ERROR_RETURN(temporalTraceKernel.Set<5>(viewSize));
+  CL_ERROR_RETURN(ExecutePixelKernel(temporalTraceKernel, viewX, viewY));
+
+  // The previous camera stands in for itself on the first frame, which
+  // ignores it anyway
+  cl_mem previousCamera = hasHistory ? previousCameraBuffer : cameraBuffer;
+  CL_ERROR_RETURN(temporalResolveKernel.Bind(
+      cameraBuffer, previousCamera, temporalFrames[current],
+      temporalFrames[previous], temporalHistory[previous],
+      temporalHistory[current], image, ns, viewSize, previousViewSize,
+      hasHistory));
+  std::vector<size_t> globalWorkSizes = {(size_t)viewX, (size_t)viewY};
+  CL_ERROR_RETURN(temporalResolveKernel.Execute(globalWorkSizes, nullptr));
+
+  temporalIndex = current;
+  previousViewX = viewX;
+  previousViewY = viewY;
+  temporalValid = true;
+  return CL_SUCCESS;
+}
+
+template <typename Kernel>
+cl_int Renderer::SetFusedArguments(Kernel &kernel, int ns, cl_mem output,
+                                   cl_uint sampleOffset) {
+  CL_ERROR_RETURN(kernel.template Set<2>(output));
+  CL_ERROR_RETURN(kernel.template Set<3>(sampleOffset));
+  return kernel.template Set<4>(ns);
+}
+
+template <typename Kernel>
+cl_int Renderer::ExecutePixelKernel(const Kernel &kernel, int sizeX,
+                                    int sizeY) {
+  std::vector<std::vector<size_t>> globalWorkSizes;
+  std::vector<std::vector<size_t>> globalWorkOffsets;
+  CalculateWorkIterations(sizeX, sizeY, 1, globalWorkSizes,
+                          globalWorkOffsets);
+  std::vector<size_t> tileSizes = {TILE_PIXELS, TILE_PIXELS};
+  for (size_t i = 0; i < globalWorkSizes.size(); ++i) {
+    // Drop the sample dimension, which the kernel loops over instead
+    globalWorkSizes[i].resize(2);
+    globalWorkOffsets[i].resize(2);
+    if (tileCulled) {
+      for (int d = 0; d < 2; ++d) {
+        globalWorkSizes[i][d] =
+            (globalWorkSizes[i][d] + TILE_PIXELS - 1) / TILE_PIXELS *
+            TILE_PIXELS;
+      }
+    }
+    CL_ERROR_RETURN(kernel.Execute(globalWorkSizes[i], &globalWorkOffsets[i],
+                                   tileCulled ? &tileSizes : nullptr));
+  }
+  return CL_SUCCESS;
+}
+
+cl_int Renderer::CreateAccumulation(void *data) {
+  const size_t accumulationSize =
+      sizeof(cl_float4) * settings.sizeX * settings.sizeY;
+  cl_mem_flags flags = CL_MEM_READ_WRITE;
+  if (data != nullptr) {
+    flags |= CL_MEM_COPY_HOST_PTR;
+  }
+  CL_ERROR_RETURN(program.CreateBuffer(flags, accumulationSize, data,
+                                       &accumulationBuffer));
+  CL_ERROR_RETURN(accumulateKernel.Set<1>(accumulationBuffer));
+  CL_ERROR_RETURN(accumulationBufferKernel.Set<0>(accumulationBuffer));
+  return accumulationFloatKernel.Set<0>(accumulationBuffer);
+}
+
+cl_int Renderer::ClearAccumulation() {
+  if (accumulationBuffer == nullptr) {
+    CL_ERROR_RETURN(CreateAccumulation(nullptr));
+  }
+  cl_float zero = 0.0f;
+  const size_t accumulationSize =
+      sizeof(cl_float4) * settings.sizeX * settings.sizeY;
+  return program.FillBuffer(accumulationBuffer, &zero, sizeof(zero),
+                            accumulationSize);
+}
+
+cl_int Renderer::UploadAccumulation(const Checkpoint &checkpoint) {
+  void *data = (void *)checkpoint.accumulation.data();
+  if (accumulationBuffer == nullptr) {
+    return CreateAccumulation(data);
+  }
+  return program.WriteBuffer(accumulationBuffer, true,
+                             sizeof(cl_float4) * checkpoint.accumulation.size(),
+                             data);
+}
+
+cl_int Renderer::ReadAccumulation(Checkpoint &checkpoint) {
+  checkpoint.accumulation.resize((size_t)settings.sizeX * settings.sizeY);
+  return program.ReadKernelOutput(
+      accumulationBuffer, true,
+      sizeof(cl_float4) * checkpoint.accumulation.size(),
+      checkpoint.accumulation.data());
+}
+
+cl_int Renderer::Accumulate(cl_uint ns) {
+  return AccumulateRows(ns, 0, settings.sizeY);
+}
+
+cl_int Renderer::AccumulateRows(cl_uint ns, int rowBegin, int rowCount) {
+  if (rowBegin < 0 || rowCount < 1 || rowBegin + rowCount > settings.sizeY) {
+    return CL_INVALID_VALUE;
+  }
+  CL_ERROR_RETURN(accumulateKernel.Set<2>(ns));
+  std::vector<size_t> globalWorkSizes = {(size_t)settings.sizeX,
+                                         (size_t)rowCount};
+  std::vector<size_t> globalWorkOffsets = {0, (size_t)rowBegin};
+  return accumulateKernel.Execute(globalWorkSizes, &globalWorkOffsets);
+}
+
+cl_int Renderer::ReadAccumulationRows(int rowBegin, int rowCount,
+                                      std::vector<cl_float4> &rows) {
+  if (rowBegin < 0 || rowCount < 1 || rowBegin + rowCount > settings.sizeY) {
+    return CL_INVALID_VALUE;
+  }
+  rows.resize((size_t)settings.sizeX * rowCount);
+  return program.ReadBufferRegion(
+      accumulationBuffer, sizeof(cl_float4) * settings.sizeX * rowBegin,
+      sizeof(cl_float4) * rows.size(), rows.data());
+}
+
+cl_int Renderer::ResolveAccumulation(bool floatOutput, cl_mem output) {
+  ResolveKernel &kernel =
+      floatOutput ? accumulationFloatKernel : accumulationBufferKernel;
+  CL_ERROR_RETURN(kernel.Set<1>(output));
+  std::vector<size_t> globalWorkSizes = {(size_t)settings.sizeX,
+                                         (size_t)settings.sizeY};
+  return kernel.Execute(globalWorkSizes, nullptr);
+}
+
+cl_int Renderer::Benchmark(int runs, double &samplesPerSecond) {
+  // The first pass absorbs one-time driver work and is not timed
+  CL_ERROR_RETURN(Trace(settings.samples));
+  CL_ERROR_RETURN(program.FinishKernelExecution());
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int run = 0; run < runs; ++run) {
+    CL_ERROR_RETURN(Trace(settings.samples, (run + 1) * settings.samples));
+  }
+  CL_ERROR_RETURN(program.FinishKernelExecution());
+  std::chrono::duration<double> elapsed =
+      std::chrono::high_resolution_clock::now() - start;
+
+  double samples =
+      (double)settings.sizeX * settings.sizeY * settings.samples * runs;
+  samplesPerSecond = samples / std::max(elapsed.count(), 1e-9);
+  return CL_SUCCESS;
+}
+
+cl_int Renderer::CreateReadbackBuffer(bool floatOutput, cl_mem *buffer) {
+  return program.CreateBuffer(READBACK_BUFFER_FLAGS, ResolvedSize(floatOutput),
+                              nullptr, buffer);
+}
+
+size_t Renderer::ResolvedSize(bool floatOutput) const {
+  return (size_t)settings.sizeX * settings.sizeY * 3 *
+         (floatOutput ? sizeof(float) : sizeof(unsigned char));
+}
+
+size_t Renderer::TraceBufferSize() const {
+  return (size_t)settings.sizeX * settings.sizeY * settings.samples *
+         SampleBytes(settings.sampleFormat);
+}
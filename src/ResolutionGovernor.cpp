@@ -0,0 +1,48 @@
+#include "ResolutionGovernor.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+ResolutionGovernor::ResolutionGovernor(double targetFps, float minScale)
+    : frameBudget(targetFps > 0.0 ? 1.0 / targetFps : 0.0),
+      minScale(std::min(std::max(minScale, 0.01f), 1.0f)),
+      scale(1.0f),
+      averageSeconds(0.0),
+      settleFrames(0) {}
+
+void ResolutionGovernor::Update(double frameSeconds) {
+  if (frameBudget <= 0.0) {
+    return;
+  }
+  averageSeconds =
+      averageSeconds <= 0.0
+          ? frameSeconds
+          : averageSeconds +
+                RESOLUTION_SMOOTHING * (frameSeconds - averageSeconds);
+  if (settleFrames > 0) {
+    --settleFrames;
+    return;
+  }
+
+  float ideal =
+      scale * (float)std::sqrt(frameBudget / std::max(averageSeconds, 1e-6));
+  float next = scale;
+  if (averageSeconds > frameBudget * RESOLUTION_OVER_BUDGET) {
+    next = std::max(ideal, minScale);
+  } else if (averageSeconds < frameBudget * RESOLUTION_HEADROOM) {
+    next = std::min({ideal, scale * RESOLUTION_MAX_STEP_UP, 1.0f});
+  }
+  if (next != scale) {
+    // Frames rendered at the old scale no longer say anything about the new
+    // one
+    scale = next;
+    averageSeconds = 0.0;
+    settleFrames = RESOLUTION_SETTLE_FRAMES;
+  }
+}
+
+void ResolutionGovernor::ScaledSize(int sizeX, int sizeY, int &scaledX,
+                                    int &scaledY) const {
+  scaledX = std::min(sizeX, std::max(1, (int)std::lround(sizeX * scale)));
+  scaledY = std::min(sizeY, std::max(1, (int)std::lround(sizeY * scale)));
+}
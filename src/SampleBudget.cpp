@@ -0,0 +1,37 @@
+#include "SampleBudget.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+SampleBudget::SampleBudget(double targetFps, int maxSamples)
+    : frameBudget(targetFps > 0.0 ? 1.0 / targetFps : 0.0),
+      maxSamples(std::max(maxSamples, 1)),
+      samples(this->maxSamples),
+      sampleSeconds(0.0) {
+  // Start low and grow, rather than overshoot the budget on the first frames
+  if (frameBudget > 0.0) {
+    samples = 1;
+  }
+}
+
+double SampleBudget::Update(double frameSeconds, bool cameraMoving) {
+  double lastSampleSeconds = frameSeconds / samples;
+  if (frameBudget <= 0.0) {
+    return lastSampleSeconds;
+  }
+  sampleSeconds =
+      sampleSeconds <= 0.0
+          ? lastSampleSeconds
+          : sampleSeconds +
+                SAMPLE_BUDGET_SMOOTHING * (lastSampleSeconds - sampleSeconds);
+
+  // The smoothed cost reacts slowly to a view getting more expensive, so the
+  // latest frame wins whenever it was costlier
+  double cost = std::max(sampleSeconds, lastSampleSeconds);
+  double budget = frameBudget *
+                  (cameraMoving ? SAMPLE_BUDGET_MOVING : SAMPLE_BUDGET_STILL);
+  samples = std::min(
+      maxSamples,
+      std::max(1, (int)std::floor(budget / std::max(cost, 1e-9))));
+  return lastSampleSeconds;
+}
@@ -0,0 +1,86 @@
+#include "Scene.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+
+int Scene::Load(const std::string &name) {
+  spheres.clear();
+
+  // TODO: Allow scene data that is not hard-coded
+  if (name == "default" || name == "lights") {
+    spheres.push_back(CLTypes::Sphere(
+        CLTypes::Vector3(0, 0, -1), 0.5f,
+        CLTypes::Lambertian(CLTypes::Vector3(0.1f, 0.2f, 0.5f))));
+    spheres.push_back(CLTypes::Sphere(
+        CLTypes::Vector3(0, -100.5, -1), 100,
+        CLTypes::Lambertian(CLTypes::Vector3(0.8f, 0.8f, 0.0f))));
+    spheres.push_back(CLTypes::Sphere(
+        CLTypes::Vector3(1, 0, -1), 0.5f,
+        CLTypes::Metal(CLTypes::Vector3(0.8f, 0.6f, 0.2f), 0.0f)));
+    spheres.push_back(CLTypes::Sphere(CLTypes::Vector3(-1, 0, -1), 0.5f,
+                                      CLTypes::Dielectric(2.52)));
+    spheres.push_back(CLTypes::Sphere(CLTypes::Vector3(-1, 0, -1), -0.45f,
+                                      CLTypes::Dielectric(2.52)));
+    // "lights" adds two small, bright lights that are hard to find by
+    // bouncing alone
+    if (name == "lights") {
+      spheres.push_back(CLTypes::Sphere(
+          CLTypes::Vector3(0.5f, 1.2f, -0.5f), 0.1f,
+          CLTypes::Emissive(CLTypes::Vector3(40.0f, 36.0f, 30.0f))));
+      spheres.push_back(CLTypes::Sphere(
+          CLTypes::Vector3(-1.5f, 0.3f, 0.0f), 0.05f,
+          CLTypes::Emissive(CLTypes::Vector3(20.0f, 40.0f, 80.0f))));
+    }
+    return 0;
+  }
+
+  // "random:<N>" places N small spheres on a jittered grid over the ground,
+  // always with the same layout for the same N
+  const std::string randomPrefix = "random:";
+  if (name.compare(0, randomPrefix.size(), randomPrefix) == 0) {
+    int count = std::atoi(name.c_str() + randomPrefix.size());
+    if (count <= 0) {
+      return 1;
+    }
+    spheres.push_back(CLTypes::Sphere(
+        CLTypes::Vector3(0, -100.5, -1), 100,
+        CLTypes::Lambertian(CLTypes::Vector3(0.5f, 0.5f, 0.5f))));
+
+    std::mt19937 generator(count);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const float extent = 8.0f;
+    const int gridSize = (int)std::ceil(std::sqrt((float)count));
+    const float spacing = extent / gridSize;
+    const float radius = 0.4f * spacing;
+    for (int i = 0; i < count; ++i) {
+      float x = -0.5f * extent + ((i % gridSize) + unit(generator)) * spacing;
+      float z = -1.0f - ((i / gridSize) + unit(generator)) * spacing;
+      CLTypes::Vector3 center(x, radius - 0.5f, z);
+      CLTypes::Vector3 color(unit(generator), unit(generator),
+                             unit(generator));
+      float material = unit(generator);
+      if (material < 0.7f) {
+        spheres.push_back(
+            CLTypes::Sphere(center, radius, CLTypes::Lambertian(color)));
+      } else if (material < 0.9f) {
+        spheres.push_back(CLTypes::Sphere(
+            center, radius, CLTypes::Metal(color, 0.5f * unit(generator))));
+      } else {
+        spheres.push_back(
+            CLTypes::Sphere(center, radius, CLTypes::Dielectric(1.5f)));
+      }
+    }
+    return 0;
+  }
+
+  return 1;
+}
+
+int Scene::NumLights() const {
+  return std::count_if(spheres.begin(), spheres.end(),
+                       [](const CLTypes::Sphere &sphere) {
+                         return sphere.m.type == CLTypes::EMISSIVE;
+                       });
+}
@@ -0,0 +1,45 @@
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(unsigned int numThreads) : stopping(false) {
+  if (numThreads == 0) {
+    numThreads = 1;
+  }
+  for (unsigned int i = 0; i < numThreads; ++i) {
+    workers.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    stopping = true;
+  }
+  queueCondition.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+unsigned int ThreadPool::RemainingCores() {
+  unsigned int cores = std::thread::hardware_concurrency();
+  // hardware_concurrency is allowed to return 0 when it cannot tell
+  return cores > 1 ? cores - 1 : 1;
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueCondition.wait(lock,
+                          [this]() { return stopping || !tasks.empty(); });
+      // Drain remaining work before exiting so no future is left unresolved
+      if (stopping && tasks.empty()) {
+        return;
+      }
+      task = std::move(tasks.front());
+      tasks.pop();
+    }
+    task();
+  }
+}
@@ -15,175 +15,451 @@
 // - OpenGL 3.3+
 // Code written by Trevor Day, 2019
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <sstream>
+
+#include <unistd.h>
 
 // Include this first to init GLEW
-#include "OpenCLProgram.hpp"
+#include "Renderer.hpp"
 //
 #include "Camera.hpp"
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include "Checkpoint.hpp"
+#include "Convergence.hpp"
+#include "DeviceSelector.hpp"
+#include "FrameStream.hpp"
+#include "ImageWriter.hpp"
+#include "Metrics.hpp"
+#include "RenderCoordinator.hpp"
+#include "RenderServer.hpp"
+#include "ResolutionGovernor.hpp"
+#include "SampleBudget.hpp"
+#include "Scene.hpp"
+#include "ThreadPool.hpp"
 
 using namespace std;
 
 #define MS_IN_S 1000.0
+#define BYTES_IN_MB (1024.0 * 1024.0)
+#define DEG_TO_RAD (M_PI / 180.0)
 
-// File paths
-#define CL_KERNEL_PATH "./cl_src/main.cl"
-#define KERNEL_INCLUDE "./cl_header/"
-// Required OpenCL definition parameters
-#define WIDTH "WIDTH"
-#define HEIGHT "HEIGHT"
-#define SAMPLES "SAMPLES"
-#define DEPTH "DEPTH"
-#define NUM_SPHERES "NUM_SPHERES"
-#define USE_PINHOLE_CAMERA "USE_PINHOLE_CAMERA"
-// Kernel names
-#define RAYTRACE_KERNEL "raytrace"
-#define COLOR_BUFFER_KERNEL "color_compress_buffer"
-#define COLOR_IMAGE_KERNEL "color_compress_image"
-
-// Helper to break down work into smaller chunks so that the GPU does not
-// time out for large combinations of resolution and sample count
-#define BASE_RESOLUTION 512
-#define BASE_SAMPLES 16
-void calculate_work_iterations(int sizeX, int sizeY, int ns,
-                               vector<vector<size_t>>& workSizes,
-                               vector<vector<size_t>>& workOffsets) {
-  workSizes.clear();
-  workOffsets.clear();
-
-  // X
-  vector<size_t> workX;
-  vector<size_t> offsetsX;
-  int numWorkX = sizeX / BASE_RESOLUTION;
-  for (int x = 0; x < numWorkX; ++x) {
-    workX.push_back(BASE_RESOLUTION);
-    offsetsX.push_back(x * BASE_RESOLUTION);
-  }
-  if (sizeX % BASE_RESOLUTION != 0) {
-    workX.push_back(sizeX % BASE_RESOLUTION);
-    offsetsX.push_back(numWorkX * BASE_RESOLUTION);
-  }
-
-  // Y
-  vector<vector<size_t>> workXY;
-  vector<vector<size_t>> offsetsXY;
-  int numWorkY = sizeY / BASE_RESOLUTION;
-  for (int y = 0; y < numWorkY; ++y) {
-    for (int x = 0; x < workX.size(); ++x) {
-      workXY.push_back({workX[x], BASE_RESOLUTION});
-      offsetsXY.push_back({offsetsX[x], (size_t)(y * BASE_RESOLUTION)});
-    }
-  }
-  int moduloBaseY = sizeY % BASE_RESOLUTION;
-  if (moduloBaseY != 0) {
-    for (int x = 0; x < workX.size(); ++x) {
-      workXY.push_back({workX[x], (size_t)moduloBaseY});
-      offsetsXY.push_back({offsetsX[x], (size_t)(numWorkY * BASE_RESOLUTION)});
-    }
-  }
-
-  // Samples
-  int numWorkSamples = ns / BASE_SAMPLES;
-  for (int s = 0; s < numWorkSamples; ++s) {
-    for (int y = 0; y < workXY.size(); ++y) {
-      workSizes.push_back({workXY[y][0], workXY[y][1], BASE_SAMPLES});
-      workOffsets.push_back(
-          {offsetsXY[y][0], offsetsXY[y][1], (size_t)(s * BASE_SAMPLES)});
-    }
-  }
-  int moduloBaseSamples = ns % BASE_SAMPLES;
-  if (moduloBaseSamples != 0) {
-    for (int y = 0; y < workXY.size(); ++y) {
-      workSizes.push_back(
-          {workXY[y][0], workXY[y][1], (size_t)moduloBaseSamples});
-      workOffsets.push_back({offsetsXY[y][0], offsetsXY[y][1],
-                             (size_t)(numWorkSamples * BASE_SAMPLES)});
-    }
+// Default seconds between checkpoints of a progressive render
+#define CHECKPOINT_INTERVAL 300.0
+
+// Encodes resolved pixels to disk and reports the encode throughput
+int save_image(const Renderer& renderer, const string& outPath,
+               const ImageWriter& writer, const void* pixels) {
+  const RenderSettings& settings = renderer.GetSettings();
+  auto startOfEncode = chrono::high_resolution_clock::now();
+  int writeResult = writer.Write(
+      outPath, writer.MakeImage(settings.sizeX, settings.sizeY, pixels));
+  auto endOfEncode = chrono::high_resolution_clock::now();
+
+  if (writeResult != 0) {
+    cout << "There was an error writing the file." << endl;
+    return 1;
   }
+
+  chrono::duration<double, milli> encodeTime = endOfEncode - startOfEncode;
+  cout << "Encode time: " << encodeTime.count() << " ms ("
+       << (renderer.ResolvedSize(writer.NeedsFloatData()) / BYTES_IN_MB) /
+              (encodeTime.count() / MS_IN_S)
+       << " MB/s)" << endl;
+  cout << "Successfully wrote " << outPath << endl;
+  return 0;
 }
 
 // Helper function to write the OpenCL ray-traced image to disk for a
 // single frame
-int write_image(int sizeX, int sizeY, int ns, string outPath,
-                OpenCLProgram& program, cl_mem traceResultsBuffer) {
+int write_image(int ns, string outPath, const ImageWriter& writer,
+                Renderer& renderer) {
+  OpenCLProgram& program = renderer.GetProgram();
+  bool floatOutput = writer.NeedsFloatData();
+
   // Execution
   auto startOfFrame = chrono::high_resolution_clock::now();
-
-  vector<vector<size_t>> globalWorkSizes;
-  vector<vector<size_t>> globalWorkOffsets;
-  calculate_work_iterations(sizeX, sizeY, ns, globalWorkSizes,
-                            globalWorkOffsets);
-  for (int i = 0; i < globalWorkSizes.size(); ++i) {
-    CL_ERROR_CHECK(program.ExecuteKernel(RAYTRACE_KERNEL, globalWorkSizes[i],
-                                         &globalWorkOffsets[i]))
-  }
-  CL_ERROR_CHECK(program.FinishKernelExecution())
-
-  // Color compression kernel
-  CL_ERROR_CHECK(program.LoadKernel(COLOR_BUFFER_KERNEL))
-  CL_ERROR_CHECK(program.SetArgument(COLOR_BUFFER_KERNEL, 0, sizeof(cl_mem),
-                                     &traceResultsBuffer));
   cl_mem outputBuffer;
-  CL_ERROR_CHECK(program.CreateBufferArgument(
-      COLOR_BUFFER_KERNEL, 1, CL_MEM_WRITE_ONLY,
-      sizeof(unsigned char) * sizeX * sizeY * 3, nullptr, &outputBuffer));
-  vector<size_t> colorGlobalWorkSizes = {(size_t)sizeX, (size_t)sizeY};
-  CL_ERROR_CHECK(
-      program.ExecuteKernel(COLOR_BUFFER_KERNEL, colorGlobalWorkSizes, nullptr))
+  CL_ERROR_CHECK(renderer.CreateReadbackBuffer(floatOutput, &outputBuffer))
+  CL_ERROR_CHECK(renderer.TraceResolved(ns, floatOutput, outputBuffer))
   CL_ERROR_CHECK(program.FinishKernelExecution())
 
   auto endOfFrame = chrono::high_resolution_clock::now();
   chrono::duration<double, milli> frameTime = endOfFrame - startOfFrame;
   cout << "Frame time: " << frameTime.count() << " ms" << endl;
+  const RenderSettings& settings = renderer.GetSettings();
+  Metrics::RecordFrame(
+      frameTime.count() / MS_IN_S,
+      (unsigned long long)settings.sizeX * settings.sizeY * ns);
 
-  // Get output
-  unsigned char* cpuOutput = new unsigned char[sizeX * sizeY * 3];
-  CL_ERROR_CHECK(program.ReadKernelOutput(
-      outputBuffer, true, sizeof(unsigned char) * sizeX * sizeY * 3, cpuOutput))
-  CL_ERROR_CHECK(program.Unload());
+  // Get output, encoding straight from the mapped buffer
+  void* mappedOutput;
+  CL_ERROR_CHECK(program.MapBuffer(outputBuffer, CL_TRUE, CL_MAP_READ,
+                                   renderer.ResolvedSize(floatOutput),
+                                   &mappedOutput))
   // Write output to disk
-  int writeResult = stbi_write_png(outPath.c_str(), sizeX, sizeY, 3, cpuOutput,
-                                   sizeX * sizeof(unsigned char) * 3);
-  delete[] cpuOutput;
+  int writeResult = save_image(renderer, outPath, writer, mappedOutput);
+  CL_ERROR_CHECK(program.UnmapBuffer(outputBuffer, mappedOutput))
+  CL_ERROR_CHECK(renderer.Unload());
+  return writeResult;
+}
 
-  if (writeResult == 0) {
-    cout << "There was an error writing the file." << endl;
+// Builds the output path for one frame of a sequence. A printf-style pattern
+// (e.g. "frame_%04d.png") is used as given, otherwise the frame number is
+// inserted before the extension.
+string frame_path(const string& outPath, int frame) {
+  if (outPath.find('%') != string::npos) {
+    int length = snprintf(nullptr, 0, outPath.c_str(), frame);
+    string result(length + 1, '\0');
+    snprintf(&result[0], result.size(), outPath.c_str(), frame);
+    result.resize(length);
+    return result;
+  }
+
+  char frameSuffix[16];
+  snprintf(frameSuffix, sizeof(frameSuffix), "_%04d", frame);
+  size_t extension = outPath.find_last_of('.');
+  size_t directory = outPath.find_last_of('/');
+  if (extension == string::npos ||
+      (directory != string::npos && extension < directory)) {
+    return outPath + frameSuffix;
+  }
+  return outPath.substr(0, extension) + frameSuffix +
+         outPath.substr(extension);
+}
+
+// A frame in flight between the device and the encoder threads. While an
+// encode is pending the output buffer stays mapped at mappedOutput.
+struct SequenceSlot {
+  cl_mem outputBuffer;
+  void* mappedOutput;
+  future<int> encodeResult;
+};
+
+// Renders numFrames frames along a camera orbit in a single process. The
+// queue is only flushed per frame, so the device traces frame i+1 while a
+// pool thread waits on the readback of frame i and encodes it.
+int render_sequence(int ns, int numFrames, float orbitDegrees,
+                    const string& outPath, const ImageWriter& writer,
+                    Renderer& renderer, Camera& cam) {
+  OpenCLProgram& program = renderer.GetProgram();
+  const RenderSettings& settings = renderer.GetSettings();
+  bool floatOutput = writer.NeedsFloatData();
+  const size_t outputSize = renderer.ResolvedSize(floatOutput);
+
+  // One host thread drives the device and every other core encodes. There is
+  // one more slot than encoders so the device always has a frame to fill.
+  // Slots are declared before the pool so that pending encodes are drained
+  // before the memory they write from is destroyed.
+  unsigned int encoderThreads = ThreadPool::RemainingCores();
+  vector<SequenceSlot> slots(encoderThreads + 1);
+  for (auto& slot : slots) {
+    CL_ERROR_CHECK(
+        renderer.CreateReadbackBuffer(floatOutput, &slot.outputBuffer))
+    slot.mappedOutput = nullptr;
+  }
+  ThreadPool encoders(encoderThreads);
+  // Total time spent inside writers across all encoder threads
+  atomic<long long> encodeMicroseconds(0);
+
+  cout << "Rendering " << numFrames << " frames with " << encoderThreads
+       << " encoder threads" << endl;
+  auto startOfSequence = chrono::high_resolution_clock::now();
+
+  // Frames overlap, so each is timed from the submission of the previous
+  // one, which the slowest stage paces
+  const unsigned long long frameSamples =
+      (unsigned long long)settings.sizeX * settings.sizeY * ns;
+  auto startOfFrame = startOfSequence;
+  int failedFrames = 0;
+  for (int frame = 0; frame < numFrames; ++frame) {
+    SequenceSlot& slot = slots[frame % slots.size()];
+    // Wait for the encoder that last used this slot, then hand its buffer
+    // back to the device before it is written again
+    if (slot.encodeResult.valid()) {
+      failedFrames += slot.encodeResult.get();
+      CL_ERROR_CHECK(program.UnmapBuffer(slot.outputBuffer, slot.mappedOutput))
+    }
+
+    CL_ERROR_CHECK(renderer.SetCamera(cam.Calculate()))
+    CL_ERROR_CHECK(renderer.TraceResolved(ns, floatOutput, slot.outputBuffer))
+    cl_event readEvent;
+    CL_ERROR_CHECK(program.MapBuffer(slot.outputBuffer, CL_FALSE, CL_MAP_READ,
+                                     outputSize, &slot.mappedOutput,
+                                     &readEvent))
+    CL_ERROR_CHECK(program.FlushKernelExecution())
+
+    string path = frame_path(outPath, frame);
+    Image image =
+        writer.MakeImage(settings.sizeX, settings.sizeY, slot.mappedOutput);
+    slot.encodeResult = encoders.Enqueue([=, &writer, &encodeMicroseconds]() {
+      if (OpenCLProgram::WaitForEvent(readEvent) != CL_SUCCESS) {
+        cout << "Failed to read back " << path << endl;
+        return 1;
+      }
+      auto startOfEncode = chrono::high_resolution_clock::now();
+      int writeResult = writer.Write(path, image);
+      encodeMicroseconds += chrono::duration_cast<chrono::microseconds>(
+                                chrono::high_resolution_clock::now() -
+                                startOfEncode)
+                                .count();
+      if (writeResult != 0) {
+        cout << "There was an error writing " << path << endl;
+        return 1;
+      }
+      return 0;
+    });
+
+    // RotateCamera hands the angle to glm::rotate, which expects radians
+    cam.RotateCamera(orbitDegrees * DEG_TO_RAD, 1.0f,
+                     CLTypes::Vector3(0.0f, 0.0f, -1.0f));
+    auto endOfFrame = chrono::high_resolution_clock::now();
+    Metrics::RecordFrame(
+        chrono::duration<double>(endOfFrame - startOfFrame).count(),
+        frameSamples);
+    startOfFrame = endOfFrame;
+  }
+
+  for (auto& slot : slots) {
+    if (slot.encodeResult.valid()) {
+      failedFrames += slot.encodeResult.get();
+      CL_ERROR_CHECK(program.UnmapBuffer(slot.outputBuffer, slot.mappedOutput))
+    }
+  }
+  CL_ERROR_CHECK(program.FinishKernelExecution())
+
+  auto endOfSequence = chrono::high_resolution_clock::now();
+  chrono::duration<double, milli> sequenceTime =
+      endOfSequence - startOfSequence;
+  cout << "Sequence time: " << sequenceTime.count() << " ms ("
+       << sequenceTime.count() / numFrames << " ms per frame)" << endl;
+  double encodeSeconds = encodeMicroseconds / (MS_IN_S * MS_IN_S);
+  cout << "Encode time: " << encodeSeconds * MS_IN_S / numFrames
+       << " ms per frame per thread ("
+       << (outputSize * numFrames / BYTES_IN_MB) / encodeSeconds
+       << " MB/s per thread)" << endl;
+
+  CL_ERROR_CHECK(renderer.Unload());
+
+  if (failedFrames > 0) {
+    cout << failedFrames << " of " << numFrames
+         << " frames could not be written." << endl;
     return 1;
   }
 
-  cout << "Successfully wrote " << outPath << endl;
+  cout << "Successfully wrote " << numFrames << " frames" << endl;
+  return 0;
+}
+
+// Renders numFrames frames along a camera orbit into stream. Every frame is
+// read back into its own mapped buffer, which the stream writes from directly
+// and which is only reused once the stream is done with it.
+int render_stream(int ns, int numFrames, float orbitDegrees,
+                  FrameStream& stream, Renderer& renderer, Camera& cam) {
+  OpenCLProgram& program = renderer.GetProgram();
+  const size_t outputSize = renderer.ResolvedSize(false);
+
+  cl_mem outputBuffers[STREAM_QUEUE_FRAMES];
+  void* mappedOutputs[STREAM_QUEUE_FRAMES];
+  for (int i = 0; i < STREAM_QUEUE_FRAMES; ++i) {
+    CL_ERROR_CHECK(renderer.CreateReadbackBuffer(false, &outputBuffers[i]))
+    mappedOutputs[i] = nullptr;
+  }
+
+  // Timed like the frames of render_sequence
+  const RenderSettings& settings = renderer.GetSettings();
+  const unsigned long long frameSamples =
+      (unsigned long long)settings.sizeX * settings.sizeY * ns;
+  auto startOfStream = chrono::high_resolution_clock::now();
+  auto startOfFrame = startOfStream;
+  int frame = 0;
+  for (; frame < numFrames; ++frame) {
+    int slot;
+    if (stream.AcquireSlot(slot) != 0) {
+      break;
+    }
+    if (mappedOutputs[slot] != nullptr) {
+      CL_ERROR_CHECK(
+          program.UnmapBuffer(outputBuffers[slot], mappedOutputs[slot]))
+    }
+
+    CL_ERROR_CHECK(renderer.SetCamera(cam.Calculate()))
+    CL_ERROR_CHECK(renderer.TraceResolved(ns, false, outputBuffers[slot]))
+    cl_event readEvent;
+    CL_ERROR_CHECK(program.MapBuffer(outputBuffers[slot], CL_FALSE,
+                                     CL_MAP_READ, outputSize,
+                                     &mappedOutputs[slot], &readEvent))
+    CL_ERROR_CHECK(program.FlushKernelExecution())
+    stream.Submit((const unsigned char*)mappedOutputs[slot], readEvent);
+
+    // RotateCamera hands the angle to glm::rotate, which expects radians
+    cam.RotateCamera(orbitDegrees * DEG_TO_RAD, 1.0f,
+                     CLTypes::Vector3(0.0f, 0.0f, -1.0f));
+    auto endOfFrame = chrono::high_resolution_clock::now();
+    Metrics::RecordFrame(
+        chrono::duration<double>(endOfFrame - startOfFrame).count(),
+        frameSamples);
+    startOfFrame = endOfFrame;
+  }
+
+  int streamResult = stream.Close();
+  for (int i = 0; i < STREAM_QUEUE_FRAMES; ++i) {
+    if (mappedOutputs[i] != nullptr) {
+      CL_ERROR_CHECK(program.UnmapBuffer(outputBuffers[i], mappedOutputs[i]))
+    }
+  }
+  CL_ERROR_CHECK(program.FinishKernelExecution())
+  CL_ERROR_CHECK(renderer.Unload());
 
+  chrono::duration<double, milli> streamTime =
+      chrono::high_resolution_clock::now() - startOfStream;
+  unsigned long written = stream.FramesWritten();
+  if (written > 0) {
+    cout << "Streamed " << written << " frames in " << streamTime.count()
+         << " ms (" << streamTime.count() / written << " ms per frame)"
+         << endl;
+  }
+  if (streamResult != 0) {
+    cout << "The stream was closed after " << written << " of " << numFrames
+         << " frames." << endl;
+    return 1;
+  }
   return 0;
 }
 
-int opengl_loop(int sizeX, int sizeY, int ns, OpenCLProgram& program,
-                OpenGLProgram& glProgram, Camera& cam,
-                cl_mem traceResultsBuffer) {
-  vector<vector<size_t>> raytraceGlobalWorkSizes;
-  vector<vector<size_t>> raytraceGlobalWorkOffsets;
-  calculate_work_iterations(sizeX, sizeY, ns, raytraceGlobalWorkSizes,
-                            raytraceGlobalWorkOffsets);
+// Renders passes of at most passSamples samples per pixel into a per-pixel
+// accumulation buffer until targetSamples is reached. The accumulation is
+// saved to checkpointPath every checkpointInterval seconds and after the
+// last pass, and checkpoint may hold a previous render to continue from.
+int render_progressive(int passSamples, int targetSamples,
+                       Checkpoint& checkpoint, const string& checkpointPath,
+                       double checkpointInterval, string outPath,
+                       const ImageWriter& writer, Renderer& renderer) {
+  OpenCLProgram& program = renderer.GetProgram();
+  CL_ERROR_CHECK(renderer.UploadAccumulation(checkpoint))
+
+  if (checkpoint.samples > 0) {
+    cout << "Resuming at " << checkpoint.samples << " samples per pixel"
+         << endl;
+  }
+  auto startOfRender = chrono::high_resolution_clock::now();
+  auto lastCheckpoint = startOfRender;
+  auto startOfPass = startOfRender;
+
+  while (checkpoint.samples < (cl_uint)targetSamples) {
+    // Samples are numbered globally so each pass, including passes after a
+    // resume, seeds different random sequences
+    cl_uint sampleOffset = checkpoint.samples;
+    cl_uint currentPassSamples =
+        min((cl_uint)passSamples, (cl_uint)targetSamples - checkpoint.samples);
+    CL_ERROR_CHECK(renderer.Trace(currentPassSamples, sampleOffset))
+    CL_ERROR_CHECK(renderer.Accumulate(currentPassSamples))
+    CL_ERROR_CHECK(program.FinishKernelExecution())
+    checkpoint.samples += currentPassSamples;
+
+    auto now = chrono::high_resolution_clock::now();
+    Metrics::RecordFrame(chrono::duration<double>(now - startOfPass).count(),
+                         (unsigned long long)checkpoint.width *
+                             checkpoint.height * currentPassSamples);
+    startOfPass = now;
+    chrono::duration<double> sinceCheckpoint = now - lastCheckpoint;
+    bool finished = checkpoint.samples >= (cl_uint)targetSamples;
+    if (!checkpointPath.empty() &&
+        (finished || sinceCheckpoint.count() >= checkpointInterval)) {
+      CL_ERROR_CHECK(renderer.ReadAccumulation(checkpoint))
+      if (checkpoint.Save(checkpointPath) != 0) {
+        cout << "There was an error writing the checkpoint." << endl;
+        return 1;
+      }
+      cout << "Checkpoint at " << checkpoint.samples
+           << " samples per pixel written to " << checkpointPath << endl;
+      lastCheckpoint = now;
+    }
+  }
+
+  auto endOfRender = chrono::high_resolution_clock::now();
+  chrono::duration<double, milli> renderTime = endOfRender - startOfRender;
+  cout << "Render time: " << renderTime.count() << " ms" << endl;
+
+  // Resolve the accumulation for the writer
+  bool floatOutput = writer.NeedsFloatData();
+  cl_mem outputBuffer;
+  CL_ERROR_CHECK(renderer.CreateReadbackBuffer(floatOutput, &outputBuffer))
+  CL_ERROR_CHECK(renderer.ResolveAccumulation(floatOutput, outputBuffer))
+  void* mappedOutput;
+  CL_ERROR_CHECK(program.MapBuffer(outputBuffer, CL_TRUE, CL_MAP_READ,
+                                   renderer.ResolvedSize(floatOutput),
+                                   &mappedOutput))
+
+  int writeResult = save_image(renderer, outPath, writer, mappedOutput);
+  CL_ERROR_CHECK(program.UnmapBuffer(outputBuffer, mappedOutput))
+  CL_ERROR_CHECK(renderer.Unload());
+  return writeResult;
+}
+
+// Displays frames of an orbiting camera, which space pauses and resumes.
+// With a target frame rate, each frame traces as many of the ns samples per
+// pixel as fit its budget, fewer while the camera moves, and the resolution
+// only drops when even a single sample per pixel would miss the target.
+// Temporal frames blend in the previous frames reprojected to the new view.
+// Without interop, frames are read back into pixel buffers that the window
+// uploads from. Frame N is traced and read back while frame N - 1 is
+// uploaded, so the window shows each frame one frame late, always at full
+// resolution and without temporal reuse.
+int opengl_loop(int ns, double targetFps, bool temporal, bool interop,
+                Renderer& renderer, OpenGLProgram& glProgram, Camera& cam) {
+  OpenCLProgram& program = renderer.GetProgram();
+  const RenderSettings& settings = renderer.GetSettings();
 
   GL_ERROR_CHECK(glProgram.AllocateImageFramebuffer())
+  if (!interop && temporal) {
+    cout << "Temporal reuse needs OpenGL interop." << endl;
+    temporal = false;
+  }
+
+  // Varying samples, scaled and temporal frames can only be traced by the
+  // fused kernel
+  if ((targetFps > 0.0 || temporal) && !renderer.CanFuse(ns)) {
+    cout << "A target frame rate or temporal reuse traces at most "
+         << BASE_SAMPLES
+         << " samples per pixel per frame." << endl;
+    ns = BASE_SAMPLES;
+  }
+  SampleBudget sampleBudget(targetFps, ns);
+  ResolutionGovernor governor(targetFps);
+  bool orbiting = true;
+  bool pauseKeyDown = false;
 
-  // Color compression kernel
-  CL_ERROR_CHECK(program.LoadKernel(COLOR_IMAGE_KERNEL))
-  CL_ERROR_CHECK(program.SetArgument(COLOR_IMAGE_KERNEL, 0, sizeof(cl_mem),
-                                     &traceResultsBuffer));
-  cl_mem image;
-  CL_ERROR_CHECK(
-      program.CreateGLImageObject(CL_MEM_READ_WRITE, GL_TEXTURE_2D, 0,
-                                  glProgram.GetFramebufferTexture(), &image));
-  CL_ERROR_CHECK(
-      program.SetArgument(COLOR_IMAGE_KERNEL, 1, sizeof(cl_mem), &image));
-  vector<size_t> colorGlobalWorkSizes = {(size_t)sizeX, (size_t)sizeY};
+  // Frames are traced into the framebuffer's texture, or resolved into a
+  // readback buffer and copied into the next pixel buffer
+  cl_mem image = nullptr;
+  cl_mem copyBuffer = nullptr;
+  cl_event readEvents[PIXEL_BUFFER_COUNT] = {nullptr, nullptr};
+  if (interop) {
+    CL_ERROR_CHECK(program.CreateGLImageObject(
+        CL_MEM_READ_WRITE, GL_TEXTURE_2D, 0,
+        glProgram.GetFramebufferTexture(), &image));
+  } else {
+    CL_ERROR_CHECK(renderer.CreateReadbackBuffer(false, &copyBuffer))
+    GL_ERROR_CHECK(glProgram.AllocatePixelBuffers())
+  }
+  const string displayMode =
+      interop ? "interop"
+              : (glProgram.HasPersistentPixelBuffers() ? "persistent PBO copy"
+                                                       : "PBO copy");
 
   double deltaTime = 0.0;
+  double totalTime = 0.0;
+  int frames = 0;
+  // Temporal frames draw new samples every frame, so that history never
+  // repeats them
+  cl_uint sampleOffset = 0;
   while (true) {
     auto startOfFrame = chrono::high_resolution_clock::now();
 
@@ -192,50 +468,402 @@ int opengl_loop(int sizeX, int sizeY, int ns, OpenCLProgram& program,
     if (glProgram.ShouldClose()) {
       break;
     }
+    bool pauseKey = glProgram.IsKeyPressed(GLFW_KEY_SPACE);
+    if (pauseKey && !pauseKeyDown) {
+      orbiting = !orbiting;
+    }
+    pauseKeyDown = pauseKey;
     // Update
-    cam.RotateCamera(1.0f, (float)deltaTime,
-                     CLTypes::Vector3(0.0f, 0.0f, -1.0f));
-    CLTypes::Camera cl_cam = cam.Calculate();
-    cl_mem cameraBuffer;
-    CL_ERROR_CHECK(program.CreateBufferArgument(
-        RAYTRACE_KERNEL, 0, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-        sizeof(CLTypes::Camera), &cl_cam, &cameraBuffer));
-    // Execute ray trace kernel
-    for (int i = 0; i < raytraceGlobalWorkSizes.size(); ++i) {
-      CL_ERROR_CHECK(program.ExecuteKernel(RAYTRACE_KERNEL,
-                                           raytraceGlobalWorkSizes[i],
-                                           &raytraceGlobalWorkOffsets[i]))
+    if (orbiting) {
+      cam.RotateCamera(1.0f, (float)deltaTime,
+                       CLTypes::Vector3(0.0f, 0.0f, -1.0f));
     }
-    CL_ERROR_CHECK(program.FinishKernelExecution())
-    CL_ERROR_CHECK(program.ReleaseBuffer(cameraBuffer))
-    // GL flush
-    GL_ERROR_CHECK(glProgram.Flush());
-    // Acquire ownership for OpenCL
-    CL_ERROR_CHECK(program.AcquireGLObjects(1, &image));
-    // Run color compression to OpenGL texture kernel
-    CL_ERROR_CHECK(program.ExecuteKernel(COLOR_IMAGE_KERNEL,
-                                         colorGlobalWorkSizes, nullptr))
-    // CL flush
-    CL_ERROR_CHECK(program.FinishKernelExecution());
-    // Acquire OpenGL ownership
-    CL_ERROR_CHECK(program.ReleaseGLObjects(1, &image));
+    CL_ERROR_CHECK(renderer.SetCamera(cam.Calculate()))
+    int frameSamples = sampleBudget.GetSamples();
+    int viewX = settings.sizeX;
+    int viewY = settings.sizeY;
+    if (interop) {
+      // GL flush
+      GL_ERROR_CHECK(glProgram.Flush());
+      // Acquire ownership for OpenCL
+      CL_ERROR_CHECK(program.AcquireGLObjects(1, &image));
+      // Trace and compress to the OpenGL texture, in one kernel when the
+      // sample count allows
+      governor.ScaledSize(settings.sizeX, settings.sizeY, viewX, viewY);
+      if (temporal) {
+        CL_ERROR_CHECK(renderer.TraceTemporalImage(frameSamples, image, viewX,
+                                                   viewY, sampleOffset))
+        sampleOffset += frameSamples;
+      } else {
+        CL_ERROR_CHECK(
+            renderer.TraceResolvedImage(frameSamples, image, viewX, viewY))
+      }
+      // CL flush
+      CL_ERROR_CHECK(program.FinishKernelExecution());
+      // Acquire OpenGL ownership
+      CL_ERROR_CHECK(program.ReleaseGLObjects(1, &image));
+    } else {
+      // This frame is read into the pixel buffer uploaded two frames ago,
+      // while the previous frame is uploaded from the other one
+      int current = frames % PIXEL_BUFFER_COUNT;
+      int previous = 1 - current;
+      void* pixels;
+      GL_ERROR_CHECK(glProgram.MapPixelBuffer(current, &pixels));
+      CL_ERROR_CHECK(renderer.TraceResolved(frameSamples, false, copyBuffer))
+      CL_ERROR_CHECK(program.ReadKernelOutput(
+          copyBuffer, false, renderer.ResolvedSize(false), pixels,
+          &readEvents[current]))
+      CL_ERROR_CHECK(program.FlushKernelExecution());
+      if (readEvents[previous] != nullptr) {
+        CL_ERROR_CHECK(OpenCLProgram::WaitForEvent(readEvents[previous]));
+        readEvents[previous] = nullptr;
+        GL_ERROR_CHECK(glProgram.UploadPixelBuffer(previous));
+      }
+    }
+    // The controllers are fed the render time without the buffer swap, which
+    // waits for vertical sync. Samples spend whatever the resolution leaves,
+    // so the resolution is judged by the time of a single sample.
+    chrono::duration<double> renderTime =
+        chrono::high_resolution_clock::now() - startOfFrame;
+    governor.Update(sampleBudget.Update(renderTime.count(), orbiting));
     // Blit framebuffer
-    GL_ERROR_CHECK(glProgram.BlitFramebuffer());
+    GL_ERROR_CHECK(glProgram.BlitFramebuffer(viewX, viewY, !interop));
     // Swap buffers
     GL_ERROR_CHECK(glProgram.SwapBuffers());
     // Print FPS
     auto endOfFrame = chrono::high_resolution_clock::now();
     chrono::duration<double, milli> frameTime = endOfFrame - startOfFrame;
     deltaTime = frameTime.count() / MS_IN_S;
-    GL_ERROR_CHECK(
-        glProgram.SetWindowTitle("FPS: " + to_string(1.0 / deltaTime)));
+    totalTime += deltaTime;
+    ++frames;
+    Metrics::RecordFrame(deltaTime,
+                         (unsigned long long)viewX * viewY * frameSamples);
+    GL_ERROR_CHECK(glProgram.SetWindowTitle(
+        "FPS: " + to_string(1.0 / deltaTime) + " (" + to_string(viewX) + "x" +
+        to_string(viewY) + ", " + to_string(frameSamples) + " spp, " +
+        displayMode + ")"));
+  }
+  if (frames > 0) {
+    cout << "Average FPS with " << displayMode << ": " << frames / totalTime
+         << endl;
   }
 
-  CL_ERROR_CHECK(program.Unload());
+  for (cl_event event : readEvents) {
+    if (event != nullptr) {
+      CL_ERROR_CHECK(OpenCLProgram::WaitForEvent(event));
+    }
+  }
+  CL_ERROR_CHECK(renderer.Unload());
   GL_ERROR_CHECK(glProgram.Shutdown());
   return 0;
 }
 
+// Builds the program for settings and scene on each device, filling the
+// binary cache so later runs with the same settings skip compilation
+int precompile_programs(const vector<DeviceCandidate>& candidates,
+                        const RenderSettings& settings, const Scene& scene) {
+  int failures = 0;
+  for (auto& candidate : candidates) {
+    auto startOfBuild = chrono::high_resolution_clock::now();
+    Renderer renderer;
+    string errorLog;
+    cl_int result = renderer.Init(candidate.platform, candidate.device,
+                                  settings, scene.spheres, {}, errorLog);
+    chrono::duration<double, milli> buildTime =
+        chrono::high_resolution_clock::now() - startOfBuild;
+    if (result != CL_SUCCESS) {
+      cout << candidate.deviceName << ": build failed (" << errorLog << ")"
+           << endl;
+      ++failures;
+      continue;
+    }
+    cout << candidate.deviceName << ": "
+         << (renderer.GetProgram().LoadedFromBinaryCache() ? "cached"
+                                                           : "compiled")
+         << " in " << buildTime.count() << " ms" << endl;
+    renderer.Unload();
+  }
+  return failures > 0 ? 1 : 0;
+}
+
+// Compares tracing throughput with and without the local memory scene cache,
+// each with spheres intersected one at a time and in batches, for random
+// scenes from 100 to 100k spheres
+int benchmark_scene_cache(const DeviceCandidate& candidate,
+                          RenderSettings settings) {
+  Camera cam(CLTypes::Vector3(0, 1, 3), CLTypes::Vector3(0, 0, -3),
+             CLTypes::Vector3(0, 1, 0), 90,
+             cl_float(settings.sizeX) / cl_float(settings.sizeY));
+  cout << "spheres\tuncached scalar\tuncached batched\tcached scalar\t"
+          "cached batched (Msamples/s)"
+       << endl;
+  for (int count : {100, 1000, 10000, 100000}) {
+    Scene scene;
+    scene.Load("random:" + to_string(count));
+    cout << count;
+    for (int cached = 0; cached < 2; ++cached) {
+      settings.sceneCache = cached ? FEATURE_ON : FEATURE_OFF;
+      for (int batched = 0; batched < 2; ++batched) {
+        Renderer::SetScalarSpheres(!batched);
+        Renderer renderer;
+        string errorLog;
+        if (renderer.Init(candidate.platform, candidate.device, settings,
+                          scene.spheres, {}, errorLog) != CL_SUCCESS) {
+          Renderer::SetScalarSpheres(false);
+          cout << endl
+               << "Error during OpenCL program compilation! (" << errorLog
+               << ")" << endl;
+          return 1;
+        }
+        double samplesPerSecond;
+        CL_ERROR_CHECK(renderer.SetCamera(cam.Calculate()))
+        CL_ERROR_CHECK(renderer.Benchmark(3, samplesPerSecond))
+        CL_ERROR_CHECK(renderer.Unload())
+        cout << "\t" << samplesPerSecond / 1e6;
+      }
+    }
+    cout << endl;
+  }
+  Renderer::SetScalarSpheres(false);
+  return 0;
+}
+
+// Traces one pass resolved to linear color into pixels. If samplesPerSecond
+// is given, the same program is then benchmarked, so it is compiled once.
+int trace_linear(const DeviceCandidate& candidate,
+                 const RenderSettings& settings, const Scene& scene,
+                 const Camera& cam, vector<float>& pixels,
+                 double* samplesPerSecond = nullptr) {
+  Renderer renderer;
+  string errorLog;
+  if (renderer.Init(candidate.platform, candidate.device, settings,
+                    scene.spheres, {}, errorLog) != CL_SUCCESS) {
+    cout << "Error during OpenCL program compilation! (" << errorLog << ")"
+         << endl;
+    return 1;
+  }
+  cl_mem outputBuffer;
+  CL_ERROR_CHECK(renderer.SetCamera(cam.Calculate()))
+  CL_ERROR_CHECK(renderer.Trace(settings.samples))
+  CL_ERROR_CHECK(renderer.CreateReadbackBuffer(true, &outputBuffer))
+  CL_ERROR_CHECK(renderer.Resolve(true, outputBuffer))
+  pixels.resize(renderer.ResolvedSize(true) / sizeof(float));
+  CL_ERROR_CHECK(renderer.GetProgram().ReadKernelOutput(
+      outputBuffer, true, renderer.ResolvedSize(true), pixels.data()))
+  if (samplesPerSecond != nullptr) {
+    CL_ERROR_CHECK(renderer.Benchmark(3, *samplesPerSecond))
+  }
+  CL_ERROR_CHECK(renderer.Unload())
+  return 0;
+}
+
+// Compares a frame traced through the selected trace buffer format against
+// interleaved float. Sample seeds do not depend on the format, so both trace
+// the same paths and any difference comes from storage alone. Fails if the
+// largest error relative to its pixel's brightness exceeds the format's
+// budget.
+int check_sample_format(const DeviceCandidate& candidate,
+                        RenderSettings settings, const Scene& scene,
+                        const Camera& cam) {
+  SampleFormat format = settings.sampleFormat;
+  vector<float> reference;
+  vector<float> pixels;
+  settings.sampleFormat = SAMPLE_FLOAT;
+  if (trace_linear(candidate, settings, scene, cam, reference) != 0) {
+    return 1;
+  }
+  settings.sampleFormat = format;
+  if (trace_linear(candidate, settings, scene, cam, pixels) != 0) {
+    return 1;
+  }
+
+  ImageError error = ImageError::Measure(pixels, reference);
+  double budget = Renderer::SampleErrorBudget(format);
+  size_t traceBytes = (size_t)settings.sizeX * settings.sizeY *
+                      settings.samples * Renderer::SampleBytes(format);
+  cout << Renderer::SampleFormatName(format) << ": "
+       << Renderer::SampleBytes(format) << " bytes per sample ("
+       << traceBytes / BYTES_IN_MB << " MB trace buffer, "
+       << (double)Renderer::SampleBytes(SAMPLE_FLOAT) /
+              Renderer::SampleBytes(format)
+       << "x smaller than float)" << endl;
+  cout << "Max error " << error.maxError << ", relative "
+       << error.maxRelativeError << ", RMSE " << error.rmse << ", PSNR "
+       << error.psnr << " dB, budget " << budget << " relative" << endl;
+  if (!(error.maxRelativeError <= budget)) {
+    cout << "Error budget exceeded." << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Traces a frame with every precision profile and compares it against the
+// exact profile at the same samples per pixel. Profiles that trace the same
+// random numbers only differ where rounding sends a path another way, while
+// the aggressive profile draws different numbers, so its error includes the
+// noise of the frame. Reports the fastest profile within maxRmse and fails if
+// the selected profile exceeds it.
+int check_precision(const DeviceCandidate& candidate, RenderSettings settings,
+                    const Scene& scene, const Camera& cam, double maxRmse) {
+  PrecisionProfile selected = settings.precision;
+  vector<float> reference;
+  PrecisionProfile fastest = PRECISION_EXACT;
+  double fastestSamplesPerSecond = 0.0;
+  bool selectedPassed = true;
+  for (PrecisionProfile precision :
+       {PRECISION_EXACT, PRECISION_FAST, PRECISION_AGGRESSIVE}) {
+    settings.precision = precision;
+    vector<float> pixels;
+    double samplesPerSecond;
+    if (trace_linear(candidate, settings, scene, cam, pixels,
+                     &samplesPerSecond) != 0) {
+      return 1;
+    }
+    if (precision == PRECISION_EXACT) {
+      reference = pixels;
+    }
+
+    ImageError error = ImageError::Measure(pixels, reference);
+    bool passed = error.rmse <= maxRmse;
+    cout << Renderer::PrecisionName(precision) << ": "
+         << samplesPerSecond / 1e6 << " Msamples/s, max error "
+         << error.maxError << ", RMSE " << error.rmse << ", PSNR "
+         << error.psnr << " dB" << (passed ? "" : " (over budget)") << endl;
+    if (passed && samplesPerSecond > fastestSamplesPerSecond) {
+      fastest = precision;
+      fastestSamplesPerSecond = samplesPerSecond;
+    }
+    if (precision == selected) {
+      selectedPassed = passed;
+    }
+  }
+  cout << "Fastest profile within RMSE " << maxRmse << ": "
+       << Renderer::PrecisionName(fastest) << endl;
+  if (!selectedPassed) {
+    cout << "Error budget exceeded by " << Renderer::PrecisionName(selected)
+         << "." << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Writes the convergence of the settings on each scene to csvPath, traced in
+// passes of settings.samples up to maxSamples samples per pixel
+int write_convergence(const DeviceCandidate& candidate,
+                      const RenderSettings& settings,
+                      const vector<string>& sceneNames, const Camera& cam,
+                      int maxSamples, int referenceSamples,
+                      const string& csvPath) {
+  ofstream csv(csvPath);
+  if (!csv) {
+    cout << "Could not open " << csvPath << endl;
+    return 1;
+  }
+  ConvergenceHarness harness(candidate.platform, candidate.device,
+                             referenceSamples);
+  ConvergenceHarness::WriteHeader(csv);
+  for (const string& sceneName : sceneNames) {
+    cout << "Measuring convergence on " << sceneName << endl;
+    string errorLog;
+    cl_int result = harness.Run(sceneName, settings, cam.Calculate(),
+                                maxSamples, csv, errorLog);
+    if (result != CL_SUCCESS) {
+      cout << "Convergence run failed (" << result << "): " << errorLog
+           << endl;
+      return 1;
+    }
+  }
+  cout << "Convergence curves written to " << csvPath << endl;
+  return 0;
+}
+
+// Renders job across the render servers at workerAddresses and writes the
+// merged image, and the merged accumulation to checkpointPath if given
+int coordinate_render(const RenderJob& job,
+                      const vector<string>& workerAddresses,
+                      const string& checkpointPath) {
+  unique_ptr<ImageWriter> writer = ImageWriter::Create(
+      job.format, job.outputPath, thread::hardware_concurrency());
+  if (!writer) {
+    cout << "Unknown output format." << endl;
+    return 1;
+  }
+  auto startOfRender = chrono::high_resolution_clock::now();
+  RenderCoordinator coordinator(workerAddresses);
+  Checkpoint checkpoint;
+  string errorLog;
+  if (coordinator.Render(job, checkpoint, errorLog) != 0) {
+    cout << "Distributed render failed: " << errorLog << endl;
+    return 1;
+  }
+  chrono::duration<double, milli> renderTime =
+      chrono::high_resolution_clock::now() - startOfRender;
+  cout << "Render time on " << workerAddresses.size()
+       << " workers: " << renderTime.count() << " ms" << endl;
+  Metrics::RecordFrame(renderTime.count() / 1000.0,
+                       (unsigned long long)job.width * job.height *
+                           job.samples);
+
+  if (!checkpointPath.empty() && checkpoint.Save(checkpointPath) != 0) {
+    cout << "There was an error writing the checkpoint." << endl;
+    return 1;
+  }
+  vector<unsigned char> pixels;
+  checkpoint.Resolve(writer->NeedsFloatData(), pixels);
+  if (writer->Write(job.outputPath, writer->MakeImage(job.width, job.height,
+                                                      pixels.data())) != 0) {
+    cout << "There was an error writing the image." << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Splits the command line into positional arguments and named options.
+// Options are written as "--name value" or "--name=value" and may appear
+// anywhere after the program name.
+void parse_arguments(int argc, char* argv[], vector<string>& positional,
+                     unordered_map<string, string>& options) {
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.size() <= 2 || arg.compare(0, 2, "--") != 0) {
+      positional.push_back(arg);
+      continue;
+    }
+    size_t equals = arg.find('=');
+    if (equals != string::npos) {
+      options[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+    } else if (i + 1 < argc && string(argv[i + 1]).compare(0, 2, "--") != 0) {
+      options[arg.substr(2)] = argv[++i];
+    } else {
+      options[arg.substr(2)] = "";
+    }
+  }
+}
+
+string string_option(const unordered_map<string, string>& options,
+                     const string& name, const string& defaultValue) {
+  auto option = options.find(name);
+  return option == options.end() ? defaultValue : option->second;
+}
+
+int int_option(const unordered_map<string, string>& options,
+               const string& name, int defaultValue) {
+  auto option = options.find(name);
+  return option == options.end() ? defaultValue : stoi(option->second);
+}
+
+float float_option(const unordered_map<string, string>& options,
+                   const string& name, float defaultValue) {
+  auto option = options.find(name);
+  return option == options.end() ? defaultValue : stof(option->second);
+}
+
+// Reads an auto/on/off option, returns false for any other value
+bool feature_option(const unordered_map<string, string>& options,
+                    const string& name, KernelFeature& feature) {
+  return Renderer::ParseFeature(string_option(options, name, "auto"), feature);
+}
+
 int main(int argc, char* argv[]) {
   // Default parameters
   bool useOpenGL = true;
@@ -245,109 +873,383 @@ int main(int argc, char* argv[]) {
   int ns = BASE_SAMPLES;
   int rayDepth = 50;
   // Command line args
-  if (argc > 1) {
-    useOpenGL = stoi(argv[1]);
+  vector<string> args;
+  unordered_map<string, string> options;
+  parse_arguments(argc, argv, args, options);
+  // A render server takes all of its settings from the jobs it receives
+  string serverSocket = string_option(options, "server", "");
+  string clientSocket = string_option(options, "client", "");
+  bool serverMode = !serverSocket.empty();
+  // Precompiling and benchmarking only need the settings to build programs
+  // for, given as
+  // <RESOLUTION_X> <RESOLUTION_Y> <SAMPLES_PER_PIXEL> <RAY_BOUNCE_DEPTH>
+  bool precompile = options.count("precompile") > 0;
+  bool benchmarkSceneCache = options.count("benchmark-scene-cache") > 0;
+  bool checkSampleFormat = options.count("check-sample-format") > 0;
+  bool checkPrecision = options.count("check-precision") > 0;
+  string convergencePath = string_option(options, "convergence", "");
+  bool settingsOnly = precompile || benchmarkSceneCache || checkSampleFormat ||
+                      checkPrecision || !convergencePath.empty();
+  // Streaming replaces the window and the output image, so it also starts
+  // at the settings
+  string streamPath = string_option(options, "stream", "");
+  bool streaming = !streamPath.empty() && !settingsOnly;
+  if (streamPath == "-") {
+    // Frames own stdout, so messages go to stderr instead
+    cout.rdbuf(cerr.rdbuf());
   }
-  int argNum = 2;
-  if (!useOpenGL) {
-    if (argc < 3) {
+  if (serverMode || settingsOnly || streaming) {
+    useOpenGL = false;
+  } else if (args.size() > 0) {
+    useOpenGL = stoi(args[0]);
+  }
+  size_t argNum = settingsOnly || streaming ? 0 : 1;
+  if (!useOpenGL && !serverMode && !settingsOnly && !streaming) {
+    if (args.size() < 2) {
       cout << "When not using OpenGL an output image filepath is required."
            << endl;
       return 0;
     } else {
-      outputPathName = argv[argNum];
+      outputPathName = args[argNum];
       ++argNum;
     }
   }
-  if (argc > argNum) {
-    sizeX = stoi(argv[argNum]);
+  if (args.size() > argNum) {
+    sizeX = stoi(args[argNum]);
     ++argNum;
   }
-  if (argc > argNum) {
-    sizeY = stoi(argv[argNum]);
+  if (args.size() > argNum) {
+    sizeY = stoi(args[argNum]);
     ++argNum;
   }
-  if (argc > argNum) {
-    ns = stoi(argv[argNum]);
+  if (args.size() > argNum) {
+    ns = stoi(args[argNum]);
     ++argNum;
   }
-  if (argc > argNum) {
-    rayDepth = stoi(argv[argNum]);
+  if (args.size() > argNum) {
+    rayDepth = stoi(args[argNum]);
     ++argNum;
   }
+  // Scene and camera
+  string sceneName = string_option(options, "scene", "default");
+  CLTypes::Vector3 cameraOrigin(0, 0, 2);
+  CLTypes::Vector3 cameraLookAt(0, 0, -1);
+  if ((options.count("camera-origin") &&
+       !CLTypes::Vector3::Parse(options["camera-origin"], cameraOrigin)) ||
+      (options.count("camera-look-at") &&
+       !CLTypes::Vector3::Parse(options["camera-look-at"], cameraLookAt))) {
+    cout << "Camera vectors are written as x,y,z." << endl;
+    return 1;
+  }
+  float fov = float_option(options, "fov", 90.0f);
 
-  unordered_map<string, cl_platform_id> platforms;
-  CL_ERROR_CHECK(OpenCLProgram::GetAvailablePlatforms(platforms))
-  cl_platform_id platform = platforms.begin()->second;
+  // Kernel variants, chosen by the renderer unless forced
+  KernelFeature sceneCache;
+  KernelFeature tileCulling;
+  KernelFeature persistentThreads;
+  if (!feature_option(options, "scene-cache", sceneCache) ||
+      !feature_option(options, "tile-culling", tileCulling) ||
+      !feature_option(options, "persistent-threads", persistentThreads)) {
+    cout << "--scene-cache, --tile-culling and --persistent-threads are one "
+            "of auto, on or off."
+         << endl;
+    return 1;
+  }
+  SampleFormat sampleFormat = SAMPLE_PLANAR;
+  if (!Renderer::ParseSampleFormat(
+          string_option(options, "sample-format", "planar"), sampleFormat)) {
+    cout << "--sample-format is one of float, planar, half or rgbe." << endl;
+    return 1;
+  }
+  PrecisionProfile precision = PRECISION_EXACT;
+  if (!Renderer::ParsePrecision(string_option(options, "precision", "exact"),
+                                precision)) {
+    cout << "--precision is one of exact, fast or aggressive." << endl;
+    return 1;
+  }
 
-  // If necessary, ask for user input on which platform to use
-  if (platforms.size() > 1) {
-    cout << "Available OpenCL platforms: \n\n";
-    for (auto i = platforms.begin(); i != platforms.end(); ++i) {
-      cout << "\t"
-           << "- " << i->first << endl;
+  // Metrics are served for as long as this process renders
+  MetricsEndpoint metricsEndpoint;
+  int metricsPort = int_option(options, "metrics", 0);
+  if (metricsPort > 0) {
+    if (metricsEndpoint.Start(metricsPort) != 0) {
+      cout << "Could not serve metrics on port " << metricsPort << endl;
+      return 1;
     }
+    Renderer::SetRecordDeviceTimes(true);
+  }
 
-    cout << endl << "Enter the name of the OpenCL platform you want to use: ";
-    string input;
-    cin >> input;
-    // Handle incorrect user input
-    while (platforms.find(input) == platforms.end()) {
-      cin.clear();  // clear errors/bad flags on cin
-      cin.ignore(cin.rdbuf()->in_avail(),
-                 '\n');  // ignores exact number of chars in cin buffer
-      cout << "No such platform." << endl
-           << "Enter the name of the OpenCL platform you want to use: ";
-      cin >> input;
+  // Hand the job to a running render server, or split it across several,
+  // instead of rendering here
+  string workerList = string_option(options, "coordinate", "");
+  if (!clientSocket.empty() || !workerList.empty()) {
+    if (options.count("continue-to")) {
+      cout << "--continue-to cannot be used with --client or --coordinate."
+           << endl;
+      return 1;
+    }
+    RenderJob job;
+    job.scene = sceneName;
+    job.width = sizeX;
+    job.height = sizeY;
+    job.samples = ns;
+    job.depth = rayDepth;
+    job.origin = cameraOrigin;
+    job.lookAt = cameraLookAt;
+    job.fov = fov;
+    job.sampleFormat = sampleFormat;
+    job.precision = precision;
+    job.sceneCache = sceneCache;
+    job.tileCulling = tileCulling;
+    job.persistentThreads = persistentThreads;
+    job.format = string_option(options, "format", "");
+    // The server may run in another working directory
+    job.outputPath = outputPathName;
+    char workingDirectory[4096];
+    if (!outputPathName.empty() && outputPathName[0] != '/' &&
+        getcwd(workingDirectory, sizeof(workingDirectory)) != nullptr) {
+      job.outputPath = string(workingDirectory) + "/" + outputPathName;
+    }
+    if (!workerList.empty()) {
+      vector<string> workerAddresses;
+      stringstream workers(workerList);
+      string workerAddress;
+      while (getline(workers, workerAddress, ',')) {
+        if (!workerAddress.empty()) {
+          workerAddresses.push_back(workerAddress);
+        }
+      }
+      return coordinate_render(job, workerAddresses,
+                               string_option(options, "checkpoint", ""));
+    }
+    string response;
+    if (RenderServer::Submit(clientSocket, job.Serialize(), response) != 0) {
+      cout << "Could not reach the render server at " << clientSocket << endl;
+      return 1;
     }
-    // Print the name of chosen OpenCL platform
-    cout << "Using OpenCL platform: \t" << input << endl;
-    platform = platforms[input];
+    cout << response << endl;
+    return response.compare(0, 2, "ok") == 0 ? 0 : 1;
   }
 
-  unordered_map<string, cl_device_id> devices;
-  CL_ERROR_CHECK(OpenCLProgram::GetAvailableDevices(platform, devices))
-  cl_device_id device = devices.begin()->second;
+  // Sequence rendering
+  int numFrames = int_option(options, "frames", 1);
+  float orbitDegrees = float_option(options, "orbit", 1.0f);
+  // Progressive rendering with checkpoints. Resuming keeps updating the
+  // resumed checkpoint unless another path is given, and --continue-to
+  // extends it to a new total sample count.
+  string resumePath = string_option(options, "resume", "");
+  string checkpointPath = string_option(options, "checkpoint", resumePath);
+  double checkpointInterval =
+      float_option(options, "checkpoint-interval", CHECKPOINT_INTERVAL);
+  int targetSamples = int_option(options, "continue-to", ns);
+  bool progressive = !useOpenGL && !streaming && numFrames == 1 &&
+                     !checkpointPath.empty();
+  if (options.count("continue-to") && !progressive) {
+    cout << "--continue-to needs --checkpoint or --resume, and a single image "
+            "rendered without OpenGL or --stream."
+         << endl;
+    return 1;
+  }
+  Scene scene;
+  if (scene.Load(sceneName) != 0) {
+    cout << "Unknown scene " << sceneName << endl;
+    return 1;
+  }
 
-  // If necessary, ask for user input on which device to use
-  if (devices.size() > 1) {
-    cout << "Available OpenCL devices: \n\n";
-    for (auto i = devices.begin(); i != devices.end(); ++i) {
-      cout << "\t"
-           << "- " << i->first << endl;
+  Checkpoint checkpoint(sizeX, sizeY);
+  checkpoint.scene = sceneName;
+  checkpoint.depth = rayDepth;
+  checkpoint.origin = cameraOrigin;
+  checkpoint.lookAt = cameraLookAt;
+  checkpoint.fov = fov;
+  checkpoint.precision = precision;
+  checkpoint.sampleFormat = sampleFormat;
+  checkpoint.numLights = scene.NumLights();
+  if (!resumePath.empty()) {
+    string errorLog;
+    if (checkpoint.Load(resumePath, errorLog) != 0) {
+      cout << "Could not resume from " << resumePath << ": " << errorLog
+           << endl;
+      return 1;
+    }
+  }
+  // Progressive renders only keep one pass of samples on the device
+  int traceSamples = progressive ? min(targetSamples, BASE_SAMPLES) : ns;
+  // Output format, picked from the extension unless given explicitly. A
+  // single image gets every core for encoding, while sequences already
+  // encode one frame per core.
+  unique_ptr<ImageWriter> writer;
+  if (!useOpenGL && !serverMode && !settingsOnly && !streaming) {
+    writer = ImageWriter::Create(
+        string_option(options, "format", ""), outputPathName,
+        numFrames > 1 ? 1 : thread::hardware_concurrency());
+    if (!writer) {
+      cout << "Unknown output format." << endl;
+      return 1;
     }
+  }
+  // Frame stream, opened before the program is built so that a bad path fails
+  // early. Opening a named pipe waits for its reader.
+  unique_ptr<FrameStream> stream;
+  if (streaming) {
+    StreamFormat streamFormat;
+    string formatName = string_option(options, "stream-format", "y4m");
+    if (!FrameStream::ParseFormat(formatName, streamFormat)) {
+      cout << "Unknown stream format." << endl;
+      return 1;
+    }
+    stream.reset(new FrameStream(streamFormat, sizeX, sizeY,
+                                 int_option(options, "fps", 30)));
+    if (stream->Open(streamPath) != 0) {
+      cout << "Could not open the stream " << streamPath << endl;
+      return 1;
+    }
+  }
 
-    cout << endl << "Enter the name of the OpenCL device you want to use: ";
+  // Device binaries are cached between runs unless --kernel-cache is empty
+  Renderer::SetBinaryCacheDirectory(string_option(
+      options, "kernel-cache", Renderer::DefaultBinaryCacheDirectory()));
+  Renderer::SetPrintBufferStats(options.count("buffer-stats") > 0);
+
+  // Device selection. --platform narrows the candidates and --device picks
+  // one of them. Without --device the user is asked if stdin is a terminal,
+  // otherwise the fastest device is used so unattended jobs never block.
+  vector<DeviceCandidate> candidates;
+  CL_ERROR_CHECK(DeviceSelector::Enumerate(candidates))
+  if (options.count("list-devices")) {
+    DeviceSelector::PrintCandidates(candidates);
+    return 0;
+  }
+  string platformSelection = string_option(options, "platform", "");
+  if (!platformSelection.empty() &&
+      DeviceSelector::FilterPlatforms(platformSelection, candidates) != 0) {
+    cout << "No such platform: " << platformSelection << endl;
+    return 1;
+  }
+  // Frames are displayed through OpenGL interop where the device supports it
+  // and copied through the host otherwise, unless --gl-interop forces either
+  KernelFeature glInterop;
+  if (!feature_option(options, "gl-interop", glInterop)) {
+    cout << "--gl-interop is one of auto, on or off." << endl;
+    return 1;
+  }
+  if (useOpenGL && glInterop == FEATURE_ON) {
+    // Only devices that can share the window's framebuffer can display
+    candidates.erase(
+        remove_if(candidates.begin(), candidates.end(),
+                  [](const DeviceCandidate& candidate) {
+                    return OpenCLProgram::OpenGLSharingSupported(
+                               candidate.device) != CL_SUCCESS;
+                  }),
+        candidates.end());
+    if (candidates.empty()) {
+      cout << "OpenGL interop is not supported by any available device. "
+              "Use --gl-interop auto or off to copy frames through the host."
+           << endl;
+      return 1;
+    }
+  }
+  if (candidates.empty()) {
+    cout << "No OpenCL devices found." << endl;
+    return 1;
+  }
+
+  RenderSettings settings(sizeX, sizeY, traceSamples, rayDepth, CL_TRUE,
+                          sceneCache, tileCulling, sampleFormat, precision,
+                          persistentThreads);
+  if (precompile && options.count("device") == 0) {
+    return precompile_programs(candidates, settings, scene);
+  }
+
+  string deviceSelection = string_option(options, "device", "");
+  string scoreCachePath = string_option(
+      options, "device-scores", DeviceSelector::DefaultScoreCachePath());
+  DeviceCandidate selected;
+  if (deviceSelection.empty() && candidates.size() > 1 &&
+      isatty(STDIN_FILENO)) {
+    cout << "Available OpenCL devices: \n\n";
+    DeviceSelector::PrintCandidates(candidates);
+    cout << endl << "Enter the index or name of the OpenCL device you want to "
+                    "use: ";
     string input;
     cin >> input;
     // Handle incorrect user input
-    while (devices.find(input) == devices.end()) {
+    while (DeviceSelector::Select(input, candidates, scoreCachePath,
+                                  selected) != 0) {
       cin.clear();  // clear errors/bad flags on cin
       cin.ignore(cin.rdbuf()->in_avail(),
                  '\n');  // ignores exact number of chars in cin buffer
       cout << "No such device." << endl
-           << "Enter the name of the OpenCL device you want to use: ";
+           << "Enter the index or name of the OpenCL device you want to use: ";
       cin >> input;
     }
-    // Print the name of chosen OpenCL device
-    cout << "Using OpenCL device: \t" << input << endl;
-    device = devices[input];
+  } else {
+    if (deviceSelection.empty()) {
+      deviceSelection = candidates.size() > 1 ? "fastest" : "0";
+    }
+    if (DeviceSelector::Select(deviceSelection, candidates, scoreCachePath,
+                               selected) != 0) {
+      cout << "No such device: " << deviceSelection << endl;
+      return 1;
+    }
+  }
+  // Print the name of chosen OpenCL device
+  cout << "Using OpenCL device: \t" << selected.deviceName << " ("
+       << selected.platformName << ")" << endl;
+  cl_platform_id platform = selected.platform;
+  cl_device_id device = selected.device;
+
+  if (precompile) {
+    return precompile_programs({selected}, settings, scene);
+  }
+  if (benchmarkSceneCache) {
+    return benchmark_scene_cache(selected, settings);
+  }
+  if (checkSampleFormat) {
+    Camera checkCam(cameraOrigin, cameraLookAt, CLTypes::Vector3(0, 1, 0), fov,
+                    cl_float(sizeX) / cl_float(sizeY));
+    return check_sample_format(selected, settings, scene, checkCam);
+  }
+  if (checkPrecision) {
+    Camera checkCam(cameraOrigin, cameraLookAt, CLTypes::Vector3(0, 1, 0), fov,
+                    cl_float(sizeX) / cl_float(sizeY));
+    return check_precision(selected, settings, scene, checkCam,
+                           float_option(options, "max-rmse",
+                                        PRECISION_MAX_RMSE));
+  }
+  if (!convergencePath.empty()) {
+    Camera checkCam(cameraOrigin, cameraLookAt, CLTypes::Vector3(0, 1, 0), fov,
+                    cl_float(sizeX) / cl_float(sizeY));
+    // Traced in passes like progressive renders, so that the curves can go
+    // past the samples of one trace buffer
+    settings.samples = min(ns, BASE_SAMPLES);
+    vector<string> sceneNames = CONVERGENCE_SCENES;
+    if (options.count("scene")) {
+      sceneNames = {sceneName};
+    }
+    return write_convergence(
+        selected, settings, sceneNames, checkCam, ns,
+        int_option(options, "reference-samples",
+                   CONVERGENCE_REFERENCE_SAMPLES),
+        convergencePath);
+  }
+  if (serverMode) {
+    RenderServer server(platform, device);
+    server.SetAllowRemote(options.count("allow-remote") > 0);
+    server.SetOutputDirectory(string_option(options, "output-dir", ""));
+    return server.Run(serverSocket);
   }
 
   OpenGLProgram glProgram;
   std::unordered_map<cl_context_properties, cl_context_properties>
       contextProperties;
+  bool interop = useOpenGL && glInterop != FEATURE_OFF &&
+                 OpenCLProgram::OpenGLSharingSupported(device) == CL_SUCCESS;
   if (useOpenGL) {
-    // Handle OpenGL interop
-    if (OpenCLProgram::OpenGLSharingSupported(device) != CL_SUCCESS) {
-      cout << "OpenGL interop is not supported by the selected device. Please "
-              "turn off OpenGL interop or select a different device."
-           << endl;
-      return 1;
-    }
-
     // OpenGL program init
     GL_ERROR_CHECK(glProgram.Init(sizeX, sizeY))
+  }
+  if (interop) {
 #if defined(__APPLE__) || defined(MACOSX)
     CGLContextObj cglContext = CGLGetCurrentContext();
     contextProperties = {{CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE,
@@ -363,76 +1265,40 @@ int main(int argc, char* argv[]) {
 #endif
   }
 
-  // TODO: Allow scene data that is not hard-coded
-  const int sphereCount = 5;
-  CLTypes::Sphere world[sphereCount];
-  world[0] =
-      CLTypes::Sphere(CLTypes::Vector3(0, 0, -1), 0.5f,
-                      CLTypes::Lambertian(CLTypes::Vector3(0.1f, 0.2f, 0.5f)));
-  world[1] =
-      CLTypes::Sphere(CLTypes::Vector3(0, -100.5, -1), 100,
-                      CLTypes::Lambertian(CLTypes::Vector3(0.8f, 0.8f, 0.0f)));
-  world[2] =
-      CLTypes::Sphere(CLTypes::Vector3(1, 0, -1), 0.5f,
-                      CLTypes::Metal(CLTypes::Vector3(0.8f, 0.6f, 0.2f), 0.0f));
-  world[3] = CLTypes::Sphere(CLTypes::Vector3(-1, 0, -1), 0.5f,
-                             CLTypes::Dielectric(2.52));
-  world[4] = CLTypes::Sphere(CLTypes::Vector3(-1, 0, -1), -0.45f,
-                             CLTypes::Dielectric(2.52));
-
   cl_bool usePinholeCamera = CL_TRUE;
-  Camera cam(CLTypes::Vector3(0, 0, 2), CLTypes::Vector3(0, 0, -1),
-             CLTypes::Vector3(0, 1, 0), 90, cl_float(sizeX) / cl_float(sizeY),
-             usePinholeCamera);
-  CLTypes::Camera cl_cam = cam.Calculate();
-
-  const int numRaytraceElements = sizeX * sizeY * ns * 3;
-
-  // Read our program source
-  ifstream in;
-  in.open(CL_KERNEL_PATH, ifstream::in);
-  string source((istreambuf_iterator<char>(in)), (istreambuf_iterator<char>()));
-  // Set up our definitions for compilation
-  unordered_map<string, string> definitions = {
-      {WIDTH, to_string(sizeX)},
-      {HEIGHT, to_string(sizeY)},
-      {SAMPLES, to_string(ns)},
-      {DEPTH, to_string(rayDepth)},
-      {NUM_SPHERES, to_string(sphereCount)},
-      {USE_PINHOLE_CAMERA, to_string(usePinholeCamera)}};
-  // Set up include paths
-  vector<string> includePaths = {KERNEL_INCLUDE};
+  Camera cam(cameraOrigin, cameraLookAt, CLTypes::Vector3(0, 1, 0), fov,
+             cl_float(sizeX) / cl_float(sizeY), usePinholeCamera);
+
   // Initialize our OpenCL program
-  OpenCLProgram program;
+  Renderer renderer;
   {
     string errorLog;
-    if (program.Init(platform, device, source, definitions, includePaths,
-                     contextProperties, errorLog) != CL_SUCCESS) {
+    settings.usePinholeCamera = usePinholeCamera;
+    if (renderer.Init(platform, device, settings, scene.spheres,
+                      contextProperties, errorLog) != CL_SUCCESS) {
       std::cout << "Error during OpenCL program compilation! (" << errorLog
                 << ")" << std::endl;
       return 1;
     }
   }
-
-  // Set up our raytrace kernel
-  CL_ERROR_CHECK(program.LoadKernel(RAYTRACE_KERNEL))
-
-  // Arguments
-  CL_ERROR_CHECK(program.CreateBufferArgument(
-      RAYTRACE_KERNEL, 0, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-      sizeof(CLTypes::Camera), &cl_cam, nullptr));
-  CL_ERROR_CHECK(program.CreateBufferArgument(
-      RAYTRACE_KERNEL, 1, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-      sizeof(world), &world[0], nullptr));
-  cl_mem traceResultsBuffer;
-  CL_ERROR_CHECK(program.CreateBufferArgument(
-      RAYTRACE_KERNEL, 2, CL_MEM_READ_WRITE,
-      sizeof(float) * numRaytraceElements, nullptr, &traceResultsBuffer));
+  CL_ERROR_CHECK(renderer.SetCamera(cam.Calculate()))
 
   if (useOpenGL) {
-    return opengl_loop(sizeX, sizeY, ns, program, glProgram, cam,
-                       traceResultsBuffer);
+    return opengl_loop(ns, float_option(options, "target-fps", 0.0f),
+                       options.count("temporal") > 0, interop, renderer,
+                       glProgram, cam);
+  }
+  if (streaming) {
+    return render_stream(ns, numFrames, orbitDegrees, *stream, renderer, cam);
+  }
+  if (progressive) {
+    return render_progressive(traceSamples, targetSamples, checkpoint,
+                              checkpointPath, checkpointInterval,
+                              outputPathName, *writer, renderer);
+  }
+  if (numFrames > 1) {
+    return render_sequence(ns, numFrames, orbitDegrees, outputPathName,
+                           *writer, renderer, cam);
   }
-  return write_image(sizeX, sizeY, ns, outputPathName, program,
-                     traceResultsBuffer);
+  return write_image(ns, outputPathName, *writer, renderer);
 }
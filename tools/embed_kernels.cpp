@@ -0,0 +1,91 @@
+// Build step that turns the OpenCL sources into a C++ header, so the
+// raytracer does not depend on its working directory to find them.
+//
+// Usage: embed_kernels <main.cl> <include directory> <output header>
+//
+// Quoted includes are inlined recursively, each file at most once, and
+// comment-only and blank lines are dropped. Everything else, including the
+// #ifdefs on definitions passed at build time, is left for the OpenCL
+// compiler.
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+
+using namespace std;
+
+bool inline_file(const string& path, const string& includeDirectory,
+                 unordered_set<string>& included, stringstream& output) {
+  if (!included.insert(path).second) {
+    return true;
+  }
+  ifstream in(path);
+  if (!in) {
+    cout << "Could not read " << path << endl;
+    return false;
+  }
+
+  string line;
+  while (getline(in, line)) {
+    size_t start = line.find_first_not_of(" \t");
+    if (start == string::npos || line.compare(start, 2, "//") == 0) {
+      continue;
+    }
+    if (line.compare(start, 8, "#include") == 0) {
+      size_t open = line.find('"', start);
+      size_t close = line.find('"', open + 1);
+      if (open != string::npos && close != string::npos) {
+        string name = line.substr(open + 1, close - open - 1);
+        if (!inline_file(includeDirectory + "/" + name, includeDirectory,
+                         included, output)) {
+          return false;
+        }
+        continue;
+      }
+    }
+    output << line << "\n";
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 4) {
+    cout << "Usage: embed_kernels <main.cl> <include directory> "
+            "<output header>"
+         << endl;
+    return 1;
+  }
+
+  stringstream source;
+  unordered_set<string> included;
+  if (!inline_file(argv[1], argv[2], included, source)) {
+    return 1;
+  }
+
+  // Raw string literals are limited in length by some compilers, so the
+  // source is emitted as one literal per line
+  ofstream out(argv[3]);
+  out << "// Generated from " << argv[1] << " by tools/embed_kernels\n"
+      << "#ifndef EMBEDDED_KERNELS_HPP\n"
+      << "#define EMBEDDED_KERNELS_HPP\n\n"
+      << "static const char EMBEDDED_KERNEL_SOURCE[] =\n";
+  string line;
+  while (getline(source, line)) {
+    out << "    \"";
+    for (char c : line) {
+      if (c == '\\' || c == '"') {
+        out << '\\';
+      }
+      out << c;
+    }
+    out << "\\n\"\n";
+  }
+  out << "    ;\n\n#endif\n";
+  if (!out) {
+    cout << "Could not write " << argv[3] << endl;
+    return 1;
+  }
+  return 0;
+}